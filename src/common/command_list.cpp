@@ -0,0 +1,149 @@
+#include "command_list.h"
+#include "gl_state.h"
+
+namespace common
+{
+    static const char *command_names[CMD_TYPE_CNT] = {
+        "use_program", "bind_vertex_array", "bind_texture", "bind_buffer", "bind_buffer_range",
+        "bind_framebuffer", "vertex_buffer", "instance_attribs", "set_enabled", "depth_mask", "depth_func",
+        "color_mask", "cull_face", "blend_func", "viewport", "clear", "clear_buffer", "uniform_int", "uniform_uint",
+        "uniform_float", "uniform_mat4", "buffer_data", "buffer_sub_data", "blit_framebuffer", "draw_arrays",
+        "draw_elements", "draw_elements_instanced", "multi_draw_indirect", "dispatch", "memory_barrier"};
+
+    std::string CommandStats::SerializeJSON()
+    {
+        std::string ret = "{\n";
+        for (int i = 0; i < CMD_TYPE_CNT; i++)
+            ret += "\"" + std::string(command_names[i]) + "\": " + std::to_string(commands[i]) + ",\n";
+        ret += "\"draws\": " + std::to_string(draws);
+        ret += "\n}";
+        return ret;
+    }
+
+    void GLBackend::Execute(const CommandList &list)
+    {
+        auto gl = GLState::GetInstance();
+        for (auto &cmd : list.commands)
+        {
+            stats.Count(cmd);
+            auto a = cmd.args;
+            switch (cmd.type)
+            {
+            case CMD_USE_PROGRAM:
+                gl->UseProgram(a[0].u);
+                break;
+            case CMD_BIND_VERTEX_ARRAY:
+                gl->BindVertexArray(a[0].u);
+                break;
+            case CMD_BIND_TEXTURE:
+                gl->BindTexture(a[0].u, a[1].u);
+                break;
+            case CMD_BIND_BUFFER:
+                gl->BindBuffer(a[0].u, a[1].u);
+                break;
+            case CMD_BIND_BUFFER_RANGE:
+                if (a[4].u)
+                    gl->BindBufferRange(a[0].u, a[1].u, a[2].u, a[3].u, a[4].u);
+                else
+                    gl->BindBufferBase(a[0].u, a[1].u, a[2].u);
+                break;
+            case CMD_BIND_FRAMEBUFFER:
+                gl->BindFramebuffer(a[0].u);
+                break;
+            case CMD_VERTEX_BUFFER:
+                glVertexArrayVertexBuffer(a[0].u, a[1].u, a[2].u, a[3].u, a[4].u);
+                break;
+            case CMD_INSTANCE_ATTRIBS:
+                for (unsigned int i = 0; i < 4; i++)
+                {
+                    glVertexArrayAttribFormat(a[0].u, 4 + i, 4, GL_FLOAT, GL_FALSE, i * sizeof(glm::vec4));
+                    glVertexArrayAttribBinding(a[0].u, 4 + i, 4);
+                    glEnableVertexArrayAttrib(a[0].u, 4 + i);
+                }
+                glVertexArrayBindingDivisor(a[0].u, 4, 1);
+                break;
+            case CMD_SET_ENABLED:
+                gl->SetEnabled(a[0].u, a[1].u);
+                break;
+            case CMD_DEPTH_MASK:
+                gl->DepthMask(a[0].u);
+                break;
+            case CMD_DEPTH_FUNC:
+                gl->DepthFunc(a[0].u);
+                break;
+            case CMD_COLOR_MASK:
+                gl->ColorMask(a[0].u);
+                break;
+            case CMD_CULL_FACE:
+                gl->CullFace(a[0].u);
+                break;
+            case CMD_BLEND_FUNC:
+                if (a[2].u == CommandList::ALL_BUFFERS)
+                    gl->BlendFunc(a[0].u, a[1].u);
+                else
+                    gl->BlendFunc(a[2].u, a[0].u, a[1].u);
+                break;
+            case CMD_VIEWPORT:
+                // not tracked, the few per frame always reach GL
+                glViewport(a[0].i, a[1].i, a[2].i, a[3].i);
+                break;
+            case CMD_CLEAR:
+                glClearColor(a[1].f, a[2].f, a[3].f, a[4].f);
+                glClear(a[0].u);
+                break;
+            case CMD_CLEAR_BUFFER:
+                glClearNamedFramebufferfv(a[0].u, GL_COLOR, a[1].i, (const float *)cmd.data);
+                break;
+            case CMD_UNIFORM_INT:
+                glUniform1i(a[0].i, a[1].i);
+                break;
+            case CMD_UNIFORM_UINT:
+                glUniform1ui(a[0].i, a[1].u);
+                break;
+            case CMD_UNIFORM_FLOAT:
+                glUniform1f(a[0].i, a[1].f);
+                break;
+            case CMD_UNIFORM_MAT4:
+                glUniformMatrix4fv(a[0].i, 1, GL_FALSE, (const float *)cmd.data);
+                break;
+            case CMD_BUFFER_DATA:
+                glNamedBufferData(a[0].u, cmd.size, cmd.data, a[1].u);
+                break;
+            case CMD_BUFFER_SUB_DATA:
+                glNamedBufferSubData(a[0].u, a[1].u, cmd.size, cmd.data);
+                break;
+            case CMD_BLIT_FRAMEBUFFER:
+                glBlitNamedFramebuffer(a[0].u, a[1].u, 0, 0, a[2].i, a[3].i, 0, 0, a[2].i, a[3].i, a[4].u, GL_NEAREST);
+                break;
+            case CMD_DRAW_ARRAYS:
+                glDrawArrays(a[0].u, a[1].u, a[2].u);
+                break;
+            case CMD_DRAW_ELEMENTS:
+                glDrawElements(a[0].u, a[1].u, GL_UNSIGNED_INT, 0);
+                break;
+            case CMD_DRAW_ELEMENTS_INSTANCED:
+                glDrawElementsInstancedBaseInstance(a[0].u, a[1].u, GL_UNSIGNED_INT, 0, a[2].u, a[3].u);
+                break;
+            case CMD_MULTI_DRAW_INDIRECT:
+                glMultiDrawElementsIndirect(a[0].u, GL_UNSIGNED_INT, (void *)(size_t)a[1].u, a[2].u, 0);
+                break;
+            case CMD_DISPATCH:
+                glDispatchCompute(a[0].u, a[1].u, a[2].u);
+                break;
+            case CMD_MEMORY_BARRIER:
+                glMemoryBarrier(a[0].u);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    void NullBackend::Execute(const CommandList &list)
+    {
+        for (auto &cmd : list.commands)
+            stats.Count(cmd);
+        if (record)
+            recorded.commands.insert(recorded.commands.end(), list.commands.begin(), list.commands.end());
+    }
+}
@@ -0,0 +1,359 @@
+#ifndef COMMAND_LIST_H
+#define COMMAND_LIST_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace common
+{
+    enum CommandType
+    {
+        CMD_USE_PROGRAM,
+        CMD_BIND_VERTEX_ARRAY,
+        CMD_BIND_TEXTURE,
+        CMD_BIND_BUFFER,
+        CMD_BIND_BUFFER_RANGE,
+        CMD_BIND_FRAMEBUFFER,
+        CMD_VERTEX_BUFFER,
+        CMD_INSTANCE_ATTRIBS,
+        CMD_SET_ENABLED,
+        CMD_DEPTH_MASK,
+        CMD_DEPTH_FUNC,
+        CMD_COLOR_MASK,
+        CMD_CULL_FACE,
+        CMD_BLEND_FUNC,
+        CMD_VIEWPORT,
+        CMD_CLEAR,
+        CMD_CLEAR_BUFFER,
+        CMD_UNIFORM_INT,
+        CMD_UNIFORM_UINT,
+        CMD_UNIFORM_FLOAT,
+        CMD_UNIFORM_MAT4,
+        CMD_BUFFER_DATA,
+        CMD_BUFFER_SUB_DATA,
+        CMD_BLIT_FRAMEBUFFER,
+        CMD_DRAW_ARRAYS,
+        CMD_DRAW_ELEMENTS,
+        CMD_DRAW_ELEMENTS_INSTANCED,
+        CMD_MULTI_DRAW_INDIRECT,
+        CMD_DISPATCH,
+        CMD_MEMORY_BARRIER,
+        CMD_TYPE_CNT
+    };
+
+    union CommandArg
+    {
+        unsigned int u;
+        int i;
+        float f;
+    };
+
+    // One recorded call. data points at what the call reads, a matrix or
+    // buffer contents, which has to stay valid until the list is executed.
+    struct Command
+    {
+        CommandType type;
+        CommandArg args[5];
+        const void *data;
+        size_t size;
+    };
+
+    // What a frame submits to the GPU, recorded first and executed by a
+    // backend afterwards. Recording touches no GL, so everything leading up
+    // to submission runs without a context.
+    class CommandList
+    {
+    public:
+        std::vector<Command> commands;
+
+        void Clear()
+        {
+            commands.clear();
+        }
+
+        void UseProgram(unsigned int program)
+        {
+            push(CMD_USE_PROGRAM, {program});
+        }
+
+        void BindVertexArray(unsigned int vao)
+        {
+            push(CMD_BIND_VERTEX_ARRAY, {vao});
+        }
+
+        void BindTexture(unsigned int unit, unsigned int texture)
+        {
+            push(CMD_BIND_TEXTURE, {unit, texture});
+        }
+
+        void BindBuffer(GLenum target, unsigned int buffer)
+        {
+            push(CMD_BIND_BUFFER, {target, buffer});
+        }
+
+        // size 0 binds the whole buffer
+        void BindBufferRange(GLenum target, unsigned int index, unsigned int buffer, unsigned int offset, unsigned int size)
+        {
+            push(CMD_BIND_BUFFER_RANGE, {target, index, buffer, offset, size});
+        }
+
+        // 0 for the default framebuffer
+        void BindFramebuffer(unsigned int framebuffer)
+        {
+            push(CMD_BIND_FRAMEBUFFER, {framebuffer});
+        }
+
+        // Points binding of vao at buffer, as glVertexArrayVertexBuffer
+        void VertexBuffer(unsigned int vao, unsigned int binding, unsigned int buffer, unsigned int offset, unsigned int stride)
+        {
+            push(CMD_VERTEX_BUFFER, {vao, binding, buffer, offset, stride});
+        }
+
+        // Makes attributes 4 to 7 of vao read a model matrix per instance
+        // from binding 4
+        void InstanceAttribs(unsigned int vao)
+        {
+            push(CMD_INSTANCE_ATTRIBS, {vao});
+        }
+
+        void SetEnabled(GLenum cap, bool enable)
+        {
+            push(CMD_SET_ENABLED, {cap, enable});
+        }
+
+        void DepthMask(bool write)
+        {
+            push(CMD_DEPTH_MASK, {write});
+        }
+
+        void DepthFunc(GLenum func)
+        {
+            push(CMD_DEPTH_FUNC, {func});
+        }
+
+        void ColorMask(bool write)
+        {
+            push(CMD_COLOR_MASK, {write});
+        }
+
+        void CullFace(GLenum face)
+        {
+            push(CMD_CULL_FACE, {face});
+        }
+
+        static const unsigned int ALL_BUFFERS = ~0u;
+
+        // For all draw buffers or only the given one
+        void BlendFunc(GLenum src, GLenum dst, unsigned int buffer = ALL_BUFFERS)
+        {
+            push(CMD_BLEND_FUNC, {src, dst, buffer});
+        }
+
+        void Viewport(int x, int y, unsigned int width, unsigned int height)
+        {
+            push(CMD_VIEWPORT, {(unsigned int)x, (unsigned int)y, width, height});
+        }
+
+        void ClearFramebuffer(GLbitfield mask, const glm::vec4 &color)
+        {
+            Command cmd = make(CMD_CLEAR, {mask});
+            for (int i = 0; i < 4; i++)
+                cmd.args[i + 1].f = color[i];
+            commands.push_back(cmd);
+        }
+
+        // Clears one color attachment of framebuffer, color has to stay valid
+        // until the list is executed
+        void ClearBuffer(unsigned int framebuffer, unsigned int draw_buffer, const glm::vec4 &color)
+        {
+            push(CMD_CLEAR_BUFFER, {framebuffer, draw_buffer}, &color, sizeof(color));
+        }
+
+        // Uniforms of the bound program, locations below 0 are skipped
+        void Uniform(int location, int value)
+        {
+            if (location < 0)
+                return;
+            Command cmd = make(CMD_UNIFORM_INT, {});
+            cmd.args[0].i = location;
+            cmd.args[1].i = value;
+            commands.push_back(cmd);
+        }
+
+        void Uniform(int location, unsigned int value)
+        {
+            if (location >= 0)
+                push(CMD_UNIFORM_UINT, {(unsigned int)location, value});
+        }
+
+        void Uniform(int location, float value)
+        {
+            if (location < 0)
+                return;
+            Command cmd = make(CMD_UNIFORM_FLOAT, {(unsigned int)location});
+            cmd.args[1].f = value;
+            commands.push_back(cmd);
+        }
+
+        void Uniform(int location, const glm::mat4 &value)
+        {
+            if (location >= 0)
+                push(CMD_UNIFORM_MAT4, {(unsigned int)location}, &value, sizeof(value));
+        }
+
+        // Replaces the storage of buffer with size bytes of data
+        void BufferData(unsigned int buffer, const void *data, size_t size, GLenum usage)
+        {
+            push(CMD_BUFFER_DATA, {buffer, usage}, data, size);
+        }
+
+        void BufferSubData(unsigned int buffer, unsigned int offset, const void *data, size_t size)
+        {
+            push(CMD_BUFFER_SUB_DATA, {buffer, offset}, data, size);
+        }
+
+        // Copies the width by height corner of src to dst
+        void BlitFramebuffer(unsigned int src, unsigned int dst, unsigned int width, unsigned int height, GLbitfield mask)
+        {
+            push(CMD_BLIT_FRAMEBUFFER, {src, dst, width, height, mask});
+        }
+
+        void DrawArrays(GLenum mode, unsigned int first, unsigned int count)
+        {
+            push(CMD_DRAW_ARRAYS, {mode, first, count});
+        }
+
+        // Unsigned int indices from the start of the element buffer
+        void DrawElements(GLenum mode, unsigned int count)
+        {
+            push(CMD_DRAW_ELEMENTS, {mode, count});
+        }
+
+        void DrawElementsInstanced(GLenum mode, unsigned int count, unsigned int instances, unsigned int base_instance)
+        {
+            push(CMD_DRAW_ELEMENTS_INSTANCED, {mode, count, instances, base_instance});
+        }
+
+        // Commands from offset on in the bound GL_DRAW_INDIRECT_BUFFER
+        void MultiDrawIndirect(GLenum mode, unsigned int offset, unsigned int draw_cnt)
+        {
+            push(CMD_MULTI_DRAW_INDIRECT, {mode, offset, draw_cnt});
+        }
+
+        void Dispatch(unsigned int x, unsigned int y, unsigned int z)
+        {
+            push(CMD_DISPATCH, {x, y, z});
+        }
+
+        // glMemoryBarrier, named so it does not clash with the winnt.h macro
+        void Barrier(GLbitfield barriers)
+        {
+            push(CMD_MEMORY_BARRIER, {barriers});
+        }
+
+    private:
+        static Command make(CommandType type, std::initializer_list<unsigned int> args, const void *data = nullptr, size_t size = 0)
+        {
+            Command cmd{type, {}, data, size};
+            unsigned int i = 0;
+            for (unsigned int arg : args)
+                cmd.args[i++].u = arg;
+            return cmd;
+        }
+
+        void push(CommandType type, std::initializer_list<unsigned int> args, const void *data = nullptr, size_t size = 0)
+        {
+            commands.push_back(make(type, args, data, size));
+        }
+    };
+
+    // Commands of each type a backend was given, and draw calls among them
+    struct CommandStats
+    {
+        unsigned int commands[CMD_TYPE_CNT];
+        unsigned int draws;
+
+        CommandStats() : commands(), draws(0) {}
+
+        void Count(const Command &cmd)
+        {
+            commands[cmd.type]++;
+            draws += cmd.type >= CMD_DRAW_ARRAYS && cmd.type <= CMD_MULTI_DRAW_INDIRECT;
+        }
+
+        unsigned int Total() const
+        {
+            unsigned int ret = 0;
+            for (auto cnt : commands)
+                ret += cnt;
+            return ret;
+        }
+
+        std::string SerializeJSON();
+    };
+
+    // Where recorded lists end up
+    class Backend
+    {
+    public:
+        virtual ~Backend() {}
+
+        virtual void Execute(const CommandList &list) = 0;
+
+        // true when there is no GPU behind it, so GL resources are not made
+        virtual bool Headless() const
+        {
+            return false;
+        }
+
+        // Counters since the last call
+        CommandStats TakeStats()
+        {
+            CommandStats ret = stats;
+            stats = CommandStats();
+            return ret;
+        }
+
+    protected:
+        CommandStats stats;
+    };
+
+    // Issues the commands to the current context, state changes through
+    // GLState so redundant ones are dropped
+    class GLBackend : public Backend
+    {
+    public:
+        virtual void Execute(const CommandList &list);
+    };
+
+    // Issues nothing. Commands are counted, and kept when recording is on,
+    // to be looked at or replayed into another backend later. Data the
+    // commands point at is not copied.
+    class NullBackend : public Backend
+    {
+    public:
+        CommandList recorded;
+
+        NullBackend(bool record = false) : record(record) {}
+
+        virtual void Execute(const CommandList &list);
+
+        virtual bool Headless() const
+        {
+            return true;
+        }
+
+        void Replay(Backend &backend)
+        {
+            backend.Execute(recorded);
+        }
+
+    private:
+        bool record;
+    };
+}
+
+#endif
@@ -1,6 +1,29 @@
 #include "common.h"
+#include "thread_pool.h"
 
 namespace common
 {
+    ThreadPool *ThreadPool::instance = nullptr;
+    unsigned int ShaderProgram::sort_cnt = 0;
+    unsigned int Material::sort_cnt = 0;
+    unsigned int ModelMesh::sort_cnt = 0;
+    GLState *GLState::instance = nullptr;
+
+    std::string GLStateStats::SerializeJSON()
+    {
+        std::string ret = "{\n";
+        ret += "\"programs\": " + std::to_string(programs) + ",\n";
+        ret += "\"programs_skipped\": " + std::to_string(programs_skipped) + ",\n";
+        ret += "\"vertex_arrays\": " + std::to_string(vertex_arrays) + ",\n";
+        ret += "\"vertex_arrays_skipped\": " + std::to_string(vertex_arrays_skipped) + ",\n";
+        ret += "\"textures\": " + std::to_string(textures) + ",\n";
+        ret += "\"textures_skipped\": " + std::to_string(textures_skipped) + ",\n";
+        ret += "\"buffers\": " + std::to_string(buffers) + ",\n";
+        ret += "\"buffers_skipped\": " + std::to_string(buffers_skipped) + ",\n";
+        ret += "\"states\": " + std::to_string(states) + ",\n";
+        ret += "\"states_skipped\": " + std::to_string(states_skipped);
+        ret += "\n}";
+        return ret;
+    }
 
 } // namespace common
@@ -23,6 +23,8 @@
 #include "json.hpp"
 #include "../resource/resource.h"
 #include "ds.h"
+#include "gl_state.h"
+#include "command_list.h"
 
 namespace common
 {
@@ -70,74 +72,182 @@ namespace common
         }
     };
 
-    struct ShaderProgram : public resources::SerializableObject
+    // Uniforms and blocks of a linked program, read once after linking so
+    // that draws set uniforms by location and never look a name up
+    struct ProgramLayout
     {
-        unsigned int shader;
+        struct Uniform
+        {
+            std::string name;
+            int location;
+            GLenum type;
+            int size;
+        };
 
-        ShaderProgram() {}
-        ShaderProgram(Shader &&vs, Shader &&fs)
+        struct Block
         {
-            init(std::move(vs), std::move(fs));
-        }
+            std::string name;
+            int binding;
+            bool storage;
+        };
 
-        ShaderProgram(Shader &&vs)
+        unsigned int program;
+        std::vector<Uniform> uniforms;
+        std::vector<Block> blocks;
+        // uniforms the renderer sets per draw, -1 when the program has none
+        int model;
+        int draw_id;
+
+        ProgramLayout() : program(0), model(-1), draw_id(-1) {}
+
+        void Reflect(unsigned int program)
         {
-            shader = glCreateProgram();
-            glAttachShader(shader, vs.shader);
-            glLinkProgram(shader);
-            int success;
-            char infoLog[512];
-            glGetProgramiv(shader, GL_LINK_STATUS, &success);
-            if (!success)
+            this->program = program;
+            uniforms.clear();
+            blocks.clear();
+            char name[256];
+            int cnt = 0;
+            glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &cnt);
+            for (int i = 0; i < cnt; i++)
             {
-                glGetProgramInfoLog(shader, 512, NULL, infoLog);
-                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
-                          << infoLog << std::endl;
+                Uniform u;
+                glGetActiveUniform(program, i, sizeof(name), NULL, &u.size, &u.type, name);
+                u.location = glGetUniformLocation(program, name);
+                // members of blocks have no location
+                if (u.location < 0)
+                    continue;
+                u.name = name;
+                // arrays are reported as name[0]
+                if (u.name.size() > 3 && u.name.compare(u.name.size() - 3, 3, "[0]") == 0)
+                    u.name.resize(u.name.size() - 3);
+                uniforms.push_back(u);
             }
+            glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &cnt);
+            for (int i = 0; i < cnt; i++)
+            {
+                Block b{"", 0, false};
+                glGetActiveUniformBlockName(program, i, sizeof(name), NULL, name);
+                glGetActiveUniformBlockiv(program, i, GL_UNIFORM_BLOCK_BINDING, &b.binding);
+                b.name = name;
+                blocks.push_back(b);
+            }
+            glGetProgramInterfaceiv(program, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &cnt);
+            for (int i = 0; i < cnt; i++)
+            {
+                Block b{"", 0, true};
+                GLenum prop = GL_BUFFER_BINDING;
+                glGetProgramResourceName(program, GL_SHADER_STORAGE_BLOCK, i, sizeof(name), NULL, name);
+                glGetProgramResourceiv(program, GL_SHADER_STORAGE_BLOCK, i, 1, &prop, 1, NULL, &b.binding);
+                b.name = name;
+                blocks.push_back(b);
+            }
+            model = Location("model");
+            draw_id = Location("draw_id");
+        }
 
+        // Location of a uniform by name, -1 if the program has none. For
+        // setting up materials, not for draws.
+        int Location(const std::string &name) const
+        {
+            for (auto &u : uniforms)
+                if (u.name == name)
+                    return u.location;
+            return -1;
+        }
+    };
+
+    struct ShaderProgram : public resources::SerializableObject
+    {
+        unsigned int shader;
+        // same program with the model matrix read per instance, 0 when
+        // there is none and the objects are drawn one by one
+        unsigned int instanced;
+        // dense id for draw sorting
+        unsigned int sort_id;
+        ProgramLayout layout;
+        ProgramLayout instanced_layout;
+
+        ShaderProgram() : shader(0), instanced(0), sort_id(sort_cnt++) {}
+        ShaderProgram(Shader &&vs, Shader &&fs) : instanced(0), sort_id(sort_cnt++)
+        {
+            init(std::move(vs), std::move(fs));
+        }
+
+        ShaderProgram(Shader &&vs) : instanced(0), sort_id(sort_cnt++)
+        {
+            shader = link(vs, nullptr);
+            layout.Reflect(shader);
             vs.Dispose();
         }
 
         void Dispose()
         {
             glDeleteProgram(shader);
+            if (instanced)
+                glDeleteProgram(instanced);
         }
 
         void init(Shader &&vs, Shader &&fs)
         {
-            shader = glCreateProgram();
-            glAttachShader(shader, vs.shader);
-            glAttachShader(shader, fs.shader);
-            glLinkProgram(shader);
-
-            int success;
-            char infoLog[512];
-            glGetProgramiv(shader, GL_LINK_STATUS, &success);
-            if (!success)
-            {
-                glGetProgramInfoLog(shader, 512, NULL, infoLog);
-                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
-                          << infoLog << std::endl;
-            }
-
+            shader = link(vs, &fs);
+            layout.Reflect(shader);
             vs.Dispose();
             fs.Dispose();
         }
 
+        // Links the instanced program, fs is null for depth only programs
+        void InitInstanced(Shader &&vs, Shader *fs = nullptr)
+        {
+            instanced = link(vs, fs);
+            instanced_layout.Reflect(instanced);
+            vs.Dispose();
+        }
+
+        // "instanced_vertex" optionally names the vertex shader of the
+        // instanced program, which takes the model matrix as attribute 4
         virtual void UnserializeJSON(std::string s)
         {
             auto j = nlohmann::json::parse(s);
             std::string vpth = j["vertex"].get<std::string>();
             std::string fpth = j["fragment"].get<std::string>();
 
+            if (j.find("instanced_vertex") != j.end())
+            {
+                Shader fs(fpth, FRAGMENT_SHADER);
+                InitInstanced(Shader(j["instanced_vertex"].get<std::string>(), VERTEX_SHADER), &fs);
+                fs.Dispose();
+            }
             init(Shader(vpth, VERTEX_SHADER), Shader(fpth, FRAGMENT_SHADER));
         }
+
+    private:
+        static unsigned int sort_cnt;
+
+        static unsigned int link(Shader &vs, Shader *fs)
+        {
+            unsigned int program = glCreateProgram();
+            glAttachShader(program, vs.shader);
+            if (fs)
+                glAttachShader(program, fs->shader);
+            glLinkProgram(program);
+
+            int success;
+            char infoLog[512];
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            if (!success)
+            {
+                glGetProgramInfoLog(program, 512, NULL, infoLog);
+                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n"
+                          << infoLog << std::endl;
+            }
+            return program;
+        }
     };
 
     struct ComputeShaderProgram
     {
         unsigned int shader;
-        ComputeShaderProgram() {}
+        ComputeShaderProgram() : shader(0) {}
         ComputeShaderProgram(std::string pth)
         {
             shader = glCreateProgram();
@@ -286,37 +396,71 @@ namespace common
 
     struct RenderArguments
     {
-        RenderArguments() {}
-        RenderArguments(glm::mat4 model) : model(model) {}
+        RenderArguments() : contribution_threshold(-1.0f) {}
+        RenderArguments(glm::mat4 model) : model(model), contribution_threshold(-1.0f) {}
 
         glm::mat4 model;
         BoundingBox box;
+        // screen area in pixels below which the object is not drawn in any
+        // pass, negative to use the thresholds of the renderer
+        float contribution_threshold;
 
-        virtual void PrepareForDraw(unsigned int shader_id)
+        // The renderer passes the model to its shaders through the draw
+        // data of the frame, only programs with a model uniform get it here
+        virtual void PrepareForDraw(CommandList &cmds, const ProgramLayout &layout)
         {
-            unsigned int modelLoc = glGetUniformLocation(shader_id, "model");
-            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+            cmds.Uniform(layout.model, model);
         }
     };
 
+    // Material::render_mode, how the renderer draws objects of a material
+    enum MaterialRenderMode
+    {
+        RENDER_MODE_OPAQUE,
+        // blended back to front after the opaque objects
+        RENDER_MODE_TRANSPARENT,
+        // blended in any order with weighted blended order independent
+        // transparency, for many overlapping objects like particles
+        RENDER_MODE_WEIGHTED
+    };
+
     struct Material
     {
-        Material()
+        Material() : sort_id(sort_cnt++)
+        {
+            material_id = render_mode = RENDER_MODE_OPAQUE;
+        }
+        Material(std::shared_ptr<ShaderProgram> shader, unsigned int material_id)
+            : shader(shader), material_id(material_id), render_mode(RENDER_MODE_OPAQUE), sort_id(sort_cnt++) {}
+
+        virtual void PrepareForDraw(CommandList &cmds)
+        {
+            cmds.UseProgram(shader->shader);
+        }
+
+        // Materials that can bind the instanced program of their shader
+        // with the same textures and values draw their objects in batches
+        virtual bool Instanceable()
         {
-            material_id = render_mode = 0;
+            return false;
         }
-        Material(std::shared_ptr<ShaderProgram> shader, unsigned int material_id) : shader(shader), material_id(material_id) {}
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForInstancedDraw(CommandList &cmds)
         {
-            glUseProgram(shader->shader);
+            cmds.UseProgram(shader->instanced);
         }
 
         virtual void Dispose() {}
 
         std::shared_ptr<ShaderProgram> shader;
         unsigned int material_id;
+        // a MaterialRenderMode
         unsigned int render_mode;
+        // dense id for draw sorting, unlike material_id always unique
+        unsigned int sort_id;
+
+    private:
+        static unsigned int sort_cnt;
     };
 
     // TODO layout description
@@ -330,8 +474,8 @@ namespace common
 
     struct ModelMesh : public resources::SerializableObject
     {
-        ModelMesh() {}
-        ModelMesh(std::string pth)
+        ModelMesh() : vao(0), vbo(0), ebo(0), sort_id(sort_cnt++), instance_attribs(false) {}
+        ModelMesh(std::string pth) : sort_id(sort_cnt++), instance_attribs(false)
         {
             init(pth);
         }
@@ -418,9 +562,10 @@ namespace common
             glGenBuffers(1, &vbo);
             glGenBuffers(1, &ebo);
 
-            glBindVertexArray(vao);
+            auto gl = GLState::GetInstance();
+            gl->BindVertexArray(vao);
 
-            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            gl->BindBuffer(GL_ARRAY_BUFFER, vbo);
             glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(VertexProperties), vertices.data(), GL_DYNAMIC_DRAW);
 
             glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
@@ -438,8 +583,8 @@ namespace common
             glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(VertexProperties), (void *)(9 * sizeof(float)));
             glEnableVertexAttribArray(3);
 
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-            glBindVertexArray(0);
+            gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+            gl->BindVertexArray(0);
         }
 
         void Dispose()
@@ -449,9 +594,9 @@ namespace common
             glDeleteBuffers(1, &ebo);
         }
 
-        void PrepareForDraw()
+        void PrepareForDraw(CommandList &cmds)
         {
-            glBindVertexArray(vao);
+            cmds.BindVertexArray(vao);
         }
 
         std::vector<VertexProperties> vertices;
@@ -464,6 +609,13 @@ namespace common
         unsigned int vbo;
         unsigned int ebo;
         BoundingBox box;
+        // dense id for draw sorting
+        unsigned int sort_id;
+        // whether the vao reads attributes 4 to 7 per instance from binding 4
+        bool instance_attribs;
+
+    private:
+        static unsigned int sort_cnt;
     };
 
 }
@@ -6,6 +6,8 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include <memory>
+#include <vector>
+#include <algorithm>
 
 namespace common
 {
@@ -15,6 +17,34 @@ namespace common
         return a.x <= b.x && a.y <= b.y && a.z <= b.z;
     }
 
+    inline bool BoxOverlap(const glm::vec3 &min0, const glm::vec3 &max0, const glm::vec3 &min1, const glm::vec3 &max1)
+    {
+        return min0.x <= max1.x && min1.x <= max0.x &&
+               min0.y <= max1.y && min1.y <= max0.y &&
+               min0.z <= max1.z && min1.z <= max0.z;
+    }
+
+    inline float BoxSqDistance(const glm::vec3 &min, const glm::vec3 &max, const glm::vec3 &p)
+    {
+        glm::vec3 d = glm::max(glm::max(min - p, p - max), glm::vec3(0.0f));
+        return glm::dot(d, d);
+    }
+
+    // Slab test, t receives the entry distance, which is 0 when origin is inside
+    inline bool RayBoxIntersect(const glm::vec3 &min, const glm::vec3 &max,
+                                const glm::vec3 &origin, const glm::vec3 &inv_dir,
+                                float max_t, float &t)
+    {
+        glm::vec3 t0 = (min - origin) * inv_dir;
+        glm::vec3 t1 = (max - origin) * inv_dir;
+        glm::vec3 tn = glm::min(t0, t1);
+        glm::vec3 tf = glm::max(t0, t1);
+        float tnear = std::max(std::max(tn.x, tn.y), std::max(tn.z, 0.0f));
+        float tfar = std::min(std::min(tf.x, tf.y), std::min(tf.z, max_t));
+        t = tnear;
+        return tnear <= tfar;
+    }
+
     struct Plane
     {
         glm::vec3 pos;
@@ -81,44 +111,151 @@ namespace common
         }
     };
 
-    // TODO memory management
+    struct SortEntry
+    {
+        unsigned long long key;
+        unsigned int value;
+    };
+
+    // LSD radix sort on the lowest key_bits bits of the keys, 8 bits per pass.
+    // Stable and allocation free, scratch must hold n entries. Returns the
+    // buffer that holds the sorted result, which is either data or scratch.
+    inline SortEntry *RadixSort(SortEntry *data, SortEntry *scratch, size_t n, unsigned int key_bits)
+    {
+        size_t cnt[256];
+        if (!n)
+            return data;
+        for (unsigned int shift = 0; shift < key_bits; shift += 8)
+        {
+            std::fill(cnt, cnt + 256, 0);
+            for (size_t i = 0; i < n; i++)
+                cnt[(data[i].key >> shift) & 0xff]++;
+            // all keys share this digit, the pass would not change the order
+            if (cnt[(data[0].key >> shift) & 0xff] == n)
+                continue;
+            size_t sum = 0;
+            for (int i = 0; i < 256; i++)
+            {
+                size_t c = cnt[i];
+                cnt[i] = sum;
+                sum += c;
+            }
+            for (size_t i = 0; i < n; i++)
+                scratch[cnt[(data[i].key >> shift) & 0xff]++] = data[i];
+            std::swap(data, scratch);
+        }
+        return data;
+    }
+
+    // Spreads the lowest 21 bits of x so that there are two zero bits between each
+    inline unsigned long long MortonSpread(unsigned int x)
+    {
+        unsigned long long v = x & 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    // Every 3 bit group is x << 2 | y << 1 | z, the same order as octree children
+    inline unsigned long long MortonEncode(unsigned int x, unsigned int y, unsigned int z)
+    {
+        return MortonSpread(x) << 2 | MortonSpread(y) << 1 | MortonSpread(z);
+    }
+
+    typedef unsigned int oct_idx;
+    const oct_idx OCT_NULL = 0xffffffff;
+
     template <class Ttag, class Tcontent>
     struct OctNode
     {
-        unsigned int depth;
-        std::shared_ptr<OctNode<Ttag, Tcontent>> subnodes[8];
-        std::shared_ptr<OctNode<Ttag, Tcontent>> father;
+        int depth; // the initial root is at depth 0, grown roots go negative
+        oct_idx subnodes; // first of the 8 children, which are stored contiguously
+        oct_idx father;
         BoundingBox box;
         Ttag tag;
         Tcontent content;
 
         OctNode()
         {
-            for (int i = 0; i < 8; i++)
-                subnodes[i] = nullptr;
-            father = nullptr;
+            subnodes = father = OCT_NULL;
             depth = 0;
         }
-        OctNode(BoundingBox box, unsigned int depth) : box(box), depth(depth)
+        OctNode(BoundingBox box, int depth) : depth(depth), box(box)
+        {
+            subnodes = father = OCT_NULL;
+        }
+
+        bool IsLeaf() const
+        {
+            return subnodes == OCT_NULL;
+        }
+    };
+
+    // Pool backed octree. Nodes are addressed by 32-bit indices and stored in
+    // fixed size pages, so a split never moves existing nodes. The root is
+    // node 0, children of a node are allocated as one block of 8, and blocks
+    // released by Collapse are kept in a free list for later splits.
+    template <class Ttag, class Tcontent>
+    class OctTree
+    {
+    public:
+        typedef OctNode<Ttag, Tcontent> node_type;
+
+        static const unsigned int PAGE_SHIFT = 10;
+        static const oct_idx PAGE_SIZE = 1 << PAGE_SHIFT;
+
+        OctTree() : block_cnt(0) {}
+        OctTree(BoundingBox box) { Reset(box); }
+
+        void Reset(BoundingBox box)
+        {
+            pages.clear();
+            free_blocks.clear();
+            // block 0 is reserved for the root, its other 7 slots stay unused
+            block_cnt = 1;
+            pages.emplace_back(new node_type[PAGE_SIZE]);
+            (*this)[Root()] = node_type(box, 0);
+        }
+
+        node_type &operator[](oct_idx idx)
+        {
+            return pages[idx >> PAGE_SHIFT][idx & (PAGE_SIZE - 1)];
+        }
+
+        const node_type &operator[](oct_idx idx) const
+        {
+            return pages[idx >> PAGE_SHIFT][idx & (PAGE_SIZE - 1)];
+        }
+
+        oct_idx Root() const
+        {
+            return 0;
+        }
+
+        unsigned int NodeCount() const
         {
-            for (int i = 0; i < 8; i++)
-                subnodes[i] = nullptr;
-            father = nullptr;
+            return (block_cnt - 1 - free_blocks.size()) * 8 + 1;
         }
 
-        int SubNodeTest(BoundingBox &ano)
+        int SubNodeTest(oct_idx now, BoundingBox &ano)
         {
+            node_type &node = (*this)[now];
+            BoundingBox &box = node.box;
             if (box.Test(ano) == BoundingBox::BOX_INV_INCLUDE)
                 return -1;
             glm::vec3 &min = ano.min;
             glm::vec3 &max = ano.max;
             int idx = 0;
-            if (subnodes[0] != nullptr)
+            if (!node.IsLeaf())
             {
-                idx += max.x <= subnodes[0]->box.max.x ? 0 : 4;
-                idx += max.y <= subnodes[0]->box.max.y ? 0 : 2;
-                idx += max.z <= subnodes[0]->box.max.z ? 0 : 1;
-                if (subnodes[idx]->box.LooseTest(ano) == BoundingBox::BOX_INCLUDE)
+                BoundingBox &sbox = (*this)[node.subnodes].box;
+                idx += max.x <= sbox.max.x ? 0 : 4;
+                idx += max.y <= sbox.max.y ? 0 : 2;
+                idx += max.z <= sbox.max.z ? 0 : 1;
+                if ((*this)[node.subnodes + idx].box.LooseTest(ano) == BoundingBox::BOX_INCLUDE)
                     return idx;
                 return -1;
             }
@@ -166,23 +303,410 @@ namespace common
             return -1;
         }
 
-        void Split()
+        oct_idx Split(oct_idx now)
         {
-            auto &min = box.min;
-            auto &max = box.max;
+            oct_idx first = alloc_block();
+            node_type &node = (*this)[now];
+            auto &min = node.box.min;
+            auto &max = node.box.max;
             float x[3] = {min.x, (min.x + max.x) * 0.5f, max.x};
             float y[3] = {min.y, (min.y + max.y) * 0.5f, max.y};
             float z[3] = {min.z, (min.z + max.z) * 0.5f, max.z};
-            float f = box.loose_factor;
+            float f = node.box.loose_factor;
             for (int i = 0; i < 2; i++)
                 for (int j = 0; j < 2; j++)
                     for (int k = 0; k < 2; k++)
-                        subnodes[(i << 2) | (j << 1) | k] = std::make_shared<OctNode<Ttag, Tcontent>>(
+                    {
+                        node_type &sub = (*this)[first + ((i << 2) | (j << 1) | k)];
+                        sub = node_type(
                             BoundingBox(glm::vec3(x[i], y[j], z[k]), glm::vec3(x[i + 1], y[j + 1], z[k + 1]), f),
-                            depth + 1);
+                            node.depth + 1);
+                        sub.father = now;
+                    }
+            node.subnodes = first;
+            return first;
         }
 
-        void Dispose() {}
+        // Doubles the root toward the side of box that lies further outside.
+        // The old root keeps its subtree and becomes a child of the new root,
+        // returns the index it was moved to.
+        oct_idx Grow(BoundingBox &box)
+        {
+            oct_idx first = alloc_block();
+            node_type &root = (*this)[Root()];
+            glm::vec3 &min = root.box.min;
+            glm::vec3 &max = root.box.max;
+            float b[3][3];
+            int idx = 0;
+            for (int i = 0; i < 3; i++)
+            {
+                float size = max[i] - min[i];
+                if (min[i] - box.min[i] > box.max[i] - max[i])
+                {
+                    idx |= 4 >> i;
+                    b[i][0] = min[i] - size, b[i][1] = min[i], b[i][2] = max[i];
+                }
+                else
+                    b[i][0] = min[i], b[i][1] = max[i], b[i][2] = max[i] + size;
+            }
+
+            oct_idx moved = first + idx;
+            node_type &old = (*this)[moved];
+            old = std::move(root);
+            old.father = Root();
+            if (!old.IsLeaf())
+                for (oct_idx i = 0; i < 8; i++)
+                    (*this)[old.subnodes + i].father = moved;
+
+            float f = old.box.loose_factor;
+            root = node_type(BoundingBox(glm::vec3(b[0][0], b[1][0], b[2][0]), glm::vec3(b[0][2], b[1][2], b[2][2]), f), old.depth - 1);
+            root.subnodes = first;
+            for (int i = 0; i < 2; i++)
+                for (int j = 0; j < 2; j++)
+                    for (int k = 0; k < 2; k++)
+                    {
+                        oct_idx sub = first + ((i << 2) | (j << 1) | k);
+                        if (sub == moved)
+                            continue;
+                        (*this)[sub] = node_type(
+                            BoundingBox(glm::vec3(b[0][i], b[1][j], b[2][k]), glm::vec3(b[0][i + 1], b[1][j + 1], b[2][k + 1]), f),
+                            old.depth);
+                        (*this)[sub].father = Root();
+                    }
+            return moved;
+        }
+
+        // Releases every descendant of now, now itself becomes a leaf
+        void Collapse(oct_idx now)
+        {
+            node_type &node = (*this)[now];
+            if (node.IsLeaf())
+                return;
+            oct_idx first = node.subnodes;
+            for (oct_idx i = 0; i < 8; i++)
+            {
+                Collapse(first + i);
+                (*this)[first + i] = node_type();
+            }
+            free_blocks.push_back(first);
+            node.subnodes = OCT_NULL;
+        }
+
+    private:
+        std::vector<std::unique_ptr<node_type[]>> pages;
+        std::vector<oct_idx> free_blocks;
+        oct_idx block_cnt;
+
+        oct_idx alloc_block()
+        {
+            if (!free_blocks.empty())
+            {
+                oct_idx ret = free_blocks.back();
+                free_blocks.pop_back();
+                return ret;
+            }
+            oct_idx ret = block_cnt++ * 8;
+            if ((ret >> PAGE_SHIFT) >= pages.size())
+                pages.emplace_back(new node_type[PAGE_SIZE]);
+            return ret;
+        }
+    };
+
+    inline float SurfaceArea(const glm::vec3 &min, const glm::vec3 &max)
+    {
+        glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    const oct_idx BVH_LEAF = OCT_NULL;
+
+    struct BVHNode
+    {
+        BoundingBox box;
+        // children are left and left + 1, BVH_LEAF for leaves
+        oct_idx left;
+        oct_idx father;
+        // the primitives of the subtree lie in [first, end), a leaf keeps its
+        // live ones in [first, first + count) and the removed ones behind them
+        unsigned int first;
+        unsigned int end;
+        unsigned int count;
+        // surface area of box when the subtree was built
+        float build_area;
+
+        bool IsLeaf() const
+        {
+            return left == BVH_LEAF;
+        }
+    };
+
+    // Binary SAH BVH over the boxes of a primitive array owned by the caller.
+    // The tree only permutes an index array, the owner reorders its primitives
+    // to match, so that every leaf refers to a contiguous range of them.
+    class BVH
+    {
+    public:
+        static const unsigned int BIN_CNT = 16;
+        static const unsigned int MAX_LEAF = 8;
+
+        BVH() { Clear(); }
+
+        void Clear()
+        {
+            nodes.assign(1, BVHNode());
+            free_pairs.clear();
+            BVHNode &root = nodes[Root()];
+            root.left = BVH_LEAF;
+            root.father = OCT_NULL;
+            root.first = root.end = root.count = 0;
+            set_box(root, glm::vec3(1e30f), glm::vec3(-1e30f));
+            root.box.loose_factor = 1.0f;
+            root.build_area = 0.0f;
+        }
+
+        BVHNode &operator[](oct_idx idx)
+        {
+            return nodes[idx];
+        }
+
+        const BVHNode &operator[](oct_idx idx) const
+        {
+            return nodes[idx];
+        }
+
+        oct_idx Root() const
+        {
+            return 0;
+        }
+
+        unsigned int NodeCount() const
+        {
+            return nodes.size() - free_pairs.size() * 2;
+        }
+
+        // Node indices are below this, for arrays kept next to the tree
+        unsigned int IndexBound() const
+        {
+            return nodes.size();
+        }
+
+        // Builds the tree over boxes[0, cnt). order must hold cnt entries and
+        // receives the new order, the primitive for slot i was at order[i].
+        void Build(const BoundingBox *boxes, unsigned int *order, unsigned int cnt)
+        {
+            Clear();
+            for (unsigned int i = 0; i < cnt; i++)
+                order[i] = i;
+            build_node(Root(), boxes, order, 0, cnt);
+        }
+
+        // Rebuilds the subtree of now from its live primitives, which move to
+        // the front of its range. order is filled for that part of the range
+        // as in Build, the rest of the range is empty. Returns the live count.
+        unsigned int BuildSubtree(oct_idx now, const BoundingBox *boxes, unsigned int *order)
+        {
+            unsigned int first = nodes[now].first;
+            unsigned int end = nodes[now].end;
+            unsigned int live = first;
+            gather_live(now, order, live);
+            release(now);
+            build_node(now, boxes, order, first, live);
+            nodes[now].end = end;
+            return live - first;
+        }
+
+        // Recomputes the boxes of now and its subtree from the primitive boxes
+        void Refit(oct_idx now, const BoundingBox *boxes)
+        {
+            BVHNode &node = nodes[now];
+            if (node.IsLeaf())
+                return fit_leaf(node, boxes);
+            Refit(node.left, boxes);
+            Refit(node.left + 1, boxes);
+            fit_inner(node);
+        }
+
+        // Recomputes the box of leaf and of its ancestors
+        void RefitUp(oct_idx leaf, const BoundingBox *boxes)
+        {
+            fit_leaf(nodes[leaf], boxes);
+            for (oct_idx now = nodes[leaf].father; now != OCT_NULL; now = nodes[now].father)
+                fit_inner(nodes[now]);
+        }
+
+        // Collects the highest nodes whose surface area has grown above
+        // factor times the area they were built with
+        void FindDegraded(oct_idx now, float factor, std::vector<oct_idx> &out)
+        {
+            BVHNode &node = nodes[now];
+            if (node.IsLeaf())
+                return;
+            if (SurfaceArea(node.box.min, node.box.max) > node.build_area * factor)
+            {
+                out.push_back(now);
+                return;
+            }
+            FindDegraded(node.left, factor, out);
+            FindDegraded(node.left + 1, factor, out);
+        }
+
+    private:
+        std::vector<BVHNode> nodes;
+        std::vector<oct_idx> free_pairs;
+
+        oct_idx alloc_pair()
+        {
+            if (!free_pairs.empty())
+            {
+                oct_idx ret = free_pairs.back();
+                free_pairs.pop_back();
+                return ret;
+            }
+            nodes.resize(nodes.size() + 2);
+            return nodes.size() - 2;
+        }
+
+        void release(oct_idx now)
+        {
+            oct_idx left = nodes[now].left;
+            if (left == BVH_LEAF)
+                return;
+            release(left);
+            release(left + 1);
+            free_pairs.push_back(left);
+            nodes[now].left = BVH_LEAF;
+        }
+
+        void gather_live(oct_idx now, unsigned int *order, unsigned int &cnt)
+        {
+            BVHNode &node = nodes[now];
+            if (!node.IsLeaf())
+            {
+                gather_live(node.left, order, cnt);
+                gather_live(node.left + 1, order, cnt);
+                return;
+            }
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+                order[cnt++] = i;
+        }
+
+        static void set_box(BVHNode &node, const glm::vec3 &min, const glm::vec3 &max)
+        {
+            node.box.min = node.box.loose_min = min;
+            node.box.max = node.box.loose_max = max;
+        }
+
+        static void fit_leaf(BVHNode &node, const BoundingBox *boxes)
+        {
+            glm::vec3 min(1e30f), max(-1e30f);
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+            {
+                min = glm::min(min, boxes[i].min);
+                max = glm::max(max, boxes[i].max);
+            }
+            set_box(node, min, max);
+        }
+
+        void fit_inner(BVHNode &node)
+        {
+            BVHNode &l = nodes[node.left];
+            BVHNode &r = nodes[node.left + 1];
+            set_box(node, glm::min(l.box.min, r.box.min), glm::max(l.box.max, r.box.max));
+        }
+
+        // Bins the box centers along the axis where they spread the most and
+        // splits at the bin border with the lowest surface area heuristic cost.
+        // Small nodes stay leaves when testing all their boxes is cheaper.
+        void build_node(oct_idx now, const BoundingBox *boxes, unsigned int *order, unsigned int first, unsigned int end)
+        {
+            glm::vec3 min(1e30f), max(-1e30f), cmin(1e30f), cmax(-1e30f);
+            for (unsigned int i = first; i < end; i++)
+            {
+                const BoundingBox &box = boxes[order[i]];
+                min = glm::min(min, box.min);
+                max = glm::max(max, box.max);
+                cmin = glm::min(cmin, box.min + box.max);
+                cmax = glm::max(cmax, box.min + box.max);
+            }
+            BVHNode &node = nodes[now];
+            set_box(node, min, max);
+            node.box.loose_factor = 1.0f;
+            node.left = BVH_LEAF;
+            node.first = first;
+            node.end = end;
+            node.count = end - first;
+            node.build_area = SurfaceArea(min, max);
+            unsigned int cnt = end - first;
+            if (cnt <= 2)
+                return;
+
+            glm::vec3 extent = cmax - cmin;
+            int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+            unsigned int mid = first + cnt / 2;
+            if (extent[axis] > 0.0f)
+            {
+                float scale = BIN_CNT * 0.9999f / extent[axis];
+                float base = cmin[axis];
+                auto bin_of = [&](unsigned int prim) {
+                    const BoundingBox &box = boxes[prim];
+                    return std::min(unsigned((box.min[axis] + box.max[axis] - base) * scale), BIN_CNT - 1);
+                };
+                unsigned int bin_cnt[BIN_CNT] = {};
+                glm::vec3 bin_min[BIN_CNT], bin_max[BIN_CNT];
+                std::fill(bin_min, bin_min + BIN_CNT, glm::vec3(1e30f));
+                std::fill(bin_max, bin_max + BIN_CNT, glm::vec3(-1e30f));
+                for (unsigned int i = first; i < end; i++)
+                {
+                    unsigned int b = bin_of(order[i]);
+                    bin_cnt[b]++;
+                    bin_min[b] = glm::min(bin_min[b], boxes[order[i]].min);
+                    bin_max[b] = glm::max(bin_max[b], boxes[order[i]].max);
+                }
+                // right_cost[i] is area times count of the bins after bin i
+                float right_cost[BIN_CNT];
+                glm::vec3 rmin(1e30f), rmax(-1e30f);
+                unsigned int rcnt = 0;
+                for (unsigned int i = BIN_CNT - 1; i > 0; i--)
+                {
+                    rmin = glm::min(rmin, bin_min[i]);
+                    rmax = glm::max(rmax, bin_max[i]);
+                    rcnt += bin_cnt[i];
+                    right_cost[i - 1] = rcnt ? SurfaceArea(rmin, rmax) * rcnt : 0.0f;
+                }
+                glm::vec3 lmin(1e30f), lmax(-1e30f);
+                unsigned int lcnt = 0;
+                float best_cost = 1e30f;
+                unsigned int best = BIN_CNT;
+                for (unsigned int i = 0; i < BIN_CNT - 1; i++)
+                {
+                    lmin = glm::min(lmin, bin_min[i]);
+                    lmax = glm::max(lmax, bin_max[i]);
+                    lcnt += bin_cnt[i];
+                    if (!lcnt || lcnt == cnt)
+                        continue;
+                    float cost = SurfaceArea(lmin, lmax) * lcnt + right_cost[i];
+                    if (cost < best_cost)
+                        best_cost = cost, best = i;
+                }
+                // one traversal step plus the expected box tests, against testing every box
+                best_cost = 1.0f + best_cost / std::max(node.build_area, 1e-20f);
+                if (best_cost >= cnt && cnt <= MAX_LEAF)
+                    return;
+                if (best != BIN_CNT)
+                    mid = std::partition(order + first, order + end,
+                                         [&](unsigned int prim) { return bin_of(prim) <= best; }) -
+                          order;
+            }
+            else if (cnt <= MAX_LEAF)
+                return;
+
+            oct_idx left = alloc_pair();
+            nodes[now].left = left;
+            nodes[now].count = 0;
+            nodes[left].father = nodes[left + 1].father = now;
+            build_node(left, boxes, order, first, mid);
+            build_node(left + 1, boxes, order, mid, end);
+        }
     };
 }
 
@@ -192,10 +192,11 @@ namespace builtin_components
     class RenderableObject : public common::Component
     {
     public:
-        RenderableObject() {}
+        RenderableObject() : occluder(false), cast_shadow(true), started(false) {}
         RenderableObject(std::shared_ptr<common::GameObject> object,
                          std::string material_pth,
-                         std::string mesh_pth) : Component(object)
+                         std::string mesh_pth,
+                         bool occluder = false) : Component(object), occluder(occluder), cast_shadow(true), started(false)
         {
             init(material_pth, mesh_pth);
         }
@@ -208,12 +209,24 @@ namespace builtin_components
             args = std::make_shared<common::RenderArguments>();
             item = std::make_shared<renderer::RenderQueueItem>(object.lock()->id, material, mesh, args, mesh->id_count);
             // TODO
-            rd_idxs.push_back(renderer::RenderLayerIndex(0, true, false, false));
+            bool transparent = material->render_mode != common::RENDER_MODE_OPAQUE;
+            rd_idxs.push_back(renderer::RenderLayerIndex(0, !transparent, cast_shadow && !transparent, transparent));
         }
 
         virtual void OnTransformed(common::TransformParameter &param)
         {
             updateRenderParam(param.model);
+            auto id = object.lock()->id;
+            for (auto &idx : rd_idxs)
+            {
+                auto &layer = renderer::RenderLayerManager::GetInstance()->layers[idx.layer];
+                if (idx.in_opaque)
+                    layer.MarkDirty(id, renderer::OPAQUE);
+                if (idx.in_transparent)
+                    layer.MarkDirty(id, renderer::TRANSPARENT);
+                if (idx.in_shadow)
+                    layer.MarkDirty(id, renderer::OPAQUE_SHADOW);
+            }
         }
 
         virtual void OnStart()
@@ -231,19 +244,54 @@ namespace builtin_components
                 if (idx.in_shadow)
                     layer.InsertObject(renderer::OPAQUE_SHADOW, item);
             }
+            if (occluder)
+                locked_object->rd->AddOccluder(item);
+            started = true;
+        }
+
+        // Static objects never move, the depth they cast into shadow maps is
+        // cached. One that does move anyway only costs a redraw of the cache.
+        void SetStatic(bool enable)
+        {
+            item->is_static = enable;
+        }
+
+        // Occluders hide the objects behind them before those are drawn,
+        // large closed meshes with few triangles suit best
+        void SetOccluder(bool enable)
+        {
+            if (enable == occluder)
+                return;
+            occluder = enable;
+            if (!started)
+                return;
+            auto rd = object.lock()->rd;
+            if (occluder)
+                rd->AddOccluder(item);
+            else
+                rd->RemoveOccluder(item->id);
         }
 
         virtual void UnserializeJSON(nlohmann::json &j, std::shared_ptr<common::GameObject> obj)
         {
             this->object = obj;
+            occluder = j.find("occluder") != j.end() && j["occluder"].get<bool>();
+            cast_shadow = j.find("cast_shadow") == j.end() || j["cast_shadow"].get<bool>();
             init(j["material"].get<std::string>(), j["mesh"].get<std::string>());
+            item->is_static = j.find("static") != j.end() && j["static"].get<bool>();
+            if (j.find("contribution_threshold") != j.end())
+                args->contribution_threshold = j["contribution_threshold"].get<float>();
         }
 
         virtual std::string SerializeJSON()
         {
             std::string ret = "{\n";
             ret += "\"material\": \"" + material_pth + "\",\n";
-            ret += "\"mesh\": \"" + mesh_pth + "\"";
+            ret += "\"mesh\": \"" + mesh_pth + "\",\n";
+            ret += "\"occluder\": " + std::string(occluder ? "true" : "false") + ",\n";
+            ret += "\"cast_shadow\": " + std::string(cast_shadow ? "true" : "false") + ",\n";
+            ret += "\"static\": " + std::string(item->is_static ? "true" : "false") + ",\n";
+            ret += "\"contribution_threshold\": " + std::to_string(args->contribution_threshold);
             ret += "\n}";
             return ret;
         }
@@ -256,6 +304,10 @@ namespace builtin_components
         std::string material_pth;
         std::string mesh_pth;
         std::vector<renderer::RenderLayerIndex> rd_idxs;
+        bool occluder;
+        // opaque objects cast shadows unless told otherwise
+        bool cast_shadow;
+        bool started;
 
         void updateRenderParam(glm::mat4 &model)
         {
@@ -0,0 +1,312 @@
+#ifndef GL_STATE_H
+#define GL_STATE_H
+
+#include <glad/glad.h>
+#include <string>
+
+namespace common
+{
+    // GL calls issued through GLState and those dropped because the state
+    // was already set, since the last TakeStats
+    struct GLStateStats
+    {
+        unsigned int programs;
+        unsigned int programs_skipped;
+        unsigned int vertex_arrays;
+        unsigned int vertex_arrays_skipped;
+        unsigned int textures;
+        unsigned int textures_skipped;
+        unsigned int buffers;
+        unsigned int buffers_skipped;
+        unsigned int states;
+        unsigned int states_skipped;
+
+        GLStateStats() : programs(0), programs_skipped(0), vertex_arrays(0), vertex_arrays_skipped(0),
+                         textures(0), textures_skipped(0), buffers(0), buffers_skipped(0), states(0), states_skipped(0) {}
+
+        unsigned int Issued() const
+        {
+            return programs + vertex_arrays + textures + buffers + states;
+        }
+
+        unsigned int Skipped() const
+        {
+            return programs_skipped + vertex_arrays_skipped + textures_skipped + buffers_skipped + states_skipped;
+        }
+
+        std::string SerializeJSON();
+    };
+
+    // Shadow of the GL state the engine changes while drawing. Engine code
+    // binds programs, vertex arrays, framebuffers, textures and buffers and
+    // sets depth, color, cull and blend state through it, and calls that
+    // would not change anything never reach GL. Code changing the state
+    // behind its back, like resource loading, has to be followed by
+    // Invalidate.
+    class GLState
+    {
+    private:
+        static GLState *instance;
+        GLState()
+        {
+            Invalidate();
+        }
+        GLState(const GLState &);
+        GLState &operator=(const GLState &);
+
+    public:
+        static const unsigned int MAX_TEXTURE_UNITS = 32;
+        static const unsigned int MAX_BUFFER_BINDINGS = 16;
+
+        static GLState *GetInstance()
+        {
+            if (instance == nullptr)
+                instance = new GLState();
+            return instance;
+        }
+
+        // Forgets everything, the next call of each kind reaches GL
+        void Invalidate()
+        {
+            program = UNKNOWN;
+            vertex_array = UNKNOWN;
+            framebuffer = UNKNOWN;
+            for (auto &texture : textures)
+                texture = UNKNOWN;
+            for (auto &buffer : buffers)
+                buffer = UNKNOWN;
+            for (auto &target : ranges)
+                for (auto &range : target)
+                    range = Range{UNKNOWN, 0, 0};
+            for (auto &cap : caps)
+                cap = -1;
+            depth_mask = color_mask = -1;
+            depth_func = cull_face = blend_src = blend_dst = UNKNOWN;
+        }
+
+        void UseProgram(unsigned int program)
+        {
+            if (update(this->program, program, stats.programs, stats.programs_skipped))
+                glUseProgram(program);
+        }
+
+        void BindVertexArray(unsigned int vao)
+        {
+            if (update(vertex_array, vao, stats.vertex_arrays, stats.vertex_arrays_skipped))
+                glBindVertexArray(vao);
+        }
+
+        // Draw and read framebuffer at once
+        void BindFramebuffer(unsigned int framebuffer)
+        {
+            if (update(this->framebuffer, framebuffer, stats.states, stats.states_skipped))
+                glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        }
+
+        // Binds texture to unit with whatever target it was created with
+        void BindTexture(unsigned int unit, unsigned int texture)
+        {
+            unsigned int untracked = UNKNOWN;
+            if (update(unit < MAX_TEXTURE_UNITS ? textures[unit] : untracked, texture, stats.textures, stats.textures_skipped))
+                glBindTextureUnit(unit, texture);
+        }
+
+        void BindBuffer(GLenum target, unsigned int buffer)
+        {
+            int t = generic_target(target);
+            unsigned int untracked = UNKNOWN;
+            if (update(t >= 0 ? buffers[t] : untracked, buffer, stats.buffers, stats.buffers_skipped))
+                glBindBuffer(target, buffer);
+        }
+
+        // Uniform and shader storage bindings, by range or whole buffers
+        void BindBufferRange(GLenum target, unsigned int index, unsigned int buffer, GLintptr offset, GLsizeiptr size)
+        {
+            int t = indexed_target(target);
+            Range range{buffer, offset, size};
+            if (t >= 0 && index < MAX_BUFFER_BINDINGS && ranges[t][index] == range)
+            {
+                stats.buffers_skipped++;
+                return;
+            }
+            stats.buffers++;
+            if (t >= 0 && index < MAX_BUFFER_BINDINGS)
+                ranges[t][index] = range;
+            // binding a range binds the generic target as well
+            int g = generic_target(target);
+            if (g >= 0)
+                buffers[g] = buffer;
+            if (size < 0)
+                glBindBufferBase(target, index, buffer);
+            else
+                glBindBufferRange(target, index, buffer, offset, size);
+        }
+
+        void BindBufferBase(GLenum target, unsigned int index, unsigned int buffer)
+        {
+            BindBufferRange(target, index, buffer, 0, -1);
+        }
+
+        // GL_DEPTH_TEST, GL_CULL_FACE and GL_BLEND are tracked, other
+        // capabilities always reach GL
+        void SetEnabled(GLenum cap, bool enable)
+        {
+            int c = capability(cap);
+            int untracked = -1;
+            if (!update(c >= 0 ? caps[c] : untracked, int(enable), stats.states, stats.states_skipped))
+                return;
+            if (enable)
+                glEnable(cap);
+            else
+                glDisable(cap);
+        }
+
+        void DepthMask(bool write)
+        {
+            if (update(depth_mask, int(write), stats.states, stats.states_skipped))
+                glDepthMask(write);
+        }
+
+        void DepthFunc(GLenum func)
+        {
+            if (update(depth_func, func, stats.states, stats.states_skipped))
+                glDepthFunc(func);
+        }
+
+        // All four channels at once
+        void ColorMask(bool write)
+        {
+            if (update(color_mask, int(write), stats.states, stats.states_skipped))
+                glColorMask(write, write, write, write);
+        }
+
+        void CullFace(GLenum face)
+        {
+            if (update(cull_face, face, stats.states, stats.states_skipped))
+                glCullFace(face);
+        }
+
+        void BlendFunc(GLenum src, GLenum dst)
+        {
+            if (src == blend_src && dst == blend_dst)
+            {
+                stats.states_skipped++;
+                return;
+            }
+            stats.states++;
+            blend_src = src;
+            blend_dst = dst;
+            glBlendFunc(src, dst);
+        }
+
+        // Blend function of one draw buffer, always reaches GL. The function
+        // for all buffers is unknown afterwards.
+        void BlendFunc(unsigned int buffer, GLenum src, GLenum dst)
+        {
+            stats.states++;
+            blend_src = blend_dst = UNKNOWN;
+            glBlendFunci(buffer, src, dst);
+        }
+
+        // Counters since the last call
+        GLStateStats TakeStats()
+        {
+            GLStateStats ret = stats;
+            stats = GLStateStats();
+            return ret;
+        }
+
+    private:
+        static const unsigned int UNKNOWN = ~0u;
+
+        struct Range
+        {
+            unsigned int buffer;
+            GLintptr offset;
+            GLsizeiptr size;
+
+            bool operator==(const Range &r) const
+            {
+                return buffer == r.buffer && offset == r.offset && size == r.size;
+            }
+        };
+
+        unsigned int program;
+        unsigned int vertex_array;
+        unsigned int framebuffer;
+        unsigned int textures[MAX_TEXTURE_UNITS];
+        // GL_ARRAY_BUFFER, GL_DRAW_INDIRECT_BUFFER, GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER
+        unsigned int buffers[4];
+        // GL_UNIFORM_BUFFER, GL_SHADER_STORAGE_BUFFER
+        Range ranges[2][MAX_BUFFER_BINDINGS];
+        int caps[3];
+        int depth_mask;
+        int color_mask;
+        unsigned int depth_func;
+        unsigned int cull_face;
+        unsigned int blend_src;
+        unsigned int blend_dst;
+        GLStateStats stats;
+
+        // Sets cached to value and counts the call, false when it is dropped
+        template <typename T>
+        static bool update(T &cached, T value, unsigned int &issued, unsigned int &skipped)
+        {
+            if (cached == value)
+            {
+                skipped++;
+                return false;
+            }
+            cached = value;
+            issued++;
+            return true;
+        }
+
+        static int generic_target(GLenum target)
+        {
+            switch (target)
+            {
+            case GL_ARRAY_BUFFER:
+                return 0;
+            case GL_DRAW_INDIRECT_BUFFER:
+                return 1;
+            case GL_UNIFORM_BUFFER:
+                return 2;
+            case GL_SHADER_STORAGE_BUFFER:
+                return 3;
+            default:
+                return -1;
+            }
+        }
+
+        static int indexed_target(GLenum target)
+        {
+            switch (target)
+            {
+            case GL_UNIFORM_BUFFER:
+                return 0;
+            case GL_SHADER_STORAGE_BUFFER:
+                return 1;
+            default:
+                return -1;
+            }
+        }
+
+        static int capability(GLenum cap)
+        {
+            switch (cap)
+            {
+            case GL_DEPTH_TEST:
+                return 0;
+            case GL_CULL_FACE:
+                return 1;
+            case GL_BLEND:
+                return 2;
+            default:
+                return -1;
+            }
+        }
+    };
+}
+
+#endif
@@ -19,11 +19,10 @@ namespace builtin_materials
         {
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, texture->texture);
+            cmds.UseProgram(shader->shader);
+            cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, texture->texture);
         };
 
         virtual void Dispose()
@@ -49,23 +48,18 @@ namespace builtin_materials
                       float shininess)
             : diffuse(diffuse), specular(specular), normal(normal), shininess(shininess), Material(shader, material_id)
         {
-            glUseProgram(shader->shader);
-            unsigned int shineLoc = glGetUniformLocation(shader->shader, "shininess");
-            glUniform1f(shineLoc, shininess);
-            glUniform1i(glGetUniformLocation(shader->shader, "diffuse"), 0 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "specular"), 1 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "normal"), 2 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1f(shader->shader, shader->layout.Location("shininess"), shininess);
+            glProgramUniform1i(shader->shader, shader->layout.Location("diffuse"), 0 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("specular"), 1 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("normal"), 2 + common::ENGINE_TEXTURE_CNT);
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, diffuse->texture);
-            glActiveTexture(GL_TEXTURE1 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, specular->texture);
-            glActiveTexture(GL_TEXTURE2 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, normal->texture);
+            cmds.UseProgram(shader->shader);
+            cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, diffuse->texture);
+            cmds.BindTexture(1 + common::ENGINE_TEXTURE_CNT, specular->texture);
+            cmds.BindTexture(2 + common::ENGINE_TEXTURE_CNT, normal->texture);
         };
 
         virtual void Dispose()
@@ -96,28 +90,21 @@ namespace builtin_materials
                               float height_scale)
             : diffuse(diffuse), specular(specular), normal(normal), depth(depth), shininess(shininess), height_scale(height_scale), Material(shader, material_id)
         {
-            glUseProgram(shader->shader);
-            unsigned int shineLoc = glGetUniformLocation(shader->shader, "shininess");
-            glUniform1f(shineLoc, shininess);
-            unsigned int heightLoc = glGetUniformLocation(shader->shader, "height_scale");
-            glUniform1f(heightLoc, height_scale);
-            glUniform1i(glGetUniformLocation(shader->shader, "diffuse"), 0 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "specular"), 1 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "normal"), 2 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "depth"), 3 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1f(shader->shader, shader->layout.Location("shininess"), shininess);
+            glProgramUniform1f(shader->shader, shader->layout.Location("height_scale"), height_scale);
+            glProgramUniform1i(shader->shader, shader->layout.Location("diffuse"), 0 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("specular"), 1 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("normal"), 2 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("depth"), 3 + common::ENGINE_TEXTURE_CNT);
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, diffuse->texture);
-            glActiveTexture(GL_TEXTURE1 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, specular->texture);
-            glActiveTexture(GL_TEXTURE2 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, normal->texture);
-            glActiveTexture(GL_TEXTURE3 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, depth->texture);
+            cmds.UseProgram(shader->shader);
+            cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, diffuse->texture);
+            cmds.BindTexture(1 + common::ENGINE_TEXTURE_CNT, specular->texture);
+            cmds.BindTexture(2 + common::ENGINE_TEXTURE_CNT, normal->texture);
+            cmds.BindTexture(3 + common::ENGINE_TEXTURE_CNT, depth->texture);
         };
 
         virtual void Dispose()
@@ -148,24 +135,19 @@ namespace builtin_materials
                     std::shared_ptr<common::Texture2D> normal)
             : albedo(albedo), metallic(metallic), roughness(roughness), normal(normal), Material(shader, material_id)
         {
-            glUseProgram(shader->shader);
-            glUniform1i(glGetUniformLocation(shader->shader, "albedoMap"), 0 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "metalicMap"), 1 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "roughnessMap"), 2 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "normalMap"), 3 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("albedoMap"), 0 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("metalicMap"), 1 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("roughnessMap"), 2 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("normalMap"), 3 + common::ENGINE_TEXTURE_CNT);
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, albedo->texture);
-            glActiveTexture(GL_TEXTURE1 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, metallic->texture);
-            glActiveTexture(GL_TEXTURE2 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, roughness->texture);
-            glActiveTexture(GL_TEXTURE3 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, normal->texture);
+            cmds.UseProgram(shader->shader);
+            cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, albedo->texture);
+            cmds.BindTexture(1 + common::ENGINE_TEXTURE_CNT, metallic->texture);
+            cmds.BindTexture(2 + common::ENGINE_TEXTURE_CNT, roughness->texture);
+            cmds.BindTexture(3 + common::ENGINE_TEXTURE_CNT, normal->texture);
         };
 
         virtual void Dispose()
@@ -197,29 +179,22 @@ namespace builtin_materials
             : albedo(albedo), metallic(metallic), roughness(roughness),
               normal(normal), depth(depth), height_scale(height_scale), Material(shader, material_id)
         {
-            glUseProgram(shader->shader);
-            unsigned int heightLoc = glGetUniformLocation(shader->shader, "height_scale");
-            glUniform1f(heightLoc, height_scale);
-            glUniform1i(glGetUniformLocation(shader->shader, "albedoMap"), 0 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "metalicMap"), 1 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "roughnessMap"), 2 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "normalMap"), 3 + common::ENGINE_TEXTURE_CNT);
-            glUniform1i(glGetUniformLocation(shader->shader, "depthMap"), 4 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1f(shader->shader, shader->layout.Location("height_scale"), height_scale);
+            glProgramUniform1i(shader->shader, shader->layout.Location("albedoMap"), 0 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("metalicMap"), 1 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("roughnessMap"), 2 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("normalMap"), 3 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("depthMap"), 4 + common::ENGINE_TEXTURE_CNT);
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, albedo->texture);
-            glActiveTexture(GL_TEXTURE1 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, metallic->texture);
-            glActiveTexture(GL_TEXTURE2 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, roughness->texture);
-            glActiveTexture(GL_TEXTURE3 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, normal->texture);
-            glActiveTexture(GL_TEXTURE4 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, depth->texture);
+            cmds.UseProgram(shader->shader);
+            cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, albedo->texture);
+            cmds.BindTexture(1 + common::ENGINE_TEXTURE_CNT, metallic->texture);
+            cmds.BindTexture(2 + common::ENGINE_TEXTURE_CNT, roughness->texture);
+            cmds.BindTexture(3 + common::ENGINE_TEXTURE_CNT, normal->texture);
+            cmds.BindTexture(4 + common::ENGINE_TEXTURE_CNT, depth->texture);
         };
 
         virtual void Dispose()
@@ -266,20 +241,17 @@ namespace builtin_materials
             render_mode = j["render_mode"].get<unsigned int>();
             std::string shaderpth = j["shader"].get<std::string>();
             shader = resources::LoadMeta<common::ShaderProgram>(shaderpth);
-            glUseProgram(shader->shader);
             auto tx2d = j["2D_textures"];
             auto txcube = j["cube_textures"];
             auto floatvals = j["float_vals"];
             auto intvals = j["int_vals"];
-            int texture_cnt = 0;
             for (auto &texture_info : tx2d)
             {
                 std::string name = texture_info["name"].get<std::string>();
                 auto tex = resources::Load<common::Texture2D>(texture_info["path"].get<std::string>());
-                textures_2d.insert(kv_tex2d(name, tex));
-                idxs.insert(kv_int(name, texture_cnt));
-                glUniform1i(glGetUniformLocation(shader->shader, name.c_str()), texture_cnt + common::ENGINE_TEXTURE_CNT);
-                texture_cnt++;
+                textures_2d.push_back(tex);
+                // samplers are program state, set once for good
+                set_sampler(name, textures_2d.size() - 1);
             }
             // for (auto &texture_info : txcube)
             // {
@@ -289,49 +261,69 @@ namespace builtin_materials
             for (auto &val_info : floatvals)
             {
                 std::string name = val_info["name"].get<std::string>();
-                float val = val_info["val"].get<float>();
-                int idx = glGetUniformLocation(shader->shader, name.c_str());
-                float_vals.insert(kv_float(name, val));
-                idxs.insert(kv_int(name, idx));
-                glUniform1f(idx, val);
+                float_vals.push_back(Value<float>{val_info["val"].get<float>(), {locate(name, false), locate(name, true)}});
             }
             for (auto &val_info : intvals)
             {
                 std::string name = val_info["name"].get<std::string>();
-                int val = val_info["val"].get<int>();
-                int idx = glGetUniformLocation(shader->shader, name.c_str());
-                int_vals.insert(kv_int(name, val));
-                idxs.insert(kv_int(name, idx));
-                glUniform1i(idx, val);
+                int_vals.push_back(Value<int>{val_info["val"].get<int>(), {locate(name, false), locate(name, true)}});
             }
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            for (auto &tex : textures_2d)
-            {
-                glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT + idxs[tex.first]);
-                glBindTexture(GL_TEXTURE_2D, tex.second->texture);
-            }
+            bind(cmds, false);
+        }
 
-            for (auto &val_info : float_vals)
-            {
-                glUniform1f(idxs[val_info.first], val_info.second);
-            }
-            for (auto &val_info : int_vals)
-            {
-                glUniform1f(idxs[val_info.first], val_info.second);
-            }
+        virtual bool Instanceable()
+        {
+            return shader->instanced != 0;
+        }
+
+        virtual void PrepareForInstancedDraw(common::CommandList &cmds)
+        {
+            bind(cmds, true);
         }
 
     private:
-        std::map<std::string, int> int_vals;
-        std::map<std::string, float> float_vals;
-        std::map<std::string, std::shared_ptr<common::Texture2D>> textures_2d;
+        // a value with its location in the program and the instanced program
+        template <typename T>
+        struct Value
+        {
+            T val;
+            int location[2];
+        };
+
+        std::vector<Value<int>> int_vals;
+        std::vector<Value<float>> float_vals;
+        // bound to unit ENGINE_TEXTURE_CNT + index
+        std::vector<std::shared_ptr<common::Texture2D>> textures_2d;
         std::map<std::string, std::shared_ptr<common::TextureCube>> textures_cube;
 
-        std::map<std::string, int> idxs;
+        int locate(const std::string &name, bool instanced)
+        {
+            if (instanced)
+                return shader->instanced ? shader->instanced_layout.Location(name) : -1;
+            return shader->layout.Location(name);
+        }
+
+        void set_sampler(const std::string &name, unsigned int unit)
+        {
+            glProgramUniform1i(shader->shader, locate(name, false), unit + common::ENGINE_TEXTURE_CNT);
+            if (shader->instanced)
+                glProgramUniform1i(shader->instanced, locate(name, true), unit + common::ENGINE_TEXTURE_CNT);
+        }
+
+        void bind(common::CommandList &cmds, bool instanced)
+        {
+            cmds.UseProgram(instanced ? shader->instanced : shader->shader);
+            for (unsigned int i = 0; i < textures_2d.size(); i++)
+                cmds.BindTexture(common::ENGINE_TEXTURE_CNT + i, textures_2d[i]->texture);
+            for (auto &val : float_vals)
+                cmds.Uniform(val.location[instanced], val.val);
+            for (auto &val : int_vals)
+                cmds.Uniform(val.location[instanced], val.val);
+        }
     };
 }
 #endif
\ No newline at end of file
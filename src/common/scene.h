@@ -2,6 +2,7 @@
 #define SCENE_H
 
 #include "game_object.h"
+#include "thread_pool.h"
 
 namespace common
 {
@@ -38,10 +39,15 @@ namespace common
 
         void OnStart()
         {
+            // renderable objects register themselves in OnStart, build the octrees in one go
+            auto layer_manager = renderer::RenderLayerManager::GetInstance();
+            layer_manager->BeginBulkInsert();
             for (auto &object : objects)
             {
                 object->OnStart();
             }
+            // the pool workers and the calling thread
+            layer_manager->EndBulkInsert(ThreadPool::GetInstance()->WorkerCount() + 1);
         }
 
         std::vector<std::shared_ptr<GameObject>> objects;
@@ -0,0 +1,177 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace common
+{
+    // Fixed set of workers with one task deque each. A worker takes the
+    // newest task of its own deque and steals the oldest of the others when
+    // it runs dry. The thread waiting on a batch runs tasks as well.
+    class ThreadPool
+    {
+    private:
+        static ThreadPool *instance;
+
+        struct Batch
+        {
+            const std::function<void(unsigned int)> *task;
+            std::atomic<unsigned int> remaining;
+        };
+
+        struct Task
+        {
+            Batch *batch;
+            unsigned int index;
+        };
+
+        struct TaskQueue
+        {
+            std::mutex lock;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<std::unique_ptr<TaskQueue>> queues;
+        std::atomic<unsigned int> queued;
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        bool stop;
+
+        ThreadPool(const ThreadPool &);
+        ThreadPool &operator=(const ThreadPool &);
+
+        bool pop(unsigned int queue, Task &task)
+        {
+            auto &q = *queues[queue];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (q.tasks.empty())
+                return false;
+            task = q.tasks.back();
+            q.tasks.pop_back();
+            queued--;
+            return true;
+        }
+
+        bool steal(unsigned int thief, Task &task)
+        {
+            for (unsigned int i = 1; i <= queues.size(); i++)
+            {
+                auto &q = *queues[(thief + i) % queues.size()];
+                std::lock_guard<std::mutex> guard(q.lock);
+                if (q.tasks.empty())
+                    continue;
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                queued--;
+                return true;
+            }
+            return false;
+        }
+
+        void run(Task &task)
+        {
+            (*task.batch->task)(task.index);
+            if (--task.batch->remaining == 0)
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+                done.notify_all();
+            }
+        }
+
+        void work(unsigned int id)
+        {
+            Task task;
+            while (true)
+            {
+                if (pop(id, task) || steal(id, task))
+                {
+                    run(task);
+                    continue;
+                }
+                std::unique_lock<std::mutex> guard(sleep_lock);
+                wake.wait(guard, [&] { return stop || queued > 0; });
+                if (stop)
+                    return;
+            }
+        }
+
+    public:
+        explicit ThreadPool(unsigned int worker_cnt) : queued(0), stop(false)
+        {
+            worker_cnt = std::max(1u, worker_cnt);
+            for (unsigned int i = 0; i < worker_cnt; i++)
+                queues.emplace_back(new TaskQueue());
+            for (unsigned int i = 0; i < worker_cnt; i++)
+                workers.emplace_back(&ThreadPool::work, this, i);
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+                stop = true;
+                wake.notify_all();
+            }
+            for (auto &worker : workers)
+                worker.join();
+        }
+
+        // One worker less than the hardware threads, the caller of Run is the last one
+        static ThreadPool *GetInstance()
+        {
+            if (instance == nullptr)
+                instance = new ThreadPool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+            return instance;
+        }
+
+        unsigned int WorkerCount()
+        {
+            return workers.size();
+        }
+
+        // Runs task(i) for every i in [0, cnt) and returns once all of them finished
+        void Run(unsigned int cnt, const std::function<void(unsigned int)> &task)
+        {
+            if (!cnt)
+                return;
+            Batch batch;
+            batch.task = &task;
+            batch.remaining = cnt;
+            for (unsigned int i = 0; i < cnt; i++)
+            {
+                auto &q = *queues[i % queues.size()];
+                std::lock_guard<std::mutex> guard(q.lock);
+                q.tasks.push_back(Task{&batch, i});
+                queued++;
+            }
+            {
+                std::lock_guard<std::mutex> guard(sleep_lock);
+                wake.notify_all();
+            }
+
+            Task stolen;
+            while (batch.remaining)
+            {
+                if (steal(0, stolen))
+                {
+                    run(stolen);
+                    continue;
+                }
+                std::unique_lock<std::mutex> guard(sleep_lock);
+                done.wait(guard, [&] { return batch.remaining == 0; });
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "../common/ds.h"
+#include <limits>
+
+// SSE by default, the 8 wide AVX kernel measured slower since it spends its
+// time on the loads and transposes rather than on the plane tests
+#if defined(__AVX__) && defined(FRUSTUM_USE_AVX)
+#define FRUSTUM_AVX
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FRUSTUM_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace renderer
+{
+    struct CameraParameters
+    {
+        float fov;
+        float aspect;
+        float near;
+        float far;
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPos;
+        // in pixels, 0 when unknown, which disables screen size estimates
+        float viewport_height;
+        // pixels per unit of tangent of the view angle
+        float pixel_scale;
+        // world space frustum planes, xyz is the normal pointing inside and
+        // w the offset, a point p is inside when dot(xyz, p) + w >= 0
+        glm::vec4 planes[6];
+
+        enum frustum_relation
+        {
+            FRUSTUM_INCLUDE,
+            FRUSTUM_INTERSECT,
+            FRUSTUM_SEPARATE
+        };
+
+        // bit i set means planes[i] still has to be tested
+        static const unsigned int ALL_PLANES = 0x3f;
+        // A box is rejected only when it lies this far outside a plane,
+        // relative to the magnitude of the terms summed up for the test. It
+        // is well above their rounding error, so a box the exact test keeps
+        // is never dropped.
+        static constexpr float REJECT_SLACK = 1e-5f;
+
+        CameraParameters() : viewport_height(0.0f), pixel_scale(0.0f) {}
+
+        void UpdateParam(float nfov, float naspect, float nnear, float nfar)
+        {
+            fov = nfov;
+            aspect = naspect;
+            near = nnear;
+            far = nfar;
+            projection = glm::perspective(fov, aspect, near, far);
+            pixel_scale = viewport_height * 0.5f / std::tan(fov * 0.5f);
+            UpdatePlanes();
+        }
+
+        // Screen area in pixels of the bounding sphere of box, infinite when
+        // the camera is inside the sphere or the viewport is unknown
+        float ScreenArea(const common::BoundingBox &box)
+        {
+            glm::vec3 center = (box.min + box.max) * 0.5f;
+            float radius = glm::length(box.max - box.min) * 0.5f;
+            glm::vec3 offset = view * glm::vec4(center, 1.0f);
+            float dist2 = glm::dot(offset, offset);
+            if (viewport_height <= 0 || dist2 <= radius * radius)
+                return std::numeric_limits<float>::infinity();
+            float screen_radius = radius * pixel_scale / std::sqrt(dist2 - radius * radius);
+            return 3.14159265f * screen_radius * screen_radius;
+        }
+
+        // Extracts the planes from projection * view, call it after either changed.
+        // Near and far come from view and the near and far the projection was
+        // made with, taking them from a perspective projection cancels away
+        // most of the precision of the far plane.
+        void UpdatePlanes()
+        {
+            glm::mat4 m = projection * view;
+            glm::vec4 row[4];
+            for (int i = 0; i < 4; i++)
+                row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+            for (int i = 0; i < 2; i++)
+            {
+                planes[i * 2] = row[3] + row[i];
+                planes[i * 2 + 1] = row[3] - row[i];
+            }
+            glm::mat4 to_world = glm::transpose(view);
+            planes[4] = to_world * glm::vec4(0.0f, 0.0f, -1.0f, -near);
+            planes[5] = to_world * glm::vec4(0.0f, 0.0f, 1.0f, far);
+            for (auto &plane : planes)
+                plane /= glm::length(glm::vec3(plane));
+        }
+
+        // Tests the box in center and extent form. Per plane only the corner
+        // furthest along the normal decides whether the box is outside, and
+        // the corner furthest against it whether the box is fully inside.
+        frustum_relation Test(const common::BoundingBox &box)
+        {
+            glm::vec3 center = (box.min + box.max) * 0.5f;
+            glm::vec3 extent = (box.max - box.min) * 0.5f;
+            bool intersect = false;
+            for (auto &plane : planes)
+            {
+                glm::vec3 normal(plane);
+                float dist = glm::dot(normal, center) + plane.w;
+                float radius = glm::dot(glm::abs(normal), extent);
+                if (dist + radius < -reject_slack(plane, center, extent))
+                    return FRUSTUM_SEPARATE;
+                intersect |= dist - radius < 0;
+            }
+            return intersect ? FRUSTUM_INTERSECT : FRUSTUM_INCLUDE;
+        }
+
+        // Tests only the planes in mask, starting with last_plane. On return
+        // mask holds the planes the box straddles, which are all its children
+        // need to test, and last_plane the plane that rejected it, if any.
+        frustum_relation Test(const common::BoundingBox &box, unsigned int &mask, unsigned char &last_plane, unsigned int &plane_tests)
+        {
+            glm::vec3 center = (box.min + box.max) * 0.5f;
+            glm::vec3 extent = (box.max - box.min) * 0.5f;
+            unsigned int straddled = 0;
+            for (int k = 0; k < 6; k++)
+            {
+                int i = (last_plane + k) % 6;
+                if (!(mask >> i & 1))
+                    continue;
+                plane_tests++;
+                glm::vec3 normal(planes[i]);
+                float dist = glm::dot(normal, center) + planes[i].w;
+                float radius = glm::dot(glm::abs(normal), extent);
+                if (dist + radius < -reject_slack(planes[i], center, extent))
+                {
+                    last_plane = i;
+                    return FRUSTUM_SEPARATE;
+                }
+                if (dist - radius < 0)
+                    straddled |= 1 << i;
+            }
+            mask = straddled;
+            return straddled ? FRUSTUM_INTERSECT : FRUSTUM_INCLUDE;
+        }
+
+        // Same as Test for cnt boxes, 8 at a time with AVX, 4 with SSE.
+        // Planes outside mask are skipped.
+        void TestBatch(const common::BoundingBox *boxes, unsigned int cnt, frustum_relation *out, unsigned int mask = ALL_PLANES)
+        {
+            unsigned int i = 0;
+#if defined(FRUSTUM_AVX)
+            for (; i + 8 <= cnt; i += 8)
+            {
+                __m256 c[3], e[3], m[3];
+                load_boxes(boxes + i, c, e);
+                __m256 sign = _mm256_set1_ps(-0.0f);
+                for (int k = 0; k < 3; k++)
+                    m[k] = _mm256_add_ps(_mm256_andnot_ps(sign, c[k]), e[k]);
+                __m256 allout = _mm256_setzero_ps(), partial = _mm256_setzero_ps();
+                for (int p = 0; p < 6; p++)
+                {
+                    if (!(mask >> p & 1))
+                        continue;
+                    auto &plane = planes[p];
+                    __m256 dist = _mm256_set1_ps(plane.w), radius = _mm256_setzero_ps();
+                    __m256 magnitude = _mm256_set1_ps(std::abs(plane.w));
+                    for (int k = 0; k < 3; k++)
+                    {
+                        __m256 n = _mm256_set1_ps(std::abs(plane[k]));
+                        dist = _mm256_add_ps(dist, _mm256_mul_ps(_mm256_set1_ps(plane[k]), c[k]));
+                        radius = _mm256_add_ps(radius, _mm256_mul_ps(n, e[k]));
+                        magnitude = _mm256_add_ps(magnitude, _mm256_mul_ps(n, m[k]));
+                    }
+                    __m256 reach = _mm256_add_ps(_mm256_add_ps(dist, radius), _mm256_mul_ps(magnitude, _mm256_set1_ps(REJECT_SLACK)));
+                    allout = _mm256_or_ps(allout, _mm256_cmp_ps(reach, _mm256_setzero_ps(), _CMP_LT_OQ));
+                    partial = _mm256_or_ps(partial, _mm256_cmp_ps(_mm256_sub_ps(dist, radius), _mm256_setzero_ps(), _CMP_LT_OQ));
+                }
+                write_result(_mm256_movemask_ps(allout), _mm256_movemask_ps(partial), 8, out + i);
+            }
+#elif defined(FRUSTUM_SSE)
+            for (; i + 4 <= cnt; i += 4)
+            {
+                __m128 c[3], e[3], m[3];
+                load_boxes(boxes + i, c, e);
+                __m128 sign = _mm_set1_ps(-0.0f);
+                for (int k = 0; k < 3; k++)
+                    m[k] = _mm_add_ps(_mm_andnot_ps(sign, c[k]), e[k]);
+                __m128 allout = _mm_setzero_ps(), partial = _mm_setzero_ps();
+                for (int p = 0; p < 6; p++)
+                {
+                    if (!(mask >> p & 1))
+                        continue;
+                    auto &plane = planes[p];
+                    __m128 dist = _mm_set1_ps(plane.w), radius = _mm_setzero_ps();
+                    __m128 magnitude = _mm_set1_ps(std::abs(plane.w));
+                    for (int k = 0; k < 3; k++)
+                    {
+                        __m128 n = _mm_set1_ps(std::abs(plane[k]));
+                        dist = _mm_add_ps(dist, _mm_mul_ps(_mm_set1_ps(plane[k]), c[k]));
+                        radius = _mm_add_ps(radius, _mm_mul_ps(n, e[k]));
+                        magnitude = _mm_add_ps(magnitude, _mm_mul_ps(n, m[k]));
+                    }
+                    __m128 reach = _mm_add_ps(_mm_add_ps(dist, radius), _mm_mul_ps(magnitude, _mm_set1_ps(REJECT_SLACK)));
+                    allout = _mm_or_ps(allout, _mm_cmplt_ps(reach, _mm_setzero_ps()));
+                    partial = _mm_or_ps(partial, _mm_cmplt_ps(_mm_sub_ps(dist, radius), _mm_setzero_ps()));
+                }
+                write_result(_mm_movemask_ps(allout), _mm_movemask_ps(partial), 4, out + i);
+            }
+#endif
+            unsigned char last_plane = 0;
+            unsigned int plane_tests = 0;
+            for (; i < cnt; i++)
+            {
+                unsigned int box_mask = mask;
+                out[i] = Test(boxes[i], box_mask, last_plane, plane_tests);
+            }
+        }
+
+    private:
+        // Allowance on the rejection of a box against plane, see REJECT_SLACK
+        static float reject_slack(const glm::vec4 &plane, const glm::vec3 &center, const glm::vec3 &extent)
+        {
+            glm::vec3 normal = glm::abs(glm::vec3(plane));
+            return (std::abs(plane.w) + glm::dot(normal, glm::abs(center) + extent)) * REJECT_SLACK;
+        }
+
+        static void write_result(int allout, int partial, int lanes, frustum_relation *out)
+        {
+            for (int j = 0; j < lanes; j++)
+                out[j] = (allout >> j) & 1 ? FRUSTUM_SEPARATE : ((partial >> j) & 1 ? FRUSTUM_INTERSECT : FRUSTUM_INCLUDE);
+        }
+
+#if defined(FRUSTUM_SSE) || defined(FRUSTUM_AVX)
+        // Loads 4 boxes and transposes them to center and extent per axis.
+        // Reading 4 floats at min and at max stays inside BoundingBox.
+        static void load_boxes(const common::BoundingBox *boxes, __m128 *c, __m128 *e)
+        {
+            __m128 min[4], max[4];
+            for (int j = 0; j < 4; j++)
+            {
+                min[j] = _mm_loadu_ps(&boxes[j].min.x);
+                max[j] = _mm_loadu_ps(&boxes[j].max.x);
+            }
+            _MM_TRANSPOSE4_PS(min[0], min[1], min[2], min[3]);
+            _MM_TRANSPOSE4_PS(max[0], max[1], max[2], max[3]);
+            __m128 half = _mm_set1_ps(0.5f);
+            for (int k = 0; k < 3; k++)
+            {
+                c[k] = _mm_mul_ps(_mm_add_ps(min[k], max[k]), half);
+                e[k] = _mm_mul_ps(_mm_sub_ps(max[k], min[k]), half);
+            }
+        }
+#endif
+
+#if defined(FRUSTUM_AVX)
+        static void load_boxes(const common::BoundingBox *boxes, __m256 *c, __m256 *e)
+        {
+            __m128 lc[3], le[3], hc[3], he[3];
+            load_boxes(boxes, lc, le);
+            load_boxes(boxes + 4, hc, he);
+            for (int k = 0; k < 3; k++)
+            {
+                c[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(lc[k]), hc[k], 1);
+                e[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(le[k]), he[k], 1);
+            }
+        }
+#endif
+    };
+}
+
+#endif
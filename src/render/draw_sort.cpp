@@ -0,0 +1,85 @@
+#include "draw_sort.h"
+
+namespace renderer
+{
+    SortKeyLayout::SortKeyLayout() : key_bits(0), back_to_front(false)
+    {
+        std::fill(shift, shift + SORT_FIELD_CNT, 0);
+        std::fill(mask, mask + SORT_FIELD_CNT, 0);
+    }
+
+    SortKeyLayout::SortKeyLayout(std::initializer_list<SortKeyField> fields, bool back_to_front) : SortKeyLayout()
+    {
+        this->back_to_front = back_to_front;
+        for (auto &f : fields)
+            key_bits += f.bits;
+        key_bits = std::min(key_bits, 64u);
+        unsigned int used = 0;
+        for (auto &f : fields)
+        {
+            unsigned int bits = std::min(f.bits, key_bits - used);
+            used += bits;
+            shift[f.field] = key_bits - used;
+            mask[f.field] = bits >= 64 ? ~0ull : (1ull << bits) - 1;
+        }
+    }
+
+    SortKeyLayout SortKeyLayout::Default(DrawPass pass)
+    {
+        switch (pass)
+        {
+        case PASS_DEPTH:
+            return SortKeyLayout({{SORT_PASS, 3}, {SORT_LAYER, 4}, {SORT_MESH, 16}, {SORT_DEPTH, 16}}, false);
+        case PASS_TRANSPARENT:
+            return SortKeyLayout({{SORT_PASS, 3}, {SORT_LAYER, 4}, {SORT_DEPTH, 24}, {SORT_SHADER, 8}, {SORT_MATERIAL, 12}, {SORT_MESH, 13}}, true);
+        case PASS_WEIGHTED:
+            return SortKeyLayout({{SORT_PASS, 3}, {SORT_LAYER, 4}, {SORT_SHADER, 8}, {SORT_MATERIAL, 12}, {SORT_MESH, 12}}, false);
+        default:
+            return SortKeyLayout({{SORT_PASS, 3}, {SORT_LAYER, 4}, {SORT_SHADER, 8}, {SORT_MATERIAL, 12}, {SORT_MESH, 12}, {SORT_DEPTH, 12}}, false);
+        }
+    }
+
+    void DrawList::Sort(unsigned int key_bits)
+    {
+        scratch.resize(entries.size());
+        common::SortEntry *order = common::RadixSort(entries.data(), scratch.data(), entries.size(), key_bits);
+        sorted.resize(items.size());
+        for (unsigned int i = 0; i < items.size(); i++)
+            sorted[i] = std::move(items[order[i].value]);
+        std::swap(items, sorted);
+        sorted.clear();
+    }
+
+    void DrawList::BuildBatches(bool by_material, bool instancing, std::vector<DrawData> &draws)
+    {
+        batches.clear();
+        for (unsigned int i = 0; i < items.size();)
+        {
+            auto &first = *items[i];
+            unsigned int j = i + 1;
+            while (j < items.size() && items[j]->mesh == first.mesh && (!by_material || items[j]->material == first.material))
+                j++;
+            bool instanced = instancing && j - i > 1 && (!by_material || first.material->Instanceable());
+            batches.push_back(DrawBatch{i, j - i, (unsigned int)draws.size(), instanced});
+            for (unsigned int k = i; k < j; k++)
+                draws.push_back(DrawData{items[k]->args->model, items[k]->material->sort_id, {0, 0, 0}});
+            i = j;
+        }
+    }
+
+    std::string DrawStats::SerializeJSON()
+    {
+        std::string ret = "{\n";
+        ret += "\"draws\": " + std::to_string(draws) + ",\n";
+        ret += "\"shader_binds\": " + std::to_string(shader_binds) + ",\n";
+        ret += "\"material_binds\": " + std::to_string(material_binds) + ",\n";
+        ret += "\"mesh_binds\": " + std::to_string(mesh_binds) + ",\n";
+        ret += "\"shader_binds_avoided\": " + std::to_string(shader_binds_avoided) + ",\n";
+        ret += "\"material_binds_avoided\": " + std::to_string(material_binds_avoided) + ",\n";
+        ret += "\"mesh_binds_avoided\": " + std::to_string(mesh_binds_avoided) + ",\n";
+        ret += "\"instanced_objects\": " + std::to_string(instanced_objects) + ",\n";
+        ret += "\"indirect_commands\": " + std::to_string(indirect_commands);
+        ret += "\n}";
+        return ret;
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef DRAW_SORT_H
+#define DRAW_SORT_H
+
+#include "render_queue.h"
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace renderer
+{
+    enum DrawPass
+    {
+        PASS_DEPTH,
+        PASS_OPAQUE,
+        PASS_TRANSPARENT,
+        // weighted blended transparency, in any order
+        PASS_WEIGHTED,
+        // opaque objects too small for the prepass, which write their own
+        // depth before the rest of the opaque objects are shaded
+        PASS_OPAQUE_SMALL,
+        PASS_CNT
+    };
+
+    enum SortField
+    {
+        SORT_PASS,
+        SORT_LAYER,
+        SORT_SHADER,
+        SORT_MATERIAL,
+        SORT_MESH,
+        SORT_DEPTH,
+        SORT_FIELD_CNT
+    };
+
+    struct SortKeyField
+    {
+        SortField field;
+        unsigned int bits;
+    };
+
+    // Packs what a draw binds and how far away it is into a 64 bit key, so
+    // that ordering by key groups the state changes of a pass. Fields are
+    // placed from the most significant bit down in the given order and
+    // fields left out take no bits. Values wider than their field wrap,
+    // which only makes the grouping worse.
+    class SortKeyLayout
+    {
+    public:
+        SortKeyLayout();
+        SortKeyLayout(std::initializer_list<SortKeyField> fields, bool back_to_front);
+
+        // Mesh then front to back depth for the prepass, so equal meshes
+        // are adjacent for instancing, state first and depth last for
+        // opaque, back to front depth first for transparent and state
+        // without depth for weighted transparency
+        static SortKeyLayout Default(DrawPass pass);
+
+        // depth is the view distance mapped to [0, 1] from near to far
+        unsigned long long Key(DrawPass pass, unsigned int layer, const RenderQueueItem &item, float depth) const
+        {
+            // quantized in double, in float the depths near 1 of a wide field
+            // round up past its mask and carry into the field above. NaN
+            // lands at 0.
+            double d = depth > 0.0f ? std::min(double(depth), 1.0) : 0.0;
+            if (back_to_front)
+                d = 1.0 - d;
+            unsigned long long key = field(SORT_PASS, pass) | field(SORT_LAYER, layer);
+            key |= field(SORT_SHADER, item.material->shader->sort_id);
+            key |= field(SORT_MATERIAL, item.material->sort_id);
+            key |= field(SORT_MESH, item.mesh->sort_id);
+            key |= field(SORT_DEPTH, d < 1.0 ? (unsigned long long)(d * mask[SORT_DEPTH]) : mask[SORT_DEPTH]);
+            return key;
+        }
+
+        unsigned int KeyBits() const
+        {
+            return key_bits;
+        }
+
+    private:
+        unsigned int shift[SORT_FIELD_CNT];
+        unsigned long long mask[SORT_FIELD_CNT];
+        unsigned int key_bits;
+        bool back_to_front;
+
+        unsigned long long field(SortField f, unsigned long long value) const
+        {
+            return (value & mask[f]) << shift[f];
+        }
+    };
+
+    // Per draw data of the frame, std430 compatible. Every drawn item gets
+    // one entry, its index is the draw id of the item, and instanced draws
+    // read the entries of their instances from the base instance on.
+    struct DrawData
+    {
+        glm::mat4 model;
+        unsigned int material;
+        unsigned int pad[3];
+    };
+
+    // Run of items drawn together, by one instanced call or one by one.
+    // first_draw is the draw id of the first item, the others follow.
+    struct DrawBatch
+    {
+        unsigned int first;
+        unsigned int count;
+        unsigned int first_draw;
+        bool instanced;
+    };
+
+    // Items of one pass with their keys. The buffers are kept from frame to
+    // frame, so filling and sorting do not allocate once they have grown.
+    class DrawList
+    {
+    public:
+        ObjectList items;
+        std::vector<DrawBatch> batches;
+
+        void Clear()
+        {
+            items.clear();
+            entries.clear();
+        }
+
+        void Add(const std::shared_ptr<RenderQueueItem> &item, unsigned long long key)
+        {
+            entries.push_back(common::SortEntry{key, (unsigned int)items.size()});
+            items.push_back(item);
+        }
+
+        // Orders items by key with a radix sort over the lowest key_bits
+        void Sort(unsigned int key_bits);
+
+        // Splits the sorted items into runs of one mesh, and of one material
+        // when by_material is set, i.e. unless the pass uses its own shader.
+        // With instancing, runs of two or more items whose material is
+        // instanceable are drawn instanced. The data of every item is
+        // appended to draws.
+        void BuildBatches(bool by_material, bool instancing, std::vector<DrawData> &draws);
+
+    private:
+        std::vector<common::SortEntry> entries;
+        std::vector<common::SortEntry> scratch;
+        ObjectList sorted;
+    };
+
+    // Draw calls and binds issued by the draw loops of a frame. A bind is
+    // avoided for each object whose shader, material or mesh was already
+    // bound, against binding all of them for every object.
+    struct DrawStats
+    {
+        unsigned int draws;
+        unsigned int shader_binds;
+        unsigned int material_binds;
+        unsigned int mesh_binds;
+        unsigned int shader_binds_avoided;
+        unsigned int material_binds_avoided;
+        unsigned int mesh_binds_avoided;
+        // objects drawn by instanced or multi draw calls, each call counts as one draw
+        unsigned int instanced_objects;
+        // commands submitted by multi draw indirect calls
+        unsigned int indirect_commands;
+
+        DrawStats() : draws(0), shader_binds(0), material_binds(0), mesh_binds(0),
+                      shader_binds_avoided(0), material_binds_avoided(0), mesh_binds_avoided(0), instanced_objects(0),
+                      indirect_commands(0) {}
+
+        DrawStats &operator+=(const DrawStats &s)
+        {
+            draws += s.draws;
+            shader_binds += s.shader_binds;
+            material_binds += s.material_binds;
+            mesh_binds += s.mesh_binds;
+            shader_binds_avoided += s.shader_binds_avoided;
+            material_binds_avoided += s.material_binds_avoided;
+            mesh_binds_avoided += s.mesh_binds_avoided;
+            instanced_objects += s.instanced_objects;
+            indirect_commands += s.indirect_commands;
+            return *this;
+        }
+
+        std::string SerializeJSON();
+    };
+}
+
+#endif
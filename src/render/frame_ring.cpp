@@ -0,0 +1,126 @@
+#include "frame_ring.h"
+#include <algorithm>
+
+namespace renderer
+{
+    FrameRing::FrameRing(unsigned int frame_size, bool headless)
+        : buffer(0), mapped(nullptr), frame_size(frame_size), frame(0), offset(0), alignment(256), stalls(0), frame_cnt(0), headless(headless)
+    {
+        for (auto &fence : fences)
+            fence = 0;
+    }
+
+    FrameRing::~FrameRing()
+    {
+        if (headless)
+            return;
+        for (auto &fence : fences)
+            if (fence)
+                glDeleteSync(fence);
+        for (auto &old : retired)
+            glDeleteBuffers(1, &old.first);
+        if (buffer)
+            glDeleteBuffers(1, &buffer);
+    }
+
+    void FrameRing::create(unsigned int size)
+    {
+        if (headless)
+        {
+            // nothing reads the old storage once its frame is recorded
+            frame_size = size;
+            host.assign((size_t)frame_size * FRAMES, 0);
+            mapped = host.data();
+            buffer++;
+            frame = 0;
+            offset = 0;
+            return;
+        }
+        if (buffer)
+            retired.push_back(std::make_pair(buffer, frame_cnt));
+        for (auto &fence : fences)
+        {
+            if (fence)
+                glDeleteSync(fence);
+            fence = 0;
+        }
+        frame_size = size;
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCreateBuffers(1, &buffer);
+        glNamedBufferStorage(buffer, (GLsizeiptr)frame_size * FRAMES, NULL, flags);
+        mapped = (unsigned char *)glMapNamedBufferRange(buffer, 0, (GLsizeiptr)frame_size * FRAMES, flags);
+        frame = 0;
+        offset = 0;
+    }
+
+    void FrameRing::BeginFrame()
+    {
+        if (!buffer && headless)
+            create(frame_size);
+        else if (!buffer)
+        {
+            int ubo_align = 256, ssbo_align = 256;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_align);
+            glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssbo_align);
+            alignment = std::max(16, std::max(ubo_align, ssbo_align));
+            create(frame_size);
+        }
+        frame_cnt++;
+        for (unsigned int i = 0; i < retired.size();)
+        {
+            if (frame_cnt - retired[i].second > FRAMES)
+            {
+                glDeleteBuffers(1, &retired[i].first);
+                retired[i] = retired.back();
+                retired.pop_back();
+            }
+            else
+                i++;
+        }
+        frame = (frame + 1) % FRAMES;
+        offset = 0;
+        if (headless)
+            return;
+        GLsync &fence = fences[frame];
+        if (!fence)
+            return;
+        GLenum state = glClientWaitSync(fence, 0, 0);
+        if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+        {
+            stalls++;
+            while (state == GL_TIMEOUT_EXPIRED)
+                state = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    void FrameRing::EndFrame()
+    {
+        if (!buffer || headless)
+            return;
+        fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    FrameRing::Allocation FrameRing::Allocate(unsigned int size)
+    {
+        unsigned int start = (offset + alignment - 1) / alignment * alignment;
+        if (start + size > frame_size)
+        {
+            // what this frame wrote stays in the old buffer, which lives on
+            // until no frame can use it
+            create(std::max(frame_size * 2, size + alignment));
+            start = 0;
+        }
+        offset = start + size;
+        unsigned int base = frame * frame_size + start;
+        return Allocation{buffer, base, mapped + base};
+    }
+
+    void *FrameRing::Bind(common::CommandList &cmds, GLenum target, unsigned int index, unsigned int size)
+    {
+        Allocation alloc = Allocate(size);
+        cmds.BindBufferRange(target, index, alloc.buffer, alloc.offset, size);
+        return alloc.ptr;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <glad/glad.h>
+#include "../common/command_list.h"
+#include <vector>
+
+namespace renderer
+{
+    // Per frame data written straight into a persistently mapped buffer.
+    // The buffer is split into FRAMES regions used in turn, a region is only
+    // written again once the fence placed at the end of its frame passed, so
+    // writing never waits on a draw that still reads the data. A headless
+    // ring hands out host memory and fake buffer names and never touches GL.
+    class FrameRing
+    {
+    public:
+        static const unsigned int FRAMES = 3;
+
+        struct Allocation
+        {
+            unsigned int buffer;
+            unsigned int offset;
+            void *ptr;
+        };
+
+        // The buffer is made on the first BeginFrame, frame_size is the
+        // initial size of a region, which doubles when a frame outgrows it
+        explicit FrameRing(unsigned int frame_size = 1 << 20, bool headless = false);
+        ~FrameRing();
+
+        // Waits until the next region is free and starts filling it
+        void BeginFrame();
+        // Fences the region of the frame, call it after the last draw reading it
+        void EndFrame();
+
+        // size bytes aligned for uniform and storage buffer ranges
+        Allocation Allocate(unsigned int size);
+
+        // Allocates a range and records binding it to index of target, e.g.
+        // a uniform block
+        void *Bind(common::CommandList &cmds, GLenum target, unsigned int index, unsigned int size);
+
+        // Frames that had to wait for the GPU to release their region
+        unsigned int Stalls() const
+        {
+            return stalls;
+        }
+
+    private:
+        unsigned int buffer;
+        unsigned char *mapped;
+        unsigned int frame_size;
+        unsigned int frame;
+        unsigned int offset;
+        unsigned int alignment;
+        unsigned int stalls;
+        GLsync fences[FRAMES];
+        // replaced buffers with the frame they were replaced in, deleted once
+        // no frame can read them any more
+        std::vector<std::pair<unsigned int, unsigned int>> retired;
+        unsigned int frame_cnt;
+        bool headless;
+        std::vector<unsigned char> host;
+
+        FrameRing(const FrameRing &);
+        FrameRing &operator=(const FrameRing &);
+
+        void create(unsigned int size);
+    };
+}
+
+#endif
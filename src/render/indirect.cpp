@@ -0,0 +1,45 @@
+#include "indirect.h"
+
+namespace renderer
+{
+    const MeshRange &GeometryPool::Get(const common::ModelMesh &mesh)
+    {
+        if (ranges.size() <= mesh.sort_id)
+            ranges.resize(mesh.sort_id + 1, MeshRange{0, 0, 0});
+        MeshRange &range = ranges[mesh.sort_id];
+        if (range.index_count || mesh.indices.empty())
+            return range;
+        range.first_index = indices.size();
+        range.index_count = mesh.indices.size();
+        range.base_vertex = vertices.size();
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+        dirty = true;
+        return range;
+    }
+
+    void IndirectBuilder::Build(const DrawList &list, GeometryPool &pool, bool by_material)
+    {
+        unsigned int start = buckets.size();
+        for (unsigned int b = 0; b < list.batches.size(); b++)
+        {
+            auto &batch = list.batches[b];
+            auto &item = *list.items[batch.first];
+            common::Material *material = by_material ? item.material.get() : nullptr;
+            bool indirect = !by_material || item.material->Instanceable();
+            if (buckets.size() > start && buckets.back().material == material && (buckets.back().command_cnt > 0) == indirect)
+                buckets.back().batch_cnt++;
+            else
+                buckets.push_back(IndirectBucket{material, b, 1, (unsigned int)commands.size(), 0, 0});
+            auto &bucket = buckets.back();
+            bucket.objects += batch.count;
+            if (!indirect)
+                continue;
+
+            auto &range = pool.Get(*item.mesh);
+            commands.push_back(DrawElementsIndirectCommand{range.index_count, batch.count, range.first_index,
+                                                           range.base_vertex, batch.first_draw});
+            bucket.command_cnt++;
+        }
+    }
+}
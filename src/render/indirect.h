@@ -0,0 +1,90 @@
+#ifndef INDIRECT_H
+#define INDIRECT_H
+
+#include "draw_sort.h"
+#include <vector>
+
+namespace renderer
+{
+    // Layout of GL_DRAW_INDIRECT_BUFFER entries for glMultiDrawElementsIndirect
+    struct DrawElementsIndirectCommand
+    {
+        unsigned int count;
+        unsigned int instance_count;
+        unsigned int first_index;
+        int base_vertex;
+        unsigned int base_instance;
+    };
+
+    // Where a mesh lives in the shared buffers, index_count is 0 until added
+    struct MeshRange
+    {
+        unsigned int first_index;
+        unsigned int index_count;
+        int base_vertex;
+    };
+
+    // Vertices and indices of every mesh drawn indirectly, appended to two
+    // shared arrays. Meshes are static, so a mesh is copied once and kept.
+    class GeometryPool
+    {
+    public:
+        std::vector<common::VertexProperties> vertices;
+        std::vector<unsigned int> indices;
+
+        GeometryPool() : dirty(false) {}
+
+        // Range of mesh, which is added first if it is not in the pool yet
+        const MeshRange &Get(const common::ModelMesh &mesh);
+
+        // true when meshes were added since the last call
+        bool TakeDirty()
+        {
+            bool ret = dirty;
+            dirty = false;
+            return ret;
+        }
+
+    private:
+        // indexed by the sort id of the mesh
+        std::vector<MeshRange> ranges;
+        bool dirty;
+    };
+
+    // Run of batches drawn in one go. With commands it is one multi draw of
+    // a single material, otherwise the batches are drawn one by one as their
+    // material has no instanced program.
+    struct IndirectBucket
+    {
+        common::Material *material;
+        unsigned int first_batch;
+        unsigned int batch_cnt;
+        unsigned int first_command;
+        unsigned int command_cnt;
+        unsigned int objects;
+    };
+
+    // Turns the batches of sorted draw lists into indirect commands, without
+    // touching GL. Consecutive batches of one instanceable material make up
+    // one bucket, one command per batch, whose base instance is the draw id
+    // of the batch.
+    class IndirectBuilder
+    {
+    public:
+        std::vector<DrawElementsIndirectCommand> commands;
+        std::vector<IndirectBucket> buckets;
+
+        void Clear()
+        {
+            commands.clear();
+            buckets.clear();
+        }
+
+        // Appends the buckets of list, whose batches must be built already.
+        // by_material false means the pass draws with its own instanced
+        // program, so every batch goes into a single bucket.
+        void Build(const DrawList &list, GeometryPool &pool, bool by_material);
+    };
+}
+
+#endif
@@ -11,8 +11,10 @@
 
 #include <map>
 #include <memory>
+#include <vector>
 
 #include "../common/ds.h"
+#include "frame_ring.h"
 
 namespace renderer
 {
@@ -126,6 +128,13 @@ namespace renderer
 
         void RemoveItem(light_id id);
 
+        // Writes the light blocks of this frame into ring and records binding
+        // them to uniform blocks 2 to 4, so any number of changes costs one copy
+        void Upload(FrameRing &ring, common::CommandList &cmds);
+
+        // The directional light of the lowest index casting shadows, if any
+        std::shared_ptr<LightParameters> GetShadowCaster();
+
     private:
         light_id pointlight_cnt;
         light_id spotlight_cnt;
@@ -135,37 +144,19 @@ namespace renderer
         std::map<light_id, light_id> inv_point_id;
         std::map<light_id, light_id> inv_spot_id;
         std::map<light_id, light_id> inv_directional_id;
-        unsigned int ubo_pointlights;
-        unsigned int ubo_spotlights;
-        unsigned int ubo_directionals;
+        // what the light blocks hold, uploaded once a frame by Upload
+        std::vector<InnerLightParameters> light_data[3];
 
         LightManager() : pointlight_cnt(0), spotlight_cnt(0), directional_cnt(0), maxid(0)
         {
-            glGenBuffers(1, &ubo_pointlights);
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_pointlights);
-            glBufferData(GL_UNIFORM_BUFFER, max_point_light * 3 * sizeof(glm::vec4) + sizeof(int), NULL, GL_DYNAMIC_DRAW);
-            glBindBufferBase(GL_UNIFORM_BUFFER, 2, ubo_pointlights);
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-            glGenBuffers(1, &ubo_spotlights);
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_spotlights);
-            glBufferData(GL_UNIFORM_BUFFER, max_spot_light * 3 * sizeof(glm::vec4) + sizeof(int), NULL, GL_DYNAMIC_DRAW);
-            glBindBufferBase(GL_UNIFORM_BUFFER, 3, ubo_spotlights);
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-            glGenBuffers(1, &ubo_directionals);
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_directionals);
-            glBufferData(GL_UNIFORM_BUFFER, max_directional_light * 3 * sizeof(glm::vec4) + sizeof(int), NULL, GL_DYNAMIC_DRAW);
-            glBindBufferBase(GL_UNIFORM_BUFFER, 4, ubo_directionals);
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            light_data[POINT_LIGHT].resize(max_point_light);
+            light_data[SPOT_LIGHT].resize(max_spot_light);
+            light_data[DIRECTIONAL_LIGHT].resize(max_directional_light);
         }
 
-        void send_lightdata(unsigned int offset, InnerLightParameters &param)
+        void send_lightdata(LightType tp, light_id index, InnerLightParameters &param)
         {
-            // std::cout << "OFFSET " << offset << std::endl;
-            glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(glm::vec4), glm::value_ptr(param.position));
-            glBufferSubData(GL_UNIFORM_BUFFER, offset + sizeof(glm::vec4), sizeof(glm::vec4), glm::value_ptr(param.color));
-            glBufferSubData(GL_UNIFORM_BUFFER, offset + 2 * sizeof(glm::vec4), sizeof(glm::vec4), glm::value_ptr(param.direction));
+            light_data[tp][index] = param;
         }
     };
 } // namespace renderer
@@ -0,0 +1,253 @@
+#include "occlusion.h"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define OCCLUSION_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace renderer
+{
+    OcclusionBuffer::OcclusionBuffer(unsigned int width, unsigned int height)
+        : width((std::max(width, 4u) + 3) & ~3u), height(std::max(height, 1u)), near(0.1f)
+    {
+        glm::uvec2 size(this->width, this->height);
+        while (true)
+        {
+            level_size.push_back(size);
+            hiz.emplace_back(size.x * size.y, 1.0f);
+            if (size.x == 1 && size.y == 1)
+                break;
+            size = glm::uvec2((size.x + 1) / 2, (size.y + 1) / 2);
+        }
+        bins.resize((this->height + BAND_HEIGHT - 1) / BAND_HEIGHT);
+    }
+
+    void OcclusionBuffer::Begin(CameraParameters &cam)
+    {
+        view_projection = cam.projection * cam.view;
+        near = cam.near;
+        triangles.clear();
+        for (auto &bin : bins)
+            bin.clear();
+    }
+
+    void OcclusionBuffer::AddOccluder(const common::ModelMesh &mesh, const glm::mat4 &model)
+    {
+        glm::mat4 mvp = view_projection * model;
+        clip_pos.resize(mesh.vertices.size());
+        for (unsigned int i = 0; i < mesh.vertices.size(); i++)
+        {
+            auto &pos = mesh.vertices[i].position;
+            clip_pos[i] = mvp * glm::vec4(pos[0], pos[1], pos[2], 1.0f);
+        }
+
+        auto &indices = mesh.indices;
+        for (unsigned int i = 0; i + 2 < indices.size(); i += 3)
+        {
+            ScreenTriangle tri;
+            bool behind = false;
+            for (int j = 0; j < 3; j++)
+            {
+                auto &p = clip_pos[indices[i + j]];
+                if (p.w < near)
+                {
+                    behind = true;
+                    break;
+                }
+                tri.v[j] = glm::vec3((p.x / p.w * 0.5f + 0.5f) * width,
+                                     (p.y / p.w * 0.5f + 0.5f) * height,
+                                     p.z / p.w * 0.5f + 0.5f);
+            }
+            if (behind)
+                continue;
+            glm::vec3 &a = tri.v[0], &b = tri.v[1], &c = tri.v[2];
+            // counter clockwise is front facing as in GL
+            if ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x) <= 0)
+                continue;
+            tri.xmin = std::max(0, (int)std::floor(std::min(a.x, std::min(b.x, c.x))));
+            tri.xmax = std::min((int)width - 1, (int)std::floor(std::max(a.x, std::max(b.x, c.x))));
+            tri.ymin = std::max(0, (int)std::floor(std::min(a.y, std::min(b.y, c.y))));
+            tri.ymax = std::min((int)height - 1, (int)std::floor(std::max(a.y, std::max(b.y, c.y))));
+            if (tri.xmin > tri.xmax || tri.ymin > tri.ymax)
+                continue;
+            for (int band = tri.ymin / BAND_HEIGHT; band <= tri.ymax / (int)BAND_HEIGHT; band++)
+                bins[band].push_back(triangles.size());
+            triangles.push_back(tri);
+        }
+    }
+
+    void OcclusionBuffer::Finish(common::ThreadPool *pool)
+    {
+        if (pool)
+            pool->Run(bins.size(), [this](unsigned int band) { rasterize_band(band); });
+        else
+            for (unsigned int band = 0; band < bins.size(); band++)
+                rasterize_band(band);
+        build_hiz();
+    }
+
+    void OcclusionBuffer::rasterize_band(unsigned int band)
+    {
+        int y0 = band * BAND_HEIGHT;
+        int y1 = std::min(height, y0 + BAND_HEIGHT);
+        std::fill(hiz[0].begin() + y0 * width, hiz[0].begin() + y1 * width, 1.0f);
+        for (auto idx : bins[band])
+            rasterize(triangles[idx], y0, y1);
+    }
+
+    // Edge functions and depth are planes over the screen, evaluated at
+    // pixel centers four pixels at a time. A pixel is covered when it is on
+    // the inner side of all three edges.
+    void OcclusionBuffer::rasterize(const ScreenTriangle &tri, int y0, int y1)
+    {
+        const glm::vec3 &a = tri.v[0], &b = tri.v[1], &c = tri.v[2];
+        const glm::vec3 *from[3] = {&b, &c, &a}, *to[3] = {&c, &a, &b};
+        float ex[3], ey[3], e0[3];
+        for (int i = 0; i < 3; i++)
+        {
+            ex[i] = -(to[i]->y - from[i]->y);
+            ey[i] = to[i]->x - from[i]->x;
+            e0[i] = -ex[i] * from[i]->x - ey[i] * from[i]->y;
+        }
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        float dzb = b.z - a.z, dzc = c.z - a.z;
+        float zx = ((c.y - a.y) * dzb - (b.y - a.y) * dzc) / area;
+        float zy = ((b.x - a.x) * dzc - (c.x - a.x) * dzb) / area;
+        float z0 = a.z - zx * a.x - zy * a.y;
+
+        int ystart = std::max(y0, tri.ymin), yend = std::min(y1 - 1, tri.ymax);
+        int xstart = tri.xmin & ~3;
+        for (int y = ystart; y <= yend; y++)
+        {
+            float py = y + 0.5f;
+            float *row = hiz[0].data() + y * width;
+#if defined(OCCLUSION_SSE)
+            __m128 step = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+            __m128 edge[3], edge_step[3];
+            for (int i = 0; i < 3; i++)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps((float)xstart), step);
+                edge[i] = _mm_add_ps(_mm_set1_ps(e0[i] + ey[i] * py), _mm_mul_ps(_mm_set1_ps(ex[i]), px));
+                edge_step[i] = _mm_set1_ps(ex[i] * 4);
+            }
+            __m128 depth = _mm_add_ps(_mm_set1_ps(z0 + zy * py),
+                                      _mm_mul_ps(_mm_set1_ps(zx), _mm_add_ps(_mm_set1_ps((float)xstart), step)));
+            __m128 depth_step = _mm_set1_ps(zx * 4);
+            __m128 zero = _mm_setzero_ps();
+            for (int x = xstart; x <= tri.xmax; x += 4)
+            {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edge[0], zero), _mm_cmpge_ps(edge[1], zero)),
+                                           _mm_cmpge_ps(edge[2], zero));
+                if (_mm_movemask_ps(inside))
+                {
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_and_ps(inside, _mm_cmplt_ps(depth, old));
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(nearer, depth), _mm_andnot_ps(nearer, old)));
+                }
+                for (int i = 0; i < 3; i++)
+                    edge[i] = _mm_add_ps(edge[i], edge_step[i]);
+                depth = _mm_add_ps(depth, depth_step);
+            }
+#else
+            for (int x = xstart; x <= tri.xmax; x++)
+            {
+                float px = x + 0.5f;
+                if (e0[0] + ex[0] * px + ey[0] * py < 0 ||
+                    e0[1] + ex[1] * px + ey[1] * py < 0 ||
+                    e0[2] + ex[2] * px + ey[2] * py < 0)
+                    continue;
+                row[x] = std::min(row[x], z0 + zx * px + zy * py);
+            }
+#endif
+        }
+    }
+
+    void OcclusionBuffer::build_hiz()
+    {
+        for (unsigned int l = 1; l < hiz.size(); l++)
+        {
+            auto &src = hiz[l - 1];
+            glm::uvec2 src_size = level_size[l - 1], size = level_size[l];
+            for (unsigned int y = 0; y < size.y; y++)
+            {
+                unsigned int sy0 = y * 2, sy1 = std::min(sy0 + 1, src_size.y - 1);
+                for (unsigned int x = 0; x < size.x; x++)
+                {
+                    unsigned int sx0 = x * 2, sx1 = std::min(sx0 + 1, src_size.x - 1);
+                    hiz[l][y * size.x + x] = std::max(std::max(src[sy0 * src_size.x + sx0], src[sy0 * src_size.x + sx1]),
+                                                      std::max(src[sy1 * src_size.x + sx0], src[sy1 * src_size.x + sx1]));
+                }
+            }
+        }
+    }
+
+    // The nearest corner is compared to the farthest occluder depth over the
+    // screen rectangle of the box, read from the level where the rectangle
+    // spans at most 2x2 texels.
+    bool OcclusionBuffer::TestBox(const common::BoundingBox &box) const
+    {
+        if (triangles.empty())
+            return true;
+        glm::vec2 min(1e30f), max(-1e30f);
+        float zmin = 1.0f;
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec4 p = view_projection * glm::vec4(i & 1 ? box.max.x : box.min.x,
+                                                      i & 2 ? box.max.y : box.min.y,
+                                                      i & 4 ? box.max.z : box.min.z, 1.0f);
+            if (p.w < near)
+                return true;
+            glm::vec2 screen((p.x / p.w * 0.5f + 0.5f) * width, (p.y / p.w * 0.5f + 0.5f) * height);
+            min = glm::min(min, screen);
+            max = glm::max(max, screen);
+            zmin = std::min(zmin, p.z / p.w * 0.5f + 0.5f);
+        }
+        int x0 = std::max(0, (int)std::floor(min.x)), x1 = std::min((int)width - 1, (int)std::floor(max.x));
+        int y0 = std::max(0, (int)std::floor(min.y)), y1 = std::min((int)height - 1, (int)std::floor(max.y));
+        // off screen, left to the frustum test
+        if (x0 > x1 || y0 > y1)
+            return true;
+
+        unsigned int level = 0;
+        while (level + 1 < hiz.size() && (x1 - x0 > 1 || y1 - y0 > 1))
+        {
+            level++;
+            x0 >>= 1, x1 >>= 1, y0 >>= 1, y1 >>= 1;
+        }
+        auto &depth = hiz[level];
+        unsigned int level_width = level_size[level].x;
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                if (depth[y * level_width + x] >= zmin)
+                    return true;
+        return false;
+    }
+
+    bool OcclusionBuffer::DumpPGM(const std::string &pth) const
+    {
+        std::ofstream f(pth, std::ios::binary);
+        if (!f)
+            return false;
+        auto &depth = hiz[0];
+        float dmin = 1.0f, dmax = 0.0f;
+        for (auto d : depth)
+            if (d < 1.0f)
+            {
+                dmin = std::min(dmin, d);
+                dmax = std::max(dmax, d);
+            }
+        float range = std::max(dmax - dmin, 1e-6f);
+        std::vector<unsigned char> pixels(width * height);
+        for (unsigned int y = 0; y < height; y++)
+            for (unsigned int x = 0; x < width; x++)
+            {
+                float d = depth[y * width + x];
+                // rows are written top first
+                pixels[(height - 1 - y) * width + x] = d >= 1.0f ? 0 : (unsigned char)(255 - 191 * (d - dmin) / range);
+            }
+        f << "P5\n"
+          << width << " " << height << "\n255\n";
+        f.write((const char *)pixels.data(), pixels.size());
+        return (bool)f;
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "../common/common.h"
+#include "../common/thread_pool.h"
+#include "camera.h"
+#include <string>
+#include <vector>
+
+namespace renderer
+{
+    // Low resolution depth buffer the occluder meshes are rasterized into on
+    // the CPU. Boxes are tested against a pyramid of its farthest depths, so
+    // hidden objects never reach the draw list. Depth is window space z in
+    // [0, 1] and rows go from bottom to top as in GL.
+    class OcclusionBuffer
+    {
+    public:
+        // rows rasterized by one task
+        static const unsigned int BAND_HEIGHT = 16;
+
+        // width is rounded up to a multiple of 4 for the SIMD rows
+        OcclusionBuffer(unsigned int width = 320, unsigned int height = 192);
+
+        // Drops the occluders of the last frame and takes the view of cam
+        void Begin(CameraParameters &cam);
+        // Transforms the triangles of mesh and bins them into bands. Back
+        // faces and triangles crossing the near plane are skipped, which
+        // only makes the buffer less occluding.
+        void AddOccluder(const common::ModelMesh &mesh, const glm::mat4 &model);
+        // Rasterizes the bands, as parallel tasks with a pool, and builds the pyramid
+        void Finish(common::ThreadPool *pool = nullptr);
+
+        // false only if the box is hidden behind the occluders
+        bool TestBox(const common::BoundingBox &box) const;
+
+        // Writes the depth buffer as a binary PGM, near is bright and empty black
+        bool DumpPGM(const std::string &pth) const;
+
+        unsigned int Width() const
+        {
+            return width;
+        }
+
+        unsigned int Height() const
+        {
+            return height;
+        }
+
+        unsigned int TriangleCount() const
+        {
+            return triangles.size();
+        }
+
+        float Depth(unsigned int x, unsigned int y) const
+        {
+            return hiz[0][y * width + x];
+        }
+
+    private:
+        struct ScreenTriangle
+        {
+            // x and y in pixels, z is the depth
+            glm::vec3 v[3];
+            int xmin, xmax, ymin, ymax;
+        };
+
+        unsigned int width;
+        unsigned int height;
+        float near;
+        glm::mat4 view_projection;
+        std::vector<glm::vec4> clip_pos;
+        std::vector<ScreenTriangle> triangles;
+        // triangles touching each band of BAND_HEIGHT rows
+        std::vector<std::vector<unsigned int>> bins;
+        // hiz[0] is the depth buffer, every further level keeps the farthest
+        // depth of 2x2 texels of the one below
+        std::vector<std::vector<float>> hiz;
+        std::vector<glm::uvec2> level_size;
+
+        void rasterize_band(unsigned int band);
+        void rasterize(const ScreenTriangle &tri, int y0, int y1);
+        void build_hiz();
+    };
+}
+
+#endif
@@ -3,22 +3,84 @@
 namespace renderer
 {
     const int max_octlayer = 10;
+    // the bulk build encodes at most 21 levels below the root, which bounds how far it can grow
+    const int max_root_grow = 21 - max_octlayer;
+    // objects below which a subtree is culled by one task
+    const unsigned int cull_grain = 2048;
+    // smaller subtrees are cheaper to fix up object by object than to rebuild
+    const unsigned int min_rebuild_objects = 64;
 
-    void RenderLayer::insert_obj(std::shared_ptr<render_queue_node> &now, RenderMode mode, std::shared_ptr<RenderQueueItem> &item)
+    void RenderLayer::insert_obj(node_id now, RenderMode mode, std::shared_ptr<RenderQueueItem> &item, node_id stop)
     {
-        auto &box = item->args->box;
-        auto &objs = now->content.objects;
-        if (now->depth >= max_octlayer)
-            return insert_obj_to_node(now, mode, item);
-        int subnode = now->SubNodeTest(box);
+        auto &tree = render_queue[mode];
+        if (!tree[now].IsLeaf())
+        {
+            int subnode = tree.SubNodeTest(now, item->args->box);
+            if (subnode != -1)
+                return insert_obj(tree[now].subnodes + subnode, mode, item, stop);
+        }
+        insert_obj_to_node(now, mode, item, stop);
+        if (tree[now].IsLeaf() && tree[now].content.subtree_objcnt > split_threshold)
+            split_leaf(mode, now);
+    }
 
-        if (subnode != -1)
+    // Splits the leaf now and moves down the objects that fit into a child
+    void RenderLayer::split_leaf(RenderMode mode, node_id now)
+    {
+        auto &tree = render_queue[mode];
+        if (tree[now].depth >= max_octlayer)
+            return;
+        frame_stats[mode].splits++;
+        split_node(tree, now);
+        auto &content = tree[now].content;
+        // detach_obj swaps the last object into the slot, walking backwards
+        // only ever swaps in objects that were already looked at
+        for (unsigned int i = content.objects.size(); i-- > 0;)
+        {
+            int subnode = tree.SubNodeTest(now, content.boxes[i]);
+            if (subnode == -1)
+                continue;
+            auto item = content.objects[i];
+            detach_obj(now, mode, i);
+            insert_obj(tree[now].subnodes + subnode, mode, item, now);
+        }
+    }
+
+    // Decreases subtree_objcnt from now up to stop, stop excluded, and merges
+    // the highest inner node that fell below merge_threshold
+    void RenderLayer::release_obj_count(RenderMode mode, node_id now, node_id stop)
+    {
+        auto &tree = render_queue[mode];
+        node_id merged = common::OCT_NULL;
+        for (node_id nd = now; nd != stop; nd = tree[nd].father)
         {
-            if (now->subnodes[0] == nullptr)
-                split_node(now);
-            return insert_obj(now->subnodes[subnode], mode, item);
+            if (--tree[nd].content.subtree_objcnt < merge_threshold && !tree[nd].IsLeaf())
+                merged = nd;
         }
-        insert_obj_to_node(now, mode, item);
+        if (merged != common::OCT_NULL)
+            merge_node(mode, merged);
+    }
+
+    // Pulls every object of the subtree up into now and releases its children
+    void RenderLayer::merge_node(RenderMode mode, node_id now)
+    {
+        auto &tree = render_queue[mode];
+        frame_stats[mode].merges++;
+        std::vector<node_id> stack(1, now);
+        while (!stack.empty())
+        {
+            auto &node = tree[stack.back()];
+            stack.pop_back();
+            if (!node.IsLeaf())
+                for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+                {
+                    auto &content = tree[sub].content;
+                    for (unsigned int i = 0; i < content.objects.size(); i++)
+                        attach_obj(now, mode, content.objects[i], content.boxes[i]);
+                    stack.push_back(sub);
+                }
+        }
+        tree.Collapse(now);
     }
 
     void RenderLayer::RemoveObject(render_id id, RenderMode mode)
@@ -27,23 +89,30 @@ namespace renderer
         auto it = obj_idxs.find(id);
         if (it == obj_idxs.end())
             return;
-
-        auto &index = it->second;
-        auto &now = index.node;
-        auto &content = now->content;
-        content.objects.erase(index.it);
-        obj_idxs.erase(it);
-
-        std::shared_ptr<render_queue_node> combined = nullptr;
-        for (auto &nd = now; nd != nullptr; nd = nd->father)
+        if (it->second.node == common::OCT_NULL)
         {
-            --nd->content.subtree_objcnt;
-            if (!nd->content.subtree_objcnt)
-                combined = nd;
+            auto &pending = bulk_items[mode];
+            for (auto pit = pending.begin(); pit != pending.end(); ++pit)
+                if ((*pit)->id == id)
+                {
+                    pending.erase(pit);
+                    break;
+                }
+            obj_idxs.erase(it);
+            return;
         }
-        if (combined != nullptr && now->subnodes[0] != nullptr)
-            for (int i = 0; i < 8; i++)
-                now->subnodes[i] = nullptr;
+        if (accel == ACCEL_BVH)
+        {
+            remove_bvh(mode, it->second);
+            obj_idxs.erase(it);
+            return;
+        }
+
+        node_id now = it->second.node;
+        unsigned int slot = it->second.slot;
+        obj_idxs.erase(it);
+        detach_obj(now, mode, slot);
+        release_obj_count(mode, now, common::OCT_NULL);
     }
 
     void RenderLayer::UpdateObject(render_id id, RenderMode mode)
@@ -51,34 +120,1225 @@ namespace renderer
         auto &obj_idxs = object_index[mode];
         auto it = obj_idxs.find(id);
 
-        if (it == obj_idxs.end())
+        if (it == obj_idxs.end() || it->second.node == common::OCT_NULL)
             return;
-        auto &index = it->second;
-        auto &item = *(index.it);
-        auto &now = index.node;
+        if (accel == ACCEL_BVH)
+        {
+            auto &queue = bvh_queue[mode];
+            auto &index = it->second;
+            auto &args = *queue.objects[index.slot]->args;
+            queue.boxes[index.slot] = args.box;
+            queue.thresholds[index.slot] = args.contribution_threshold;
+            index.dirty = false;
+            if (index.node != BVH_PENDING)
+                queue.tree.RefitUp(index.node, queue.boxes.data());
+            return;
+        }
+        relocate_obj(mode, it->second);
+    }
+
+    void RenderLayer::CommitUpdates(unsigned int thread_cnt)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            if (accel == ACCEL_BVH)
+            {
+                commit_bvh(RenderMode(i));
+                continue;
+            }
+            auto &dirty = dirty_objects[i];
+            if (dirty.empty())
+                continue;
+            RenderMode mode = RenderMode(i);
+            auto &tree = render_queue[mode];
+            auto &obj_idxs = object_index[mode];
+            // the root grows for all new boxes first, growing moves the old
+            // root to another node id, which the counts below are keyed by
+            moved_objects.clear();
+            moved_counts.clear();
+            for (auto id : dirty)
+            {
+                auto it = obj_idxs.find(id);
+                // removed or already placed again since it was marked
+                if (it == obj_idxs.end() || !it->second.dirty)
+                    continue;
+                auto &index = it->second;
+                index.dirty = false;
+                auto &args = *tree[index.node].content.objects[index.slot]->args;
+                auto &box = args.box;
+                if (tree[tree.Root()].box.LooseTest(box) != common::BoundingBox::BOX_INCLUDE)
+                    fit_root(mode, box);
+                tree[index.node].content.boxes[index.slot] = box;
+                tree[index.node].content.thresholds[index.slot] = args.contribution_threshold;
+                moved_objects.push_back(&index);
+            }
+            dirty.clear();
+            // objects that are still in the right node cost nothing, only count the others
+            unsigned int moved_cnt = 0;
+            for (auto index : moved_objects)
+            {
+                if (!need_relocate(tree, *index))
+                    continue;
+                moved_objects[moved_cnt++] = index;
+                // counted in every subtree that holds both its old and new place
+                auto &box = tree[index->node].content.boxes[index->slot];
+                for (node_id nd = relocation_target(tree, index->node, box); nd != common::OCT_NULL; nd = tree[nd].father)
+                    moved_counts[nd]++;
+            }
+            moved_objects.resize(moved_cnt);
+
+            // the highest subtree on the way of an object in which enough
+            // objects moved is rebuilt, which takes every object moving
+            // inside it along. Subtrees picked this way never nest.
+            rebuild_nodes.clear();
+            for (auto index : moved_objects)
+            {
+                auto &box = tree[index->node].content.boxes[index->slot];
+                node_id pick = common::OCT_NULL;
+                for (node_id nd = relocation_target(tree, index->node, box); nd != common::OCT_NULL; nd = tree[nd].father)
+                {
+                    unsigned int objects = tree[nd].content.subtree_objcnt;
+                    if (objects >= min_rebuild_objects && moved_counts[nd] > objects * rebuild_threshold)
+                        pick = nd;
+                }
+                if (pick != common::OCT_NULL && std::find(rebuild_nodes.begin(), rebuild_nodes.end(), pick) == rebuild_nodes.end())
+                    rebuild_nodes.push_back(pick);
+            }
+            // before relocating, which may merge nodes away
+            for (auto nd : rebuild_nodes)
+                rebuild(mode, nd, thread_cnt);
+            // objects placed by a rebuild are found in the right node
+            for (auto index : moved_objects)
+                relocate_obj(mode, *index);
+        }
+    }
+
+    // The nearest node from now up that holds box, the root if none does
+    node_id RenderLayer::relocation_target(render_queue_tree &tree, node_id now, common::BoundingBox &box)
+    {
+        while (now != tree.Root() && tree[now].box.LooseTest(box) != common::BoundingBox::BOX_INCLUDE)
+            now = tree[now].father;
+        return now;
+    }
+
+    bool RenderLayer::need_relocate(render_queue_tree &tree, RenderQueueIndex &index)
+    {
+        auto &node = tree[index.node];
+        auto &box = node.content.boxes[index.slot];
+        if (node.box.LooseTest(box) != common::BoundingBox::BOX_INCLUDE)
+            return index.node != tree.Root() || node.depth > -max_root_grow;
+        // objects stay in a leaf until it splits
+        return !node.IsLeaf() && tree.SubNodeTest(index.node, box) != -1;
+    }
+
+    // Grows the root until it holds box. Only the old root moves, the rest of
+    // the tree keeps its nodes and objects.
+    void RenderLayer::fit_root(RenderMode mode, common::BoundingBox &box)
+    {
+        auto &tree = render_queue[mode];
+        node_id root = tree.Root();
+        while (tree[root].depth > -max_root_grow &&
+               tree[root].box.LooseTest(box) != common::BoundingBox::BOX_INCLUDE)
+        {
+            node_id moved = tree.Grow(box);
+            auto &old = tree[moved].content;
+            auto &content = tree[root].content;
+            content.init();
+            content.subtree_objcnt = old.subtree_objcnt;
+            for (auto &obj : old.objects)
+                object_index[mode][obj->id].node = moved;
+            for (node_id sub = tree[root].subnodes; sub < tree[root].subnodes + 8; sub++)
+                if (sub != moved)
+                    tree[sub].content.init();
+        }
+    }
+
+    void RenderLayer::SetWorldBound(glm::vec3 min, glm::vec3 max, unsigned int thread_cnt)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            auto &tree = render_queue[i];
+            std::vector<std::shared_ptr<RenderQueueItem>> items;
+            collect_objs(tree, tree.Root(), items);
+            tree.Reset(common::BoundingBox(min, max, 1.0));
+            tree[tree.Root()].content.init();
+            BulkInsert(RenderMode(i), items, thread_cnt);
+        }
+    }
+
+    // Moves the object up to the nearest node that still holds its box and
+    // reinserts it from there, only the counts below that node are touched
+    void RenderLayer::relocate_obj(RenderMode mode, RenderQueueIndex &index)
+    {
+        auto &tree = render_queue[mode];
+        auto item = tree[index.node].content.objects[index.slot];
         auto &box = item->args->box;
-        if (now->box.LooseTest(box) != common::BoundingBox::BOX_INCLUDE)
+        // placed with its current box, a pending mark has nothing left to do
+        index.dirty = false;
+        if (tree[tree.Root()].box.LooseTest(box) != common::BoundingBox::BOX_INCLUDE)
+            fit_root(mode, box);
+        tree[index.node].content.boxes[index.slot] = box;
+        tree[index.node].content.thresholds[index.slot] = item->args->contribution_threshold;
+        if (!need_relocate(tree, index))
+            return;
+        frame_stats[mode].relocations++;
+        node_id now = index.node;
+        node_id target = relocation_target(tree, now, box);
+
+        detach_obj(now, mode, index.slot);
+        release_obj_count(mode, now, target);
+        insert_obj(target, mode, item, target);
+    }
+
+    // Builds the subtree of now again from its objects. They stay below
+    // now, so the counts above it do not change.
+    void RenderLayer::rebuild(RenderMode mode, node_id now, unsigned int thread_cnt)
+    {
+        auto &tree = render_queue[mode];
+        frame_stats[mode].rebuilds++;
+        std::vector<std::shared_ptr<RenderQueueItem>> items;
+        items.reserve(tree[now].content.subtree_objcnt);
+        collect_objs(tree, now, items);
+        tree.Collapse(now);
+        tree[now].content.objects.clear();
+        tree[now].content.boxes.clear();
+        tree[now].content.thresholds.clear();
+        tree[now].content.init();
+        bulk_build(now, mode, items, thread_cnt);
+    }
+
+    void RenderLayer::collect_objs(render_queue_tree &tree, node_id now, std::vector<std::shared_ptr<RenderQueueItem>> &items)
+    {
+        auto &node = tree[now];
+        items.insert(items.end(), node.content.objects.begin(), node.content.objects.end());
+        if (!node.IsLeaf())
+            for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+                collect_objs(tree, sub, items);
+    }
+
+    void RenderLayer::BulkInsert(RenderMode mode, std::vector<std::shared_ptr<RenderQueueItem>> &items, unsigned int thread_cnt)
+    {
+        unsigned int cnt = items.size();
+        if (!cnt)
+            return;
+        if (accel == ACCEL_BVH)
+        {
+            for (auto &item : items)
+                insert_bvh(mode, item);
+            return build_bvh(mode);
+        }
+        auto &tree = render_queue[mode];
+        common::BoundingBox bound = items[0]->args->box;
+        for (auto &item : items)
+        {
+            bound.min = glm::min(bound.min, item->args->box.min);
+            bound.max = glm::max(bound.max, item->args->box.max);
+        }
+        fit_root(mode, bound);
+        bulk_build(tree.Root(), mode, items, thread_cnt);
+    }
+
+    // Adds items to the subtree of now, Morton coded within its box
+    void RenderLayer::bulk_build(node_id now, RenderMode mode, std::vector<std::shared_ptr<RenderQueueItem>> &items, unsigned int thread_cnt)
+    {
+        auto &tree = render_queue[mode];
+        unsigned int cnt = items.size();
+        auto &node = tree[now];
+        int levels = std::min(max_octlayer - node.depth, 21);
+        if (levels <= 0)
         {
-            RemoveObject(id, mode);
-            InsertObject(mode, item);
+            for (auto &item : items)
+                insert_obj_to_node(now, mode, item, node.father);
             return;
         }
-        if (now->depth >= max_octlayer)
+
+        std::vector<common::SortEntry> entries(cnt);
+        std::vector<common::SortEntry> scratch(cnt);
+        glm::vec3 origin = node.box.min;
+        glm::vec3 scale = float(1 << levels) / (node.box.max - node.box.min);
+        float maxcell = float((1 << levels) - 1);
+        auto encode = [&](unsigned int st, unsigned int ed) {
+            for (unsigned int i = st; i < ed; i++)
+            {
+                auto &box = items[i]->args->box;
+                glm::vec3 cell = glm::clamp(((box.min + box.max) * 0.5f - origin) * scale, 0.0f, maxcell);
+                entries[i].key = common::MortonEncode(cell.x, cell.y, cell.z);
+                entries[i].value = i;
+            }
+        };
+        thread_cnt = std::max(1u, std::min(thread_cnt, cnt / 4096));
+        if (thread_cnt == 1)
+            encode(0, cnt);
+        else
+        {
+            unsigned int chunk = (cnt + thread_cnt - 1) / thread_cnt;
+            common::ThreadPool::GetInstance()->Run((cnt + chunk - 1) / chunk, [&](unsigned int i) {
+                encode(i * chunk, std::min((i + 1) * chunk, cnt));
+            });
+        }
+
+        common::SortEntry *sorted = common::RadixSort(entries.data(), scratch.data(), cnt, levels * 3);
+        // the build passes over the items once per level, keep their boxes in sorted order
+        std::vector<common::BoundingBox> boxes(cnt);
+        for (unsigned int i = 0; i < cnt; i++)
+            boxes[i] = items[sorted[i].value]->args->box;
+        build_subtree(now, mode, items, sorted, boxes.data(), cnt, levels);
+    }
+
+    // entries hold the items whose center lies in the cell of now, sorted by
+    // Morton code, levels is the number of code levels below now
+    void RenderLayer::build_subtree(
+        node_id now,
+        RenderMode mode,
+        std::vector<std::shared_ptr<RenderQueueItem>> &items,
+        common::SortEntry *entries,
+        common::BoundingBox *boxes,
+        unsigned int cnt,
+        unsigned int levels)
+    {
+        auto &tree = render_queue[mode];
+        tree[now].content.subtree_objcnt += cnt;
+        bool keep = tree[now].IsLeaf() && tree[now].content.subtree_objcnt <= split_threshold;
+        if (tree[now].depth >= max_octlayer || !levels || keep)
+        {
+            for (unsigned int i = 0; i < cnt; i++)
+                attach_obj(now, mode, items[entries[i].value], boxes[i]);
             return;
-        int subnode = now->SubNodeTest(box);
-        if (subnode == -1)
+        }
+
+        // items of one child are contiguous, those that fit into the child
+        // are moved to the front of the child's range, the rest stay here
+        unsigned int shift = (levels - 1) * 3;
+        unsigned int st[8], fit[8];
+        unsigned int i = 0;
+        bool descend = false;
+        for (unsigned int sub = 0; sub < 8; sub++)
+        {
+            st[sub] = fit[sub] = i;
+            for (; i < cnt && ((entries[i].key >> shift) & 7) == sub; i++)
+            {
+                if (tree.SubNodeTest(now, boxes[i]) == int(sub))
+                {
+                    boxes[fit[sub]] = boxes[i];
+                    entries[fit[sub]++] = entries[i];
+                }
+                else
+                    attach_obj(now, mode, items[entries[i].value], boxes[i]);
+            }
+            descend |= fit[sub] != st[sub];
+        }
+        if (!descend)
+            return;
+        // objects the leaf held before the build move down as well
+        if (tree[now].IsLeaf())
+            split_leaf(mode, now);
+        node_id first = tree[now].subnodes;
+        for (unsigned int sub = 0; sub < 8; sub++)
+            if (fit[sub] != st[sub])
+                build_subtree(first + sub, mode, items, entries + st[sub], boxes + st[sub], fit[sub] - st[sub], levels - 1);
+    }
+
+    void RenderLayer::SetAccelType(AccelType type, unsigned int thread_cnt)
+    {
+        if (type == accel)
+            return;
+        std::vector<std::shared_ptr<RenderQueueItem>> items[3];
+        for (int i = 0; i < 3; i++)
+        {
+            if (accel == ACCEL_BVH)
+            {
+                auto &queue = bvh_queue[i];
+                for (auto &obj : queue.objects)
+                    if (obj)
+                        items[i].push_back(obj);
+                queue.tree.Clear();
+                queue.objects.clear();
+                queue.boxes.clear();
+                queue.thresholds.clear();
+                queue.built_cnt = queue.removed_cnt = 0;
+            }
+            else
+            {
+                auto &tree = render_queue[i];
+                node_id root = tree.Root();
+                collect_objs(tree, root, items[i]);
+                tree.Collapse(root);
+                tree[root].content.objects.clear();
+                tree[root].content.boxes.clear();
+                tree[root].content.thresholds.clear();
+                tree[root].content.init();
+            }
+        }
+        accel = type;
+        for (int i = 0; i < 3; i++)
+            BulkInsert(RenderMode(i), items[i], thread_cnt);
+    }
+
+    // Drops the views that cannot see the box and narrows the planes of the
+    // others, returns whether any view is left. View 0 also drops the box
+    // when it is occluded and is the one that keeps last_plane up to date.
+    bool RenderLayer::test_node(const common::BoundingBox &box, unsigned char &last_plane, CullState &state, CullStats &stats)
+    {
+        bool inside = all_inside(state);
+        for (unsigned int v = 0; v < cull_view_cnt; v++)
+        {
+            if (!(state.views >> v & 1) || !state.planes[v])
+                continue;
+            unsigned int mask = state.planes[v];
+            unsigned char plane = last_plane;
+            if (cull_views[v]->Test(box, mask, plane, stats.plane_tests) == CameraParameters::FRUSTUM_SEPARATE)
+                state.views &= ~(1u << v);
+            else
+                state.planes[v] = mask;
+            if (!v)
+                last_plane = plane;
+        }
+        if (!state.views)
+        {
+            stats.nodes_rejected++;
+            return false;
+        }
+        if ((state.views & 1) && cull_occlusion && !cull_occlusion->TestBox(box))
+        {
+            stats.nodes_occluded++;
+            state.views &= ~1u;
+            if (!state.views)
+                return false;
+        }
+        stats.nodes_accepted += !inside && all_inside(state);
+        return true;
+    }
+
+    // Whether the node is fully inside every view left
+    bool RenderLayer::all_inside(const CullState &state)
+    {
+        for (unsigned int v = 0; v < cull_view_cnt; v++)
+            if ((state.views >> v & 1) && state.planes[v])
+                return false;
+        return true;
+    }
+
+    // Whether an object with box and its own threshold is large enough on
+    // the screen of view to be kept, its area goes to areas for view 0
+    bool RenderLayer::contributes(unsigned int view, const common::BoundingBox &box, float threshold, std::vector<float> *areas)
+    {
+        float min_area = cull_contribution->min_area[view];
+        bool keep_area = !view && areas;
+        if (min_area < 0 && !keep_area)
+            return true;
+        float area = cull_views[view]->ScreenArea(box);
+        if (min_area >= 0 && area < (threshold >= 0 ? threshold : min_area))
+            return false;
+        if (keep_area)
+            areas->push_back(area);
+        return true;
+    }
+
+    // Appends each object in slots [st, ed) to the lists of the views that
+    // see it. The boxes are tested in batches for the SIMD kernel, once per
+    // view, and the views seeing an object are collected as a bitmask.
+    void RenderLayer::cull_range(ObjectList &objects, std::vector<common::BoundingBox> &boxes, std::vector<float> &thresholds,
+                                 unsigned int st, unsigned int ed, const CullState &state, ObjectList *out, std::vector<float> *areas,
+                                 CullStats &stats)
+    {
+        const unsigned int batch = 64;
+        CameraParameters::frustum_relation rel[batch];
+        unsigned char seen[batch];
+        for (unsigned int i = st; i < ed; i += batch)
+        {
+            unsigned int cnt = std::min(ed - i, batch);
+            std::fill(seen, seen + cnt, 0);
+            for (unsigned int v = 0; v < cull_view_cnt; v++)
+            {
+                if (!(state.views >> v & 1))
+                    continue;
+                if (!state.planes[v])
+                {
+                    for (unsigned int j = 0; j < cnt; j++)
+                        seen[j] |= 1 << v;
+                    continue;
+                }
+                cull_views[v]->TestBatch(boxes.data() + i, cnt, rel, state.planes[v]);
+                for (unsigned int j = 0; j < cnt; j++)
+                    if (rel[j] != CameraParameters::FRUSTUM_SEPARATE)
+                        seen[j] |= 1 << v;
+            }
+            for (unsigned int j = 0; j < cnt; j++)
+            {
+                if ((seen[j] & 1) && cull_occlusion && !cull_occlusion->TestBox(boxes[i + j]))
+                {
+                    stats.objects_occluded++;
+                    seen[j] &= ~1;
+                }
+                for (unsigned int v = 0; seen[j] >> v; v++)
+                {
+                    if (!(seen[j] >> v & 1))
+                        continue;
+                    if (cull_contribution && !contributes(v, boxes[i + j], thresholds[i + j], areas))
+                    {
+                        stats.objects_small++;
+                        continue;
+                    }
+                    out[v].push_back(objects[i + j]);
+                }
+            }
+        }
+    }
+
+    void RenderLayer::MultiViewCull(RenderMode mode, CameraParameters *const *views, unsigned int view_cnt, ObjectList *out,
+                                    common::ThreadPool *pool, const OcclusionBuffer *occlusion, const ContributionCull *contribution)
+    {
+        view_cnt = std::min(view_cnt, MAX_CULL_VIEWS);
+        if (!view_cnt)
+            return;
+        auto &tree = render_queue[mode];
+        auto &queue = bvh_queue[mode];
+        auto &stats = frame_stats[mode].cull;
+        unsigned int total = accel == ACCEL_OCTREE ? tree[tree.Root()].content.subtree_objcnt : queue.built_cnt;
+        cull_views = views;
+        cull_view_cnt = view_cnt;
+        cull_occlusion = occlusion;
+        cull_contribution = contribution;
+        std::vector<float> *areas = contribution ? contribution->areas : nullptr;
+        CullState state;
+        state.views = (1u << view_cnt) - 1;
+        for (unsigned int v = 0; v < view_cnt; v++)
+            state.planes[v] = CameraParameters::ALL_PLANES;
+        if (accel == ACCEL_BVH && queue.last_planes.size() < queue.tree.IndexBound())
+            queue.last_planes.resize(queue.tree.IndexBound(), 0);
+        if (!pool || total <= cull_grain)
+        {
+            if (accel == ACCEL_OCTREE)
+                cull_octree(tree, tree.Root(), state, out, areas, stats);
+            else
+                cull_bvh(queue, queue.tree.Root(), state, out, areas, stats);
+        }
+        else
+        {
+            // the tasks are made in the order of a serial traversal and their
+            // buffers joined in that order, so the result does not depend on
+            // which worker ran what
+            cull_task_cnt = 0;
+            if (accel == ACCEL_OCTREE)
+                split_cull_octree(tree, tree.Root(), state, stats);
+            else
+                split_cull_bvh(queue, queue.tree.Root(), state, stats);
+            pool->Run(cull_task_cnt, [&](unsigned int i) {
+                auto &task = cull_tasks[i];
+                for (unsigned int v = 0; v < view_cnt; v++)
+                    task.out[v].clear();
+                task.areas.clear();
+                task.stats = CullStats();
+                std::vector<float> *task_areas = areas ? &task.areas : nullptr;
+                if (accel == ACCEL_BVH)
+                    cull_bvh(queue, task.node, task.state, task.out, task_areas, task.stats);
+                else if (task.own_only)
+                    cull_node_objs(tree[task.node].content, task.state, task.out, task_areas, task.stats);
+                else
+                    cull_octree(tree, task.node, task.state, task.out, task_areas, task.stats);
+            });
+            for (unsigned int v = 0; v < view_cnt; v++)
+            {
+                size_t cnt = out[v].size();
+                for (unsigned int i = 0; i < cull_task_cnt; i++)
+                    cnt += cull_tasks[i].out[v].size();
+                out[v].reserve(cnt);
+                for (unsigned int i = 0; i < cull_task_cnt; i++)
+                    out[v].insert(out[v].end(),
+                                  std::make_move_iterator(cull_tasks[i].out[v].begin()),
+                                  std::make_move_iterator(cull_tasks[i].out[v].end()));
+            }
+            if (areas)
+                for (unsigned int i = 0; i < cull_task_cnt; i++)
+                    areas->insert(areas->end(), cull_tasks[i].areas.begin(), cull_tasks[i].areas.end());
+            for (unsigned int i = 0; i < cull_task_cnt; i++)
+                stats += cull_tasks[i].stats;
+        }
+        if (accel == ACCEL_BVH)
+        {
+            stats.object_tests += queue.objects.size() - queue.built_cnt;
+            cull_range(queue.objects, queue.boxes, queue.thresholds, queue.built_cnt, queue.objects.size(), state, out, areas, stats);
+        }
+        cull_views = nullptr;
+        cull_view_cnt = 0;
+        cull_occlusion = nullptr;
+        cull_contribution = nullptr;
+    }
+
+    void RenderLayer::push_cull_task(node_id now, const CullState &state, bool own_only)
+    {
+        if (cull_task_cnt == cull_tasks.size())
+            cull_tasks.emplace_back();
+        auto &task = cull_tasks[cull_task_cnt++];
+        task.node = now;
+        task.state = state;
+        task.own_only = own_only;
+    }
+
+    // Subtrees of at most cull_grain objects become one task each. Larger
+    // nodes are tested here, their own objects become a task of their own.
+    void RenderLayer::split_cull_octree(render_queue_tree &tree, node_id now, const CullState &state, CullStats &stats)
+    {
+        auto &node = tree[now];
+        if (node.IsLeaf() || (unsigned int)node.content.subtree_objcnt <= cull_grain)
+            return push_cull_task(now, state, false);
+        stats.nodes_visited++;
+        if (!node.content.objects.empty())
+            push_cull_task(now, state, true);
+        for (node_id subnode = node.subnodes; subnode < node.subnodes + 8; subnode++)
+        {
+            CullState sub_state = state;
+            auto &sub = tree[subnode];
+            if (test_node(sub.box, sub.tag.last_plane, sub_state, stats))
+                split_cull_octree(tree, subnode, sub_state, stats);
+        }
+    }
+
+    void RenderLayer::split_cull_bvh(BVHQueue &queue, node_id now, CullState state, CullStats &stats)
+    {
+        auto &node = queue.tree[now];
+        if (node.IsLeaf() || node.end - node.first <= cull_grain)
+            return push_cull_task(now, state, false);
+        stats.nodes_visited++;
+        if (!test_node(node.box, queue.last_planes[now], state, stats))
+            return;
+        split_cull_bvh(queue, node.left, state, stats);
+        split_cull_bvh(queue, node.left + 1, state, stats);
+    }
+
+    void RenderLayer::cull_node_objs(OctItem &content, const CullState &state, ObjectList *out, std::vector<float> *areas, CullStats &stats)
+    {
+        auto &objects = content.objects;
+        // objects seen by view 0 are still tested against the occlusion, and
+        // all of them against the contribution thresholds
+        if (all_inside(state) && !(cull_occlusion && (state.views & 1)) && !cull_contribution)
+        {
+            for (unsigned int v = 0; v < cull_view_cnt; v++)
+                if (state.views >> v & 1)
+                    out[v].insert(out[v].end(), objects.begin(), objects.end());
+            return;
+        }
+        stats.object_tests += objects.size();
+        cull_range(objects, content.boxes, content.thresholds, 0, objects.size(), state, out, areas, stats);
+    }
+
+    // state holds the views that may see the node and the planes of each it
+    // straddles, the children of a node only test those
+    void RenderLayer::cull_octree(render_queue_tree &tree, node_id now, const CullState &state, ObjectList *out, std::vector<float> *areas,
+                                  CullStats &stats)
+    {
+        auto &node = tree[now];
+        stats.nodes_visited++;
+        cull_node_objs(node.content, state, out, areas, stats);
+
+        if (!node.IsLeaf())
+        {
+            for (node_id subnode = node.subnodes; subnode < node.subnodes + 8; subnode++)
+            {
+                CullState sub_state = state;
+                auto &sub = tree[subnode];
+                if (test_node(sub.box, sub.tag.last_plane, sub_state, stats))
+                    cull_octree(tree, subnode, sub_state, out, areas, stats);
+            }
+        }
+    }
+
+    void RenderLayer::cull_bvh(BVHQueue &queue, node_id now, CullState state, ObjectList *out, std::vector<float> *areas, CullStats &stats)
+    {
+        auto &node = queue.tree[now];
+        stats.nodes_visited++;
+        if (!test_node(node.box, queue.last_planes[now], state, stats))
+            return;
+        if (!node.IsLeaf())
+        {
+            cull_bvh(queue, node.left, state, out, areas, stats);
+            cull_bvh(queue, node.left + 1, state, out, areas, stats);
             return;
-        if (now->subnodes[0] == nullptr)
-            split_node(now);
+        }
+        if (all_inside(state) && !(cull_occlusion && (state.views & 1)) && !cull_contribution)
+        {
+            auto objects = queue.objects.begin() + node.first;
+            for (unsigned int v = 0; v < cull_view_cnt; v++)
+                if (state.views >> v & 1)
+                    out[v].insert(out[v].end(), objects, objects + node.count);
+            return;
+        }
+        stats.object_tests += node.count;
+        cull_range(queue.objects, queue.boxes, queue.thresholds, node.first, node.first + node.count, state, out, areas, stats);
+    }
 
-        for (auto &nd = now; nd != nullptr; nd = nd->father)
-            --nd->content.subtree_objcnt;
+    void RenderLayer::insert_bvh(RenderMode mode, std::shared_ptr<RenderQueueItem> &item)
+    {
+        auto &queue = bvh_queue[mode];
+        auto &index = object_index[mode][item->id];
+        index.node = BVH_PENDING;
+        index.slot = queue.objects.size();
+        index.dirty = false;
+        queue.objects.push_back(item);
+        queue.boxes.push_back(item->args->box);
+        queue.thresholds.push_back(item->args->contribution_threshold);
+    }
 
-        now->content.objects.erase(index.it);
-        insert_obj(now->subnodes[subnode], mode, item);
+    // A removed pending object is swapped with the last one. Inside the tree
+    // the last live object of the leaf takes the slot, and the leaf box is
+    // left as it is until the next refit.
+    void RenderLayer::remove_bvh(RenderMode mode, RenderQueueIndex &index)
+    {
+        auto &queue = bvh_queue[mode];
+        unsigned int last;
+        if (index.node == BVH_PENDING)
+            last = queue.objects.size() - 1;
+        else
+        {
+            auto &leaf = queue.tree[index.node];
+            last = leaf.first + --leaf.count;
+            queue.removed_cnt++;
+        }
+        if (index.slot != last)
+        {
+            queue.objects[index.slot] = std::move(queue.objects[last]);
+            queue.boxes[index.slot] = queue.boxes[last];
+            queue.thresholds[index.slot] = queue.thresholds[last];
+            object_index[mode][queue.objects[index.slot]->id].slot = index.slot;
+        }
+        if (index.node == BVH_PENDING)
+        {
+            queue.objects.pop_back();
+            queue.boxes.pop_back();
+            queue.thresholds.pop_back();
+        }
+        else
+            queue.objects[last] = nullptr;
+    }
+
+    void RenderLayer::commit_bvh(RenderMode mode)
+    {
+        auto &queue = bvh_queue[mode];
+        auto &obj_idxs = object_index[mode];
+        bool refit = false;
+        for (auto id : dirty_objects[mode])
+        {
+            auto it = obj_idxs.find(id);
+            if (it == obj_idxs.end() || !it->second.dirty)
+                continue;
+            auto &index = it->second;
+            index.dirty = false;
+            auto &args = *queue.objects[index.slot]->args;
+            queue.boxes[index.slot] = args.box;
+            queue.thresholds[index.slot] = args.contribution_threshold;
+            refit |= index.node != BVH_PENDING;
+        }
+        dirty_objects[mode].clear();
+
+        unsigned int stale = queue.objects.size() - queue.built_cnt + queue.removed_cnt;
+        if (stale && stale > (queue.objects.size() - queue.removed_cnt) * rebuild_threshold)
+        {
+            frame_stats[mode].rebuilds++;
+            return build_bvh(mode);
+        }
+        if (!refit)
+            return;
+        queue.tree.Refit(queue.tree.Root(), queue.boxes.data());
+        bvh_degraded.clear();
+        queue.tree.FindDegraded(queue.tree.Root(), 1.0f + rebuild_threshold, bvh_degraded);
+        frame_stats[mode].rebuilds += bvh_degraded.size();
+        for (auto now : bvh_degraded)
+        {
+            unsigned int live = queue.tree.BuildSubtree(now, queue.boxes.data(), bvh_order.data());
+            auto &node = queue.tree[now];
+            reorder_bvh(mode, node.first, live, node.end);
+            bind_bvh_leaves(mode, now);
+        }
+    }
+
+    void RenderLayer::build_bvh(RenderMode mode)
+    {
+        auto &queue = bvh_queue[mode];
+        // drop the slots of removed objects and pick up boxes that moved meanwhile
+        unsigned int cnt = 0;
+        for (unsigned int i = 0; i < queue.objects.size(); i++)
+            if (queue.objects[i])
+            {
+                queue.boxes[cnt] = queue.objects[i]->args->box;
+                queue.thresholds[cnt] = queue.objects[i]->args->contribution_threshold;
+                queue.objects[cnt++] = std::move(queue.objects[i]);
+            }
+        queue.objects.resize(cnt);
+        queue.boxes.resize(cnt);
+        queue.thresholds.resize(cnt);
+        bvh_order.resize(std::max<size_t>(bvh_order.size(), cnt));
+        queue.tree.Build(queue.boxes.data(), bvh_order.data(), cnt);
+        reorder_bvh(mode, 0, cnt, cnt);
+        bind_bvh_leaves(mode, queue.tree.Root());
+        queue.built_cnt = cnt;
+        queue.removed_cnt = 0;
+    }
+
+    void RenderLayer::reorder_bvh(RenderMode mode, unsigned int first, unsigned int live, unsigned int end)
+    {
+        auto &queue = bvh_queue[mode];
+        ObjectList objects(live);
+        std::vector<common::BoundingBox> boxes(live);
+        std::vector<float> thresholds(live);
+        for (unsigned int i = 0; i < live; i++)
+        {
+            objects[i] = std::move(queue.objects[bvh_order[first + i]]);
+            boxes[i] = queue.boxes[bvh_order[first + i]];
+            thresholds[i] = queue.thresholds[bvh_order[first + i]];
+        }
+        std::move(objects.begin(), objects.end(), queue.objects.begin() + first);
+        std::copy(boxes.begin(), boxes.end(), queue.boxes.begin() + first);
+        std::copy(thresholds.begin(), thresholds.end(), queue.thresholds.begin() + first);
+        for (unsigned int i = first + live; i < end; i++)
+            queue.objects[i] = nullptr;
+    }
+
+    void RenderLayer::bind_bvh_leaves(RenderMode mode, node_id now)
+    {
+        auto &queue = bvh_queue[mode];
+        auto &node = queue.tree[now];
+        if (!node.IsLeaf())
+        {
+            bind_bvh_leaves(mode, node.left);
+            bind_bvh_leaves(mode, node.left + 1);
+            return;
+        }
+        for (unsigned int i = node.first; i < node.first + node.count; i++)
+        {
+            auto &index = object_index[mode][queue.objects[i]->id];
+            index.node = now;
+            index.slot = i;
+        }
+    }
+
+    // Keeps the largest_cnt most populated nodes, largest first
+    static void track_largest(std::vector<std::pair<node_id, unsigned int>> &largest, unsigned int largest_cnt,
+                              node_id now, unsigned int cnt)
+    {
+        if (!cnt || (largest.size() == largest_cnt && (largest.empty() || largest.back().second >= cnt)))
+            return;
+        auto pos = std::find_if(largest.begin(), largest.end(),
+                                [&](const std::pair<node_id, unsigned int> &ano) { return ano.second < cnt; });
+        largest.insert(pos, std::make_pair(now, cnt));
+        if (largest.size() > largest_cnt)
+            largest.pop_back();
+    }
+
+    static void count_at_depth(QueueStats &stats, int depth, unsigned int objects)
+    {
+        unsigned int level = depth - stats.root_depth;
+        if (level >= stats.nodes_per_depth.size())
+        {
+            stats.nodes_per_depth.resize(level + 1, 0);
+            stats.objects_per_depth.resize(level + 1, 0);
+        }
+        stats.nodes_per_depth[level]++;
+        stats.objects_per_depth[level] += objects;
+    }
+
+    QueueStats RenderLayer::GetStats(RenderMode mode, unsigned int largest_cnt)
+    {
+        QueueStats stats;
+        stats.node_cnt = stats.object_cnt = stats.root_objects = 0;
+        stats.last_frame = last_frame_stats[mode];
+        if (accel == ACCEL_OCTREE)
+        {
+            auto &tree = render_queue[mode];
+            stats.root_depth = tree[tree.Root()].depth;
+            stats.root_objects = tree[tree.Root()].content.objects.size();
+            octree_stats(tree, tree.Root(), stats, largest_cnt);
+        }
+        else
+        {
+            auto &queue = bvh_queue[mode];
+            stats.root_depth = 0;
+            bvh_stats(queue, queue.tree.Root(), 0, stats, largest_cnt);
+            // pending objects are not in the tree yet
+            stats.root_objects = queue.objects.size() - queue.built_cnt;
+            stats.object_cnt += stats.root_objects;
+        }
+        return stats;
+    }
+
+    void RenderLayer::octree_stats(render_queue_tree &tree, node_id now, QueueStats &stats, unsigned int largest_cnt)
+    {
+        auto &node = tree[now];
+        unsigned int cnt = node.content.objects.size();
+        stats.node_cnt++;
+        stats.object_cnt += cnt;
+        count_at_depth(stats, node.depth, cnt);
+        track_largest(stats.largest_nodes, largest_cnt, now, cnt);
+        if (!node.IsLeaf())
+            for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+                octree_stats(tree, sub, stats, largest_cnt);
+    }
+
+    void RenderLayer::bvh_stats(BVHQueue &queue, node_id now, int depth, QueueStats &stats, unsigned int largest_cnt)
+    {
+        auto &node = queue.tree[now];
+        unsigned int cnt = node.IsLeaf() ? node.count : 0;
+        stats.node_cnt++;
+        stats.object_cnt += cnt;
+        count_at_depth(stats, depth, cnt);
+        track_largest(stats.largest_nodes, largest_cnt, now, cnt);
+        if (!node.IsLeaf())
+        {
+            bvh_stats(queue, node.left, depth + 1, stats, largest_cnt);
+            bvh_stats(queue, node.left + 1, depth + 1, stats, largest_cnt);
+        }
+    }
+
+    static std::string json_array(const std::vector<unsigned int> &values)
+    {
+        std::string ret = "[";
+        for (auto value : values)
+            ret += std::to_string(value) + ",";
+        if (values.empty())
+            return ret + "]";
+        ret[ret.length() - 1] = ']';
+        return ret;
+    }
+
+    std::string CullStats::SerializeJSON()
+    {
+        std::string ret = "{\n";
+        ret += "\"nodes_visited\": " + std::to_string(nodes_visited) + ",\n";
+        ret += "\"nodes_accepted\": " + std::to_string(nodes_accepted) + ",\n";
+        ret += "\"nodes_rejected\": " + std::to_string(nodes_rejected) + ",\n";
+        ret += "\"object_tests\": " + std::to_string(object_tests) + ",\n";
+        ret += "\"plane_tests\": " + std::to_string(plane_tests) + ",\n";
+        ret += "\"nodes_occluded\": " + std::to_string(nodes_occluded) + ",\n";
+        ret += "\"objects_occluded\": " + std::to_string(objects_occluded) + ",\n";
+        ret += "\"objects_small\": " + std::to_string(objects_small);
+        ret += "\n}";
+        return ret;
+    }
+
+    std::string FrameStats::SerializeJSON()
+    {
+        std::string ret = "{\n";
+        ret += "\"splits\": " + std::to_string(splits) + ",\n";
+        ret += "\"merges\": " + std::to_string(merges) + ",\n";
+        ret += "\"relocations\": " + std::to_string(relocations) + ",\n";
+        ret += "\"rebuilds\": " + std::to_string(rebuilds) + ",\n";
+        ret += "\"cull\": " + cull.SerializeJSON();
+        ret += "\n}";
+        return ret;
+    }
+
+    std::string QueueStats::SerializeJSON()
+    {
+        std::string ret = "{\n";
+        ret += "\"root_depth\": " + std::to_string(root_depth) + ",\n";
+        ret += "\"node_cnt\": " + std::to_string(node_cnt) + ",\n";
+        ret += "\"object_cnt\": " + std::to_string(object_cnt) + ",\n";
+        ret += "\"root_objects\": " + std::to_string(root_objects) + ",\n";
+        ret += "\"nodes_per_depth\": " + json_array(nodes_per_depth) + ",\n";
+        ret += "\"objects_per_depth\": " + json_array(objects_per_depth) + ",\n";
+        ret += "\"largest_nodes\": [";
+        for (auto &node : largest_nodes)
+            ret += "\n{\"node\": " + std::to_string(node.first) + ", \"objects\": " + std::to_string(node.second) + "},";
+        if (largest_nodes.empty())
+            ret += "]";
+        else
+            ret[ret.length() - 1] = ']';
+        ret += ",\n\"last_frame\": " + last_frame.SerializeJSON();
+        ret += "\n}";
+        return ret;
+    }
+
+    std::string RenderLayer::SerializeStatsJSON()
+    {
+        const char *names[3] = {"opaque", "transparent", "opaque_shadow"};
+        std::string ret = "{\n";
+        ret += "\"accel\": \"";
+        ret += accel == ACCEL_OCTREE ? "octree" : "bvh";
+        ret += "\"";
+        for (int i = 0; i < 3; i++)
+            ret += ",\n\"" + std::string(names[i]) + "\": " + GetStats(RenderMode(i)).SerializeJSON();
+        ret += "\n}";
+        return ret;
+    }
+
+    // Keeps the capacity closest hits in out as a max heap on dist
+    static void push_hit(QueryHit *out, unsigned int capacity, unsigned int &cnt, RenderQueueItem *item, float dist)
+    {
+        if (cnt == capacity)
+        {
+            if (dist >= out[0].dist)
+                return;
+            std::pop_heap(out, out + cnt);
+            cnt--;
+        }
+        out[cnt].item = item;
+        out[cnt].dist = dist;
+        std::push_heap(out, out + ++cnt);
+    }
+
+    // The helpers below test the objects in slots [st, ed) of one array pair
+
+    static void box_range(ObjectList &objects, std::vector<common::BoundingBox> &boxes, unsigned int st, unsigned int ed,
+                          const common::BoundingBox &box, RenderQueueItem **out, unsigned int capacity, unsigned int &cnt)
+    {
+        for (unsigned int i = st; i < ed; i++)
+            if (common::BoxOverlap(boxes[i].min, boxes[i].max, box.min, box.max))
+            {
+                if (cnt < capacity)
+                    out[cnt] = objects[i].get();
+                cnt++;
+            }
+    }
+
+    static void sphere_range(ObjectList &objects, std::vector<common::BoundingBox> &boxes, unsigned int st, unsigned int ed,
+                             glm::vec3 &center, float sqradius, RenderQueueItem **out, unsigned int capacity, unsigned int &cnt)
+    {
+        for (unsigned int i = st; i < ed; i++)
+            if (common::BoxSqDistance(boxes[i].min, boxes[i].max, center) <= sqradius)
+            {
+                if (cnt < capacity)
+                    out[cnt] = objects[i].get();
+                cnt++;
+            }
+    }
+
+    static void ray_range(ObjectList &objects, std::vector<common::BoundingBox> &boxes, unsigned int st, unsigned int ed,
+                          glm::vec3 &origin, glm::vec3 &inv_dir, float max_dist, QueryHit *out, unsigned int capacity, unsigned int &cnt)
+    {
+        float t;
+        for (unsigned int i = st; i < ed; i++)
+            if (common::RayBoxIntersect(boxes[i].min, boxes[i].max, origin, inv_dir, max_dist, t))
+                push_hit(out, capacity, cnt, objects[i].get(), t);
+    }
+
+    static void nearest_range(ObjectList &objects, std::vector<common::BoundingBox> &boxes, unsigned int st, unsigned int ed,
+                              glm::vec3 &point, QueryHit *out, unsigned int k, unsigned int &cnt)
+    {
+        for (unsigned int i = st; i < ed; i++)
+            push_hit(out, k, cnt, objects[i].get(), common::BoxSqDistance(boxes[i].min, boxes[i].max, point));
+    }
+
+    // Search bound of the ray and nearest queries, the farthest hit once out is full
+    static float hit_bound(QueryHit *out, unsigned int capacity, unsigned int cnt, float max_dist)
+    {
+        return cnt == capacity ? std::min(max_dist, out[0].dist) : max_dist;
+    }
+
+    unsigned int RenderLayer::QueryBox(RenderMode mode, const common::BoundingBox &box, RenderQueueItem **out, unsigned int capacity)
+    {
+        unsigned int cnt = 0;
+        if (accel == ACCEL_BVH)
+        {
+            auto &queue = bvh_queue[mode];
+            query_bvh_box(queue, queue.tree.Root(), box, out, capacity, cnt);
+            box_range(queue.objects, queue.boxes, queue.built_cnt, queue.objects.size(), box, out, capacity, cnt);
+            return cnt;
+        }
+        auto &tree = render_queue[mode];
+        query_box(tree, tree.Root(), box, out, capacity, cnt);
+        return cnt;
+    }
+
+    unsigned int RenderLayer::QuerySphere(RenderMode mode, glm::vec3 center, float radius, RenderQueueItem **out, unsigned int capacity)
+    {
+        unsigned int cnt = 0;
+        float sqradius = radius * radius;
+        if (accel == ACCEL_BVH)
+        {
+            auto &queue = bvh_queue[mode];
+            query_bvh_sphere(queue, queue.tree.Root(), center, sqradius, out, capacity, cnt);
+            sphere_range(queue.objects, queue.boxes, queue.built_cnt, queue.objects.size(), center, sqradius, out, capacity, cnt);
+            return cnt;
+        }
+        auto &tree = render_queue[mode];
+        query_sphere(tree, tree.Root(), center, sqradius, out, capacity, cnt);
+        return cnt;
+    }
+
+    unsigned int RenderLayer::QueryRay(RenderMode mode, glm::vec3 origin, glm::vec3 dir, float max_dist, QueryHit *out, unsigned int capacity)
+    {
+        unsigned int cnt = 0;
+        if (!capacity)
+            return 0;
+        glm::vec3 inv_dir = 1.0f / dir;
+        if (accel == ACCEL_BVH)
+        {
+            auto &queue = bvh_queue[mode];
+            ray_range(queue.objects, queue.boxes, queue.built_cnt, queue.objects.size(), origin, inv_dir, max_dist, out, capacity, cnt);
+            query_bvh_ray(queue, queue.tree.Root(), origin, inv_dir, max_dist, out, capacity, cnt);
+        }
+        else
+        {
+            auto &tree = render_queue[mode];
+            query_ray(tree, tree.Root(), origin, inv_dir, max_dist, out, capacity, cnt);
+        }
+        std::sort_heap(out, out + cnt);
+        return cnt;
+    }
+
+    unsigned int RenderLayer::QueryNearest(RenderMode mode, glm::vec3 point, unsigned int k, QueryHit *out)
+    {
+        unsigned int cnt = 0;
+        if (!k)
+            return 0;
+        if (accel == ACCEL_BVH)
+        {
+            auto &queue = bvh_queue[mode];
+            nearest_range(queue.objects, queue.boxes, queue.built_cnt, queue.objects.size(), point, out, k, cnt);
+            query_bvh_nearest(queue, queue.tree.Root(), point, out, k, cnt);
+        }
+        else
+        {
+            auto &tree = render_queue[mode];
+            query_nearest(tree, tree.Root(), point, out, k, cnt);
+        }
+        std::sort_heap(out, out + cnt);
+        // the search works on squared distances
+        for (unsigned int i = 0; i < cnt; i++)
+            out[i].dist = std::sqrt(out[i].dist);
+        return cnt;
+    }
+
+    // Objects may reach into the loose part of a node, so nodes are pruned by their loose box
+
+    void RenderLayer::query_box(render_queue_tree &tree, node_id now, const common::BoundingBox &box,
+                                RenderQueueItem **out, unsigned int capacity, unsigned int &cnt)
+    {
+        auto &node = tree[now];
+        if (now != tree.Root() && !common::BoxOverlap(node.box.loose_min, node.box.loose_max, box.min, box.max))
+            return;
+        auto &content = node.content;
+        box_range(content.objects, content.boxes, 0, content.objects.size(), box, out, capacity, cnt);
+        if (!node.IsLeaf())
+            for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+                query_box(tree, sub, box, out, capacity, cnt);
+    }
+
+    void RenderLayer::query_sphere(render_queue_tree &tree, node_id now, glm::vec3 &center, float sqradius,
+                                   RenderQueueItem **out, unsigned int capacity, unsigned int &cnt)
+    {
+        auto &node = tree[now];
+        if (now != tree.Root() && common::BoxSqDistance(node.box.loose_min, node.box.loose_max, center) > sqradius)
+            return;
+        auto &content = node.content;
+        sphere_range(content.objects, content.boxes, 0, content.objects.size(), center, sqradius, out, capacity, cnt);
+        if (!node.IsLeaf())
+            for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+                query_sphere(tree, sub, center, sqradius, out, capacity, cnt);
+    }
+
+    void RenderLayer::query_ray(render_queue_tree &tree, node_id now, glm::vec3 &origin, glm::vec3 &inv_dir, float max_dist,
+                                QueryHit *out, unsigned int capacity, unsigned int &cnt)
+    {
+        auto &node = tree[now];
+        float t;
+        max_dist = hit_bound(out, capacity, cnt, max_dist);
+        if (now != tree.Root() && !common::RayBoxIntersect(node.box.loose_min, node.box.loose_max, origin, inv_dir, max_dist, t))
+            return;
+        auto &content = node.content;
+        ray_range(content.objects, content.boxes, 0, content.objects.size(), origin, inv_dir, max_dist, out, capacity, cnt);
+        if (!node.IsLeaf())
+            for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+                query_ray(tree, sub, origin, inv_dir, max_dist, out, capacity, cnt);
+    }
+
+    void RenderLayer::query_nearest(render_queue_tree &tree, node_id now, glm::vec3 &point,
+                                    QueryHit *out, unsigned int k, unsigned int &cnt)
+    {
+        auto &node = tree[now];
+        auto &content = node.content;
+        nearest_range(content.objects, content.boxes, 0, content.objects.size(), point, out, k, cnt);
+        if (node.IsLeaf())
+            return;
+
+        // visit the closer children first, they shrink the bound the most
+        float dist[8];
+        int order[8];
+        for (int i = 0; i < 8; i++)
+        {
+            auto &sub = tree[node.subnodes + i].box;
+            dist[i] = common::BoxSqDistance(sub.loose_min, sub.loose_max, point);
+            order[i] = i;
+        }
+        std::sort(order, order + 8, [&](int a, int b) { return dist[a] < dist[b]; });
+        for (auto i : order)
+        {
+            if (cnt == k && dist[i] >= out[0].dist)
+                break;
+            query_nearest(tree, node.subnodes + i, point, out, k, cnt);
+        }
+    }
+
+    void RenderLayer::query_bvh_box(BVHQueue &queue, node_id now, const common::BoundingBox &box,
+                                    RenderQueueItem **out, unsigned int capacity, unsigned int &cnt)
+    {
+        auto &node = queue.tree[now];
+        if (!common::BoxOverlap(node.box.min, node.box.max, box.min, box.max))
+            return;
+        if (node.IsLeaf())
+            return box_range(queue.objects, queue.boxes, node.first, node.first + node.count, box, out, capacity, cnt);
+        query_bvh_box(queue, node.left, box, out, capacity, cnt);
+        query_bvh_box(queue, node.left + 1, box, out, capacity, cnt);
+    }
+
+    void RenderLayer::query_bvh_sphere(BVHQueue &queue, node_id now, glm::vec3 &center, float sqradius,
+                                       RenderQueueItem **out, unsigned int capacity, unsigned int &cnt)
+    {
+        auto &node = queue.tree[now];
+        if (common::BoxSqDistance(node.box.min, node.box.max, center) > sqradius)
+            return;
+        if (node.IsLeaf())
+            return sphere_range(queue.objects, queue.boxes, node.first, node.first + node.count, center, sqradius, out, capacity, cnt);
+        query_bvh_sphere(queue, node.left, center, sqradius, out, capacity, cnt);
+        query_bvh_sphere(queue, node.left + 1, center, sqradius, out, capacity, cnt);
+    }
+
+    void RenderLayer::query_bvh_ray(BVHQueue &queue, node_id now, glm::vec3 &origin, glm::vec3 &inv_dir, float max_dist,
+                                    QueryHit *out, unsigned int capacity, unsigned int &cnt)
+    {
+        auto &node = queue.tree[now];
+        max_dist = hit_bound(out, capacity, cnt, max_dist);
+        if (node.IsLeaf())
+            return ray_range(queue.objects, queue.boxes, node.first, node.first + node.count, origin, inv_dir, max_dist, out, capacity, cnt);
+        // enter the nearer child first
+        float t[2];
+        bool hit[2];
+        for (int i = 0; i < 2; i++)
+        {
+            auto &sub = queue.tree[node.left + i].box;
+            hit[i] = common::RayBoxIntersect(sub.min, sub.max, origin, inv_dir, max_dist, t[i]);
+        }
+        int first = hit[1] && (!hit[0] || t[1] < t[0]) ? 1 : 0;
+        for (int j = 0; j < 2; j++)
+        {
+            int i = first ^ j;
+            if (hit[i] && t[i] <= hit_bound(out, capacity, cnt, max_dist))
+                query_bvh_ray(queue, node.left + i, origin, inv_dir, max_dist, out, capacity, cnt);
+        }
+    }
+
+    void RenderLayer::query_bvh_nearest(BVHQueue &queue, node_id now, glm::vec3 &point,
+                                        QueryHit *out, unsigned int k, unsigned int &cnt)
+    {
+        auto &node = queue.tree[now];
+        if (node.IsLeaf())
+            return nearest_range(queue.objects, queue.boxes, node.first, node.first + node.count, point, out, k, cnt);
+        float dist[2];
+        for (int i = 0; i < 2; i++)
+        {
+            auto &sub = queue.tree[node.left + i].box;
+            dist[i] = common::BoxSqDistance(sub.min, sub.max, point);
+        }
+        int first = dist[1] < dist[0] ? 1 : 0;
+        for (int j = 0; j < 2; j++)
+        {
+            int i = first ^ j;
+            if (cnt == k && dist[i] >= out[0].dist)
+                break;
+            query_bvh_nearest(queue, node.left + i, point, out, k, cnt);
+        }
     }
 
-    void RenderLayer::insert_light(std::shared_ptr<render_queue_node> &now, std::shared_ptr<LightParameters> &light)
+    void RenderLayer::insert_light(node_id now, std::shared_ptr<LightParameters> &light)
     {
     }
 
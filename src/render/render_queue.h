@@ -2,8 +2,14 @@
 #define RDQUEUE_H
 
 #include "../common/common.h"
+#include "../common/thread_pool.h"
+#include "camera.h"
+#include "occlusion.h"
 #include "light.h"
 #include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
 
 namespace renderer
 {
@@ -25,15 +31,19 @@ namespace renderer
         std::shared_ptr<common::ModelMesh> mesh;
         std::shared_ptr<common::RenderArguments> args;
         unsigned int vertex_cnt;
+        // never moves, so what is drawn from it, like its shadow, may be cached
+        bool is_static;
 
-        virtual void Draw(unsigned int shader_id)
+        // bind_mesh false when the mesh of the previous draw is still bound
+        virtual void Draw(common::CommandList &cmds, const common::ProgramLayout &layout, bool bind_mesh = true)
         {
-            mesh->PrepareForDraw();
-            args->PrepareForDraw(shader_id);
-            glDrawElements(GL_TRIANGLES, vertex_cnt, GL_UNSIGNED_INT, 0);
+            if (bind_mesh)
+                mesh->PrepareForDraw(cmds);
+            args->PrepareForDraw(cmds, layout);
+            cmds.DrawElements(GL_TRIANGLES, vertex_cnt);
         }
 
-        RenderQueueItem()
+        RenderQueueItem() : is_static(false)
         {
             material = nullptr;
             mesh = nullptr;
@@ -43,16 +53,20 @@ namespace renderer
                         std::shared_ptr<common::Material> material,
                         std::shared_ptr<common::ModelMesh> mesh,
                         std::shared_ptr<common::RenderArguments> args,
-                        unsigned int vertex_cnt) : id(id), material(material), mesh(mesh), args(args), vertex_cnt(vertex_cnt) {}
+                        unsigned int vertex_cnt) : id(id), material(material), mesh(mesh), args(args), vertex_cnt(vertex_cnt), is_static(false) {}
     };
 
-    typedef std::list<std::shared_ptr<RenderQueueItem>> ObjectList;
+    typedef std::vector<std::shared_ptr<RenderQueueItem>> ObjectList;
     typedef std::list<std::shared_ptr<LightParameters>> LightList;
 
     struct OctItem
     {
         int subtree_objcnt;
         ObjectList objects;
+        // boxes[i] is the box of objects[i], kept next to each other for culling
+        std::vector<common::BoundingBox> boxes;
+        // own contribution threshold of objects[i], negative when it has none
+        std::vector<float> thresholds;
         LightList lights[2];
 
         void init()
@@ -63,60 +77,281 @@ namespace renderer
         ~OctItem() {}
     };
 
-    struct EmptyTag
+    // Frame to frame culling state of a node
+    struct CullTag
     {
+        // the plane that rejected the node last, it is tested first
+        unsigned char last_plane;
+
+        CullTag() : last_plane(0) {}
+    };
+
+    // dist is the ray entry distance or the distance to the query point
+    struct QueryHit
+    {
+        RenderQueueItem *item;
+        float dist;
+
+        bool operator<(const QueryHit &ano) const
+        {
+            return dist < ano.dist;
+        }
+    };
+
+    typedef common::OctNode<CullTag, OctItem> render_queue_node;
+    typedef common::OctTree<CullTag, OctItem> render_queue_tree;
+    typedef common::oct_idx node_id;
+
+    enum AccelType
+    {
+        ACCEL_OCTREE,
+        ACCEL_BVH
+    };
+
+    // node of objects inserted into a bvh queue since its last build
+    const node_id BVH_PENDING = common::OCT_NULL - 1;
+
+    struct BVHQueue
+    {
+        common::BVH tree;
+        // [0, built_cnt) is in the leaf order of tree, slots of removed objects
+        // stay empty until the next build. Objects after built_cnt are pending
+        // and tested one by one.
+        ObjectList objects;
+        std::vector<common::BoundingBox> boxes;
+        std::vector<float> thresholds;
+        unsigned int built_cnt;
+        unsigned int removed_cnt;
+        // CullTag::last_plane per tree node
+        std::vector<unsigned char> last_planes;
+
+        BVHQueue() : built_cnt(0), removed_cnt(0) {}
+    };
+
+    struct CullStats
+    {
+        unsigned int nodes_visited;
+        // nodes found fully inside, their subtree skips the frustum tests
+        unsigned int nodes_accepted;
+        unsigned int nodes_rejected;
+        unsigned int object_tests;
+        // node against plane tests, planes a parent lies inside are skipped
+        unsigned int plane_tests;
+        // inside the frustum but hidden behind the occluders
+        unsigned int nodes_occluded;
+        unsigned int objects_occluded;
+        // inside the frustum but below the contribution threshold
+        unsigned int objects_small;
+
+        CullStats() : nodes_visited(0), nodes_accepted(0), nodes_rejected(0), object_tests(0), plane_tests(0),
+                      nodes_occluded(0), objects_occluded(0), objects_small(0) {}
+
+        CullStats &operator+=(const CullStats &ano)
+        {
+            nodes_visited += ano.nodes_visited;
+            nodes_accepted += ano.nodes_accepted;
+            nodes_rejected += ano.nodes_rejected;
+            object_tests += ano.object_tests;
+            plane_tests += ano.plane_tests;
+            nodes_occluded += ano.nodes_occluded;
+            objects_occluded += ano.objects_occluded;
+            objects_small += ano.objects_small;
+            return *this;
+        }
+
+        std::string SerializeJSON();
     };
 
-    typedef common::OctNode<EmptyTag, OctItem> render_queue_node;
+    // Counted from one EndFrame to the next
+    struct FrameStats
+    {
+        unsigned int splits;
+        unsigned int merges;
+        unsigned int relocations;
+        unsigned int rebuilds;
+        CullStats cull;
+
+        FrameStats() : splits(0), merges(0), relocations(0), rebuilds(0) {}
+
+        std::string SerializeJSON();
+    };
+
+    struct QueueStats
+    {
+        // depth of the root, the per depth arrays start at it
+        int root_depth;
+        unsigned int node_cnt;
+        unsigned int object_cnt;
+        unsigned int root_objects;
+        std::vector<unsigned int> nodes_per_depth;
+        std::vector<unsigned int> objects_per_depth;
+        // the nodes that hold the most objects themselves, largest first
+        std::vector<std::pair<node_id, unsigned int>> largest_nodes;
+        FrameStats last_frame;
+
+        std::string SerializeJSON();
+    };
+
+    // views culled together in one traversal
+    const unsigned int MAX_CULL_VIEWS = 8;
+
+    // What a node still has to be tested against
+    struct CullState
+    {
+        // bit v is set while view v may see the node
+        unsigned int views;
+        // planes of view v the node straddles, 0 when it is fully inside
+        unsigned char planes[MAX_CULL_VIEWS];
+    };
+
+    // Contribution culling of a MultiViewCull. An object smaller on screen
+    // than min_area[v] pixels, or than its own threshold if it has one, is
+    // dropped for view v, a negative min_area keeps everything. The screen
+    // areas of the objects kept for view 0 are appended to areas, in the
+    // order of out[0], when it is given.
+    struct ContributionCull
+    {
+        float min_area[MAX_CULL_VIEWS];
+        std::vector<float> *areas;
+    };
+
+    struct CullTask
+    {
+        node_id node;
+        CullState state;
+        // only the objects of node itself, its subnodes are tasks of their own
+        bool own_only;
+        ObjectList out[MAX_CULL_VIEWS];
+        std::vector<float> areas;
+        CullStats stats;
+    };
 
     struct RenderQueueLightIndex
     {
-        std::shared_ptr<render_queue_node> node;
+        node_id node;
         LightList::iterator it;
         RenderQueueLightIndex() {}
     };
 
     struct RenderQueueIndex
     {
-        std::shared_ptr<render_queue_node> node;
-        ObjectList::iterator it;
+        node_id node;
+        unsigned int slot;
+        bool dirty;
 
         RenderQueueIndex()
         {
-            node = nullptr;
+            node = common::OCT_NULL;
+            dirty = false;
         }
 
-        RenderQueueIndex(std::shared_ptr<render_queue_node> &node,
-                         ObjectList::iterator it) : node(node), it(it) {}
+        RenderQueueIndex(node_id node,
+                         unsigned int slot) : node(node), slot(slot), dirty(false) {}
     };
 
     class RenderLayer
     {
     public:
-        RenderLayer()
+        RenderLayer() : accel(ACCEL_OCTREE), cull_task_cnt(0), cull_views(nullptr), cull_view_cnt(0), cull_occlusion(nullptr), cull_contribution(nullptr), rebuild_threshold(0.5f), split_threshold(8), merge_threshold(4), bulk_mode(false)
         {
             for (int i = 0; i < 3; i++)
             {
-                // TODO
-                render_queue[i] = std::make_shared<render_queue_node>(
+                render_queue[i].Reset(
                     common::BoundingBox(
                         glm::vec3(-64.0, -64.0, -64.0),
                         glm::vec3(64.0, 64.0, 64.0),
-                        1.0),
-                    0);
-                render_queue[i]->content.init();
+                        1.0));
+                render_queue[i][render_queue[i].Root()].content.init();
             }
         }
 
         void InsertObject(RenderMode mode, std::shared_ptr<RenderQueueItem> &item)
         {
             object_index[mode][item->id] = RenderQueueIndex();
-            insert_obj(render_queue[mode], mode, item);
+            if (bulk_mode)
+            {
+                bulk_items[mode].push_back(item);
+                return;
+            }
+            if (accel == ACCEL_BVH)
+                return insert_bvh(mode, item);
+            fit_root(mode, item->args->box);
+            insert_obj(render_queue[mode].Root(), mode, item);
+        }
+
+        // Moves every queue of the layer to the given structure. The octree
+        // suits scenes of similar sized objects that move a lot, the bvh
+        // mostly static scenes with very uneven object sizes.
+        void SetAccelType(AccelType type, unsigned int thread_cnt = 1);
+
+        AccelType GetAccelType()
+        {
+            return accel;
+        }
+
+        // Sets the initial root box of all queues, queues that already hold
+        // objects are rebuilt. Roots still grow when objects leave this box.
+        void SetWorldBound(glm::vec3 min, glm::vec3 max, unsigned int thread_cnt = 1);
+
+        // Inserts all items in one pass: the Morton codes of the box centers
+        // are radix sorted, which groups every subtree into a contiguous range,
+        // and the tree is then filled range by range.
+        void BulkInsert(RenderMode mode, std::vector<std::shared_ptr<RenderQueueItem>> &items, unsigned int thread_cnt = 1);
+
+        // Until EndBulkInsert, InsertObject only collects the items
+        void BeginBulkInsert()
+        {
+            bulk_mode = true;
+        }
+
+        void EndBulkInsert(unsigned int thread_cnt = 1)
+        {
+            bulk_mode = false;
+            for (int i = 0; i < 3; i++)
+            {
+                BulkInsert(RenderMode(i), bulk_items[i], thread_cnt);
+                bulk_items[i].clear();
+                bulk_items[i].shrink_to_fit();
+            }
         }
 
         void RemoveObject(render_id id, RenderMode mode);
         void UpdateObject(render_id id, RenderMode mode);
 
+        // Defers the update of a moved object to the next CommitUpdates
+        void MarkDirty(render_id id, RenderMode mode)
+        {
+            auto it = object_index[mode].find(id);
+            if (it == object_index[mode].end() || it->second.node == common::OCT_NULL || it->second.dirty)
+                return;
+            it->second.dirty = true;
+            dirty_objects[mode].push_back(id);
+        }
+
+        // Re-buckets every object marked since the last commit. Each moved
+        // object counts in the subtrees holding both its old and its new
+        // place, and a subtree in which more than rebuild_threshold of the
+        // objects moved is rebuilt like BulkInsert does, on up to thread_cnt
+        // threads. Objects outside rebuilt subtrees are relocated one by one.
+        // A bvh queue is refit instead, subtrees whose surface area grew by
+        // more than rebuild_threshold are rebuilt, and the whole tree once
+        // pending and removed objects exceed rebuild_threshold of it.
+        void CommitUpdates(unsigned int thread_cnt = 1);
+
+        void SetRebuildThreshold(float threshold)
+        {
+            rebuild_threshold = threshold;
+        }
+
+        // An octree leaf splits once it holds more than split objects, an
+        // inner node merges its subtree once it holds less than merge. The
+        // gap between them keeps objects near a boundary from thrashing.
+        void SetNodeThresholds(int split, int merge)
+        {
+            split_threshold = split;
+            merge_threshold = std::max(1, std::min(merge, split));
+        }
+
         void InsertLight(std::shared_ptr<LightParameters> &light)
         {
         }
@@ -129,44 +364,226 @@ namespace renderer
         {
         }
 
-        std::shared_ptr<render_queue_node> GetQueue(RenderMode mode)
+        // The queries below never allocate. QueryBox and QuerySphere write at
+        // most capacity items to out and return the number of matches, which
+        // may be larger than capacity. QueryRay writes the capacity nearest
+        // hits sorted by entry distance, QueryNearest the k items closest to
+        // point sorted by distance, both return the number written.
+        unsigned int QueryBox(RenderMode mode, const common::BoundingBox &box, RenderQueueItem **out, unsigned int capacity);
+        unsigned int QuerySphere(RenderMode mode, glm::vec3 center, float radius, RenderQueueItem **out, unsigned int capacity);
+        unsigned int QueryRay(RenderMode mode, glm::vec3 origin, glm::vec3 dir, float max_dist, QueryHit *out, unsigned int capacity);
+        unsigned int QueryNearest(RenderMode mode, glm::vec3 point, unsigned int k, QueryHit *out);
+
+        // Appends the objects of the queue that may be seen by cam to out.
+        // With a pool, subtrees are culled as parallel tasks, the result is
+        // the same as without. With occlusion, nodes and objects hidden in
+        // it are dropped as well, it must have been rendered from cam.
+        void FrustumCull(RenderMode mode, CameraParameters &cam, ObjectList &out, common::ThreadPool *pool = nullptr,
+                         const OcclusionBuffer *occlusion = nullptr)
+        {
+            CameraParameters *view = &cam;
+            MultiViewCull(mode, &view, 1, &out, pool, occlusion);
+        }
+
+        // FrustumCull for up to MAX_CULL_VIEWS views in one traversal, each
+        // node is tested against the views that still may see it and the
+        // objects seen by views[v] are appended to out[v]. The occlusion, if
+        // any, must have been rendered from views[0] and only culls for it.
+        // With contribution, objects too small on screen are dropped by the
+        // same tasks.
+        void MultiViewCull(RenderMode mode, CameraParameters *const *views, unsigned int view_cnt, ObjectList *out,
+                           common::ThreadPool *pool = nullptr, const OcclusionBuffer *occlusion = nullptr,
+                           const ContributionCull *contribution = nullptr);
+
+        // Walks the queue of mode, the counters are those of the last frame.
+        // For a bvh queue the depths are those of the leaves.
+        QueueStats GetStats(RenderMode mode, unsigned int largest_cnt = 8);
+
+        // All three queues as one JSON object
+        std::string SerializeStatsJSON();
+
+        // Closes the counters of the current frame
+        void EndFrame()
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                last_frame_stats[i] = frame_stats[i];
+                frame_stats[i] = FrameStats();
+            }
+        }
+
+        render_queue_tree &GetQueue(RenderMode mode)
         {
             return render_queue[mode];
         }
 
+        BVHQueue &GetBVHQueue(RenderMode mode)
+        {
+            return bvh_queue[mode];
+        }
+
     private:
-        std::shared_ptr<render_queue_node> render_queue[3];
-        std::map<render_id, RenderQueueIndex> object_index[3];
+        AccelType accel;
+        render_queue_tree render_queue[3];
+        BVHQueue bvh_queue[3];
+        std::vector<unsigned int> bvh_order;
+        std::vector<node_id> bvh_degraded;
+        // buffers of the parallel culling tasks, kept between frames
+        std::vector<CullTask> cull_tasks;
+        unsigned int cull_task_cnt;
+        // views, occlusion and contribution culling of the running MultiViewCull
+        CameraParameters *const *cull_views;
+        unsigned int cull_view_cnt;
+        const OcclusionBuffer *cull_occlusion;
+        const ContributionCull *cull_contribution;
+        FrameStats frame_stats[3];
+        FrameStats last_frame_stats[3];
+        std::unordered_map<render_id, RenderQueueIndex> object_index[3];
+        std::vector<render_id> dirty_objects[3];
+        std::vector<RenderQueueIndex *> moved_objects;
+        // moved objects per subtree and the subtrees rebuilt, of the running commit
+        std::unordered_map<node_id, unsigned int> moved_counts;
+        std::vector<node_id> rebuild_nodes;
+        float rebuild_threshold;
+        int split_threshold;
+        int merge_threshold;
         std::map<light_id, RenderQueueLightIndex> light_index;
+        bool bulk_mode;
+        std::vector<std::shared_ptr<RenderQueueItem>> bulk_items[3];
         // TODO volatile light
 
-        void insert_obj(std::shared_ptr<render_queue_node> &now, RenderMode mode, std::shared_ptr<RenderQueueItem> &item);
+        void build_subtree(
+            node_id now,
+            RenderMode mode,
+            std::vector<std::shared_ptr<RenderQueueItem>> &items,
+            common::SortEntry *entries,
+            common::BoundingBox *boxes,
+            unsigned int cnt,
+            unsigned int levels);
+
+        void insert_obj(node_id now, RenderMode mode, std::shared_ptr<RenderQueueItem> &item, node_id stop = common::OCT_NULL);
+
+        void fit_root(RenderMode mode, common::BoundingBox &box);
+
+        void split_leaf(RenderMode mode, node_id now);
+
+        void release_obj_count(RenderMode mode, node_id now, node_id stop);
 
-        void insert_light(std::shared_ptr<render_queue_node> &now, std::shared_ptr<LightParameters> &light);
+        void merge_node(RenderMode mode, node_id now);
 
+        bool need_relocate(render_queue_tree &tree, RenderQueueIndex &index);
+
+        void relocate_obj(RenderMode mode, RenderQueueIndex &index);
+
+        node_id relocation_target(render_queue_tree &tree, node_id now, common::BoundingBox &box);
+
+        void rebuild(RenderMode mode, node_id now, unsigned int thread_cnt);
+
+        void bulk_build(node_id now, RenderMode mode, std::vector<std::shared_ptr<RenderQueueItem>> &items, unsigned int thread_cnt);
+
+        void octree_stats(render_queue_tree &tree, node_id now, QueueStats &stats, unsigned int largest_cnt);
+        void bvh_stats(BVHQueue &queue, node_id now, int depth, QueueStats &stats, unsigned int largest_cnt);
+
+        void collect_objs(render_queue_tree &tree, node_id now, std::vector<std::shared_ptr<RenderQueueItem>> &items);
+
+        void query_box(render_queue_tree &tree, node_id now, const common::BoundingBox &box,
+                       RenderQueueItem **out, unsigned int capacity, unsigned int &cnt);
+        void query_sphere(render_queue_tree &tree, node_id now, glm::vec3 &center, float sqradius,
+                          RenderQueueItem **out, unsigned int capacity, unsigned int &cnt);
+        void query_ray(render_queue_tree &tree, node_id now, glm::vec3 &origin, glm::vec3 &inv_dir, float max_dist,
+                       QueryHit *out, unsigned int capacity, unsigned int &cnt);
+        void query_nearest(render_queue_tree &tree, node_id now, glm::vec3 &point,
+                           QueryHit *out, unsigned int k, unsigned int &cnt);
+
+        void push_cull_task(node_id now, const CullState &state, bool own_only);
+        bool test_node(const common::BoundingBox &box, unsigned char &last_plane, CullState &state, CullStats &stats);
+        bool all_inside(const CullState &state);
+        bool contributes(unsigned int view, const common::BoundingBox &box, float threshold, std::vector<float> *areas);
+        void cull_range(ObjectList &objects, std::vector<common::BoundingBox> &boxes, std::vector<float> &thresholds,
+                        unsigned int st, unsigned int ed, const CullState &state, ObjectList *out, std::vector<float> *areas,
+                        CullStats &stats);
+        void split_cull_octree(render_queue_tree &tree, node_id now, const CullState &state, CullStats &stats);
+        void split_cull_bvh(BVHQueue &queue, node_id now, CullState state, CullStats &stats);
+        void cull_node_objs(OctItem &content, const CullState &state, ObjectList *out, std::vector<float> *areas, CullStats &stats);
+        void cull_octree(render_queue_tree &tree, node_id now, const CullState &state, ObjectList *out, std::vector<float> *areas,
+                         CullStats &stats);
+        void cull_bvh(BVHQueue &queue, node_id now, CullState state, ObjectList *out, std::vector<float> *areas, CullStats &stats);
+
+        void query_bvh_box(BVHQueue &queue, node_id now, const common::BoundingBox &box,
+                           RenderQueueItem **out, unsigned int capacity, unsigned int &cnt);
+        void query_bvh_sphere(BVHQueue &queue, node_id now, glm::vec3 &center, float sqradius,
+                              RenderQueueItem **out, unsigned int capacity, unsigned int &cnt);
+        void query_bvh_ray(BVHQueue &queue, node_id now, glm::vec3 &origin, glm::vec3 &inv_dir, float max_dist,
+                           QueryHit *out, unsigned int capacity, unsigned int &cnt);
+        void query_bvh_nearest(BVHQueue &queue, node_id now, glm::vec3 &point,
+                               QueryHit *out, unsigned int k, unsigned int &cnt);
+
+        void insert_bvh(RenderMode mode, std::shared_ptr<RenderQueueItem> &item);
+        void remove_bvh(RenderMode mode, RenderQueueIndex &index);
+        void commit_bvh(RenderMode mode);
+        void build_bvh(RenderMode mode);
+        // Moves the objects of [first, first + live) to the slots given by
+        // bvh_order, the rest of [first, end) is left empty
+        void reorder_bvh(RenderMode mode, unsigned int first, unsigned int live, unsigned int end);
+        void bind_bvh_leaves(RenderMode mode, node_id now);
+
+        void insert_light(node_id now, std::shared_ptr<LightParameters> &light);
+
+        // subtree_objcnt is increased from now up to stop, stop excluded
         void insert_obj_to_node(
-            std::shared_ptr<render_queue_node> &now,
+            node_id now,
             RenderMode mode,
-            std::shared_ptr<RenderQueueItem> &item)
+            std::shared_ptr<RenderQueueItem> &item,
+            node_id stop = common::OCT_NULL)
         {
-            now->content.objects.push_back(item);
-            for (auto nd = now; nd != nullptr; nd = nd->father)
-                ++nd->content.subtree_objcnt;
+            auto &tree = render_queue[mode];
+            for (node_id nd = now; nd != stop; nd = tree[nd].father)
+                ++tree[nd].content.subtree_objcnt;
+            attach_obj(now, mode, item, item->args->box);
+        }
 
+        // Stores item in now without touching subtree_objcnt. box may be the
+        // one stored before the object was marked dirty, so the mark stays.
+        void attach_obj(
+            node_id now,
+            RenderMode mode,
+            std::shared_ptr<RenderQueueItem> &item,
+            common::BoundingBox &box)
+        {
+            auto &content = render_queue[mode][now].content;
             auto &idx = object_index[mode][item->id];
             idx.node = now;
-            idx.it = now->content.objects.end();
-            idx.it--;
+            idx.slot = content.objects.size();
+            content.objects.push_back(item);
+            content.boxes.push_back(box);
+            content.thresholds.push_back(item->args->contribution_threshold);
         }
 
-        void split_node(std::shared_ptr<render_queue_node> &now)
+        // Swap-removes the object in slot of now, subtree_objcnt is not touched
+        void detach_obj(
+            node_id now,
+            RenderMode mode,
+            unsigned int slot)
         {
-            now->Split();
-            for (int i = 0; i < 8; i++)
+            auto &content = render_queue[mode][now].content;
+            unsigned int last = content.objects.size() - 1;
+            if (slot != last)
             {
-                now->subnodes[i]->content.init();
-                now->subnodes[i]->father = now;
+                content.objects[slot] = std::move(content.objects[last]);
+                content.boxes[slot] = content.boxes[last];
+                content.thresholds[slot] = content.thresholds[last];
+                object_index[mode][content.objects[slot]->id].slot = slot;
             }
+            content.objects.pop_back();
+            content.boxes.pop_back();
+            content.thresholds.pop_back();
+        }
+
+        void split_node(render_queue_tree &tree, node_id now)
+        {
+            node_id first = tree.Split(now);
+            for (int i = 0; i < 8; i++)
+                tree[first + i].content.init();
             // TODO push light
         }
     };
@@ -211,6 +628,18 @@ namespace renderer
             return instance;
         }
 
+        void BeginBulkInsert()
+        {
+            for (auto &layer : layers)
+                layer.BeginBulkInsert();
+        }
+
+        void EndBulkInsert(unsigned int thread_cnt = 1)
+        {
+            for (auto &layer : layers)
+                layer.EndBulkInsert(thread_cnt);
+        }
+
         RenderLayer layers[MAX_LAYER_NUM];
     };
 }
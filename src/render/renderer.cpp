@@ -1,117 +1,586 @@
 #include "renderer.h"
 #include <glm/gtx/string_cast.hpp>
+#include <cstring>
 
 namespace renderer
 {
+    // uniform block 0 as the shaders declare it
+    struct ViewBlock
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPos;
+        glm::vec4 camInfo;
+
+        ViewBlock(const CameraParameters &cam) : view(cam.view), projection(cam.projection), viewPos(cam.viewPos),
+                                                 camInfo(cam.fov, cam.aspect, cam.near, cam.far) {}
+    };
 
     void Renderer::Render()
     {
-        glDepthMask(GL_TRUE);
-        glClearColor(0.0f, 0.3f, 0.4f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glDepthMask(GL_FALSE);
-        skybox->Draw();
+        commands.Clear();
+        commands.SetEnabled(GL_DEPTH_TEST, true);
+        commands.SetEnabled(GL_CULL_FACE, true);
+        commands.SetEnabled(GL_BLEND, false);
+        commands.DepthMask(true);
+        commands.ColorMask(true);
+        commands.ClearFramebuffer(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, glm::vec4(0.0f, 0.3f, 0.4f, 1.0f));
+        commands.DepthMask(false);
+        ring.BeginFrame();
+        upload_uniforms();
+        if (skybox)
+            skybox->Draw(commands);
         cull_lights();
 
         auto &layers = RenderLayerManager::GetInstance()->layers;
-        item_to_draw.clear();
+        auto pool = common::ThreadPool::GetInstance();
         for (auto &layer : layers)
-            cull_objects(layer.GetQueue(OPAQUE), false);
-        // TODO Material sorting
-        glDepthMask(GL_TRUE);
-        glDepthFunc(GL_LESS);
-        glColorMask(0, 0, 0, 0);
-        for (auto &item : item_to_draw)
+            layer.CommitUpdates(pool->WorkerCount() + 1);
+        const OcclusionBuffer *occlusion_test = nullptr;
+        if (occlusion_culling && !occluders.empty())
+        {
+            occlusion.Begin(cam_param);
+            for (auto &item : occluders)
+                if (cam_param.Test(item->args->box) != CameraParameters::FRUSTUM_SEPARATE)
+                    occlusion.AddOccluder(*item->mesh, item->args->model);
+            occlusion.Finish(pool);
+            occlusion_test = &occlusion;
+        }
+        CameraParameters *views[2] = {&cam_param, &sub_param};
+        // objects of the main view too small to be shaded are dropped by the
+        // cull tasks, the sub view keeps everything
+        ContributionCull contribution;
+        contribution.min_area[0] = contribution_threshold[1];
+        contribution.min_area[1] = -1.0f;
+        contribution.areas = &item_areas;
+        for (auto &list : item_to_draw)
+            list.clear();
+        item_areas.clear();
+        layer_end.clear();
+        for (auto &layer : layers)
+        {
+            layer.MultiViewCull(OPAQUE, views, sub_enabled ? 2 : 1, item_to_draw, pool, occlusion_test, &contribution);
+            layer_end.push_back(item_to_draw[0].size());
+        }
+        // transparent objects are only drawn for the main view
+        transparent_items.clear();
+        transparent_end.clear();
+        contribution.areas = nullptr;
+        for (auto &layer : layers)
+        {
+            layer.MultiViewCull(TRANSPARENT, views, 1, &transparent_items, pool, occlusion_test, &contribution);
+            transparent_end.push_back(transparent_items.size());
+        }
+        cull_casters(pool);
+        build_draw_lists();
+
+        // in the order the passes are drawn
+        DrawPass passes[PASS_CNT] = {PASS_DEPTH, PASS_OPAQUE_SMALL, PASS_OPAQUE, PASS_WEIGHTED, PASS_TRANSPARENT};
+        for (auto pass : passes)
+        {
+            pass_commands[pass].Clear();
+            split_pass(pass);
+        }
+        pass_commands[PASS_DEPTH].DepthMask(true);
+        pass_commands[PASS_DEPTH].DepthFunc(GL_LESS);
+        pass_commands[PASS_DEPTH].ColorMask(false);
+        // objects left out of the prepass are shaded and write depth before
+        // the rest, which is then only shaded where it is nearest
+        pass_commands[PASS_OPAQUE_SMALL].DepthMask(true);
+        pass_commands[PASS_OPAQUE_SMALL].DepthFunc(GL_LESS);
+        pass_commands[PASS_OPAQUE_SMALL].ColorMask(true);
+        pass_commands[PASS_OPAQUE].DepthMask(false);
+        pass_commands[PASS_OPAQUE].DepthFunc(GL_LEQUAL);
+        pass_commands[PASS_OPAQUE].ColorMask(true);
+        // transparent passes test against the opaque depth without writing it
+        bool weighted = !draw_lists[PASS_WEIGHTED].items.empty();
+        if (weighted)
         {
-            glUseProgram(depth_shader->shader);
-            item->Draw(depth_shader->shader);
+            if (!backend->Headless())
+                oit.Resize(screen_size.x, screen_size.y);
+            oit.Begin(pass_commands[PASS_WEIGHTED]);
+            oit.Composite(pass_commands[PASS_TRANSPARENT]);
         }
-        glDepthMask(GL_FALSE);
-        glDepthFunc(GL_LEQUAL);
-        glColorMask(1, 1, 1, 1);
-        for (auto &item : item_to_draw)
+        if (!draw_lists[PASS_TRANSPARENT].items.empty())
         {
-            item->material->PrepareForDraw();
-            item->Draw(item->material->shader->shader);
+            pass_commands[PASS_TRANSPARENT].SetEnabled(GL_BLEND, true);
+            pass_commands[PASS_TRANSPARENT].BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
         }
+        begin_shadows();
+        // chunks of all passes are recorded in one go, i runs through the
+        // chunks of each pass in turn and then through those of the shadows
+        unsigned int first_chunk[PASS_CNT + 1] = {0};
+        for (unsigned int pass = 0; pass < PASS_CNT; pass++)
+            first_chunk[pass + 1] = first_chunk[pass] + chunk_cnt[pass];
+        auto record = [&](unsigned int i) {
+            if (i >= first_chunk[PASS_CNT])
+                return record_shadow_chunk(i - first_chunk[PASS_CNT]);
+            unsigned int pass = 0;
+            while (i >= first_chunk[pass + 1])
+                pass++;
+            record_chunk(DrawPass(pass), chunks[pass][i - first_chunk[pass]]);
+        };
+        unsigned int total_chunks = first_chunk[PASS_CNT] + shadow_cascades * 2;
+        if (parallel_recording)
+            pool->Run(total_chunks, record);
+        else
+            for (unsigned int i = 0; i < total_chunks; i++)
+                record(i);
+        draw_stats = DrawStats();
+        for (auto pass : passes)
+            for (unsigned int i = 0; i < chunk_cnt[pass]; i++)
+                draw_stats += chunks[pass][i].stats;
+        shadow_stats = DrawStats();
+        for (unsigned int i = 0; i < shadow_cascades * 2; i++)
+            shadow_stats += shadow_chunks[i].stats;
+        for (auto &layer : layers)
+            layer.EndFrame();
+
+        // whatever ran since the last frame may have changed GL state
+        auto gl = common::GLState::GetInstance();
+        gl->Invalidate();
+        gl->TakeStats();
+        backend->Execute(commands);
+        backend->Execute(shadow_commands[0]);
+        for (unsigned int i = 0; i < shadow_cascades * 2; i++)
+            backend->Execute(shadow_chunks[i].commands);
+        backend->Execute(shadow_commands[1]);
+        for (auto pass : passes)
+        {
+            backend->Execute(pass_commands[pass]);
+            for (unsigned int i = 0; i < chunk_cnt[pass]; i++)
+                backend->Execute(chunks[pass][i].commands);
+        }
+        ring.EndFrame();
+        state_stats = gl->TakeStats();
     }
 
-    void Renderer::cull_lights()
+    // Camera and lights only change copies on the CPU, what the frame uses
+    // is written here once into the ring and bound by range
+    void Renderer::upload_uniforms()
     {
-        glUseProgram(light_culler->shader);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_totindex);
-        glm::ivec2 st(0, 0);
-        glBufferSubData(
-            GL_SHADER_STORAGE_BUFFER,
-            sizeof(int) * 65536 * 2,
-            sizeof(glm::ivec2),
-            glm::value_ptr(st));
-        glDispatchCompute(1, 1, 1);
-        glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+        ViewBlock vp(cam_param);
+        view_alloc = ring.Allocate(sizeof(vp));
+        memcpy(view_alloc.ptr, &vp, sizeof(vp));
+        commands.BindBufferRange(GL_UNIFORM_BUFFER, 0, view_alloc.buffer, view_alloc.offset, sizeof(vp));
+
+        struct
+        {
+            glm::vec4 ambient;
+            glm::vec2 size;
+        } gi{ambient, screen_size};
+        memcpy(ring.Bind(commands, GL_UNIFORM_BUFFER, 1, sizeof(gi)), &gi, sizeof(gi));
+
+        LightManager::GetInstance()->Upload(ring, commands);
     }
 
-    void Renderer::cull_objects(std::shared_ptr<render_queue_node> &now, bool include)
+    // Keys the objects of the main view, which the cull left only those large
+    // enough to be shaded of, for the prepass and the opaque pass when they
+    // are large enough for the prepass and for the small opaque pass when
+    // not, and transparent objects for the pass of their material, then
+    // sorts the lists
+    void Renderer::build_draw_lists()
     {
-        for (auto &obj : now->content.objects)
-            if (include || cam_param.Test(obj->args->box) != CameraParameters::FRUSTUM_SEPARATE)
-                item_to_draw.push_back(obj);
+        auto &items = item_to_draw[0];
+        auto &depth_list = draw_lists[PASS_DEPTH];
+        auto &opaque_list = draw_lists[PASS_OPAQUE];
+        auto &small_list = draw_lists[PASS_OPAQUE_SMALL];
+        for (auto &list : draw_lists)
+            list.Clear();
+        // view space z of a point is dot(forward, p) + forward.w, negative in front
+        glm::vec4 forward(cam_param.view[0][2], cam_param.view[1][2], cam_param.view[2][2], cam_param.view[3][2]);
+        float range = cam_param.far - cam_param.near;
+        unsigned int layer = 0;
+        for (unsigned int i = 0; i < items.size(); i++)
+        {
+            while (i >= layer_end[layer])
+                layer++;
+            auto &args = *items[i]->args;
+            float prepass = args.contribution_threshold >= 0 ? args.contribution_threshold : contribution_threshold[0];
+            glm::vec3 center = (args.box.min + args.box.max) * 0.5f;
+            float depth = (-glm::dot(glm::vec3(forward), center) - forward.w - cam_param.near) / range;
+            if (item_areas[i] >= prepass)
+            {
+                depth_list.Add(items[i], sort_layouts[PASS_DEPTH].Key(PASS_DEPTH, layer, *items[i], depth));
+                opaque_list.Add(items[i], sort_layouts[PASS_OPAQUE].Key(PASS_OPAQUE, layer, *items[i], depth));
+            }
+            else
+                small_list.Add(items[i], sort_layouts[PASS_OPAQUE_SMALL].Key(PASS_OPAQUE_SMALL, layer, *items[i], depth));
+        }
+        layer = 0;
+        for (unsigned int i = 0; i < transparent_items.size(); i++)
+        {
+            while (i >= transparent_end[layer])
+                layer++;
+            auto &item = *transparent_items[i];
+            auto &args = *item.args;
+            glm::vec3 center = (args.box.min + args.box.max) * 0.5f;
+            float depth = (-glm::dot(glm::vec3(forward), center) - forward.w - cam_param.near) / range;
+            DrawPass pass = item.material->render_mode == common::RENDER_MODE_WEIGHTED ? PASS_WEIGHTED : PASS_TRANSPARENT;
+            draw_lists[pass].Add(transparent_items[i], sort_layouts[pass].Key(pass, layer, item, depth));
+        }
+        draw_data.clear();
+        for (unsigned int pass = 0; pass < PASS_CNT; pass++)
+        {
+            draw_lists[pass].Sort(sort_layouts[pass].KeyBits());
+            // runs of one mesh and material stay in order when they are drawn
+            // instanced or by one multi draw, so sorted transparency batches
+            // like the rest
+            draw_lists[pass].BuildBatches(pass != PASS_DEPTH, instancing && !indirect_draw, draw_data);
+        }
+        build_shadow_lists();
+        // instance attributes are set up here once, not by the threads
+        // recording the draws
+        auto setup_instancing = [&](DrawList &list) {
+            for (auto &batch : list.batches)
+            {
+                auto &mesh = *list.items[batch.first]->mesh;
+                if (batch.instanced && !mesh.instance_attribs)
+                    commands.InstanceAttribs(mesh.vao);
+                mesh.instance_attribs |= batch.instanced;
+            }
+        };
+        for (auto &list : draw_lists)
+            setup_instancing(list);
+        for (unsigned int i = 0; i < shadow_cascades * 2; i++)
+            setup_instancing(shadow_lists[i]);
+        upload_draw_data();
+        if (indirect_draw)
+            build_indirect();
+    }
+
+    // Fits the cascades of the light casting shadows to the main view and
+    // culls the shadow queues against them
+    void Renderer::cull_casters(common::ThreadPool *pool)
+    {
+        shadow_cascades = 0;
+        auto light = shadows ? LightManager::GetInstance()->GetShadowCaster() : nullptr;
+        if (!light)
+            return;
+        shadow.Fit(cam_param, glm::vec3(light->inner_params.direction));
+        shadow.CullCasters(RenderLayerManager::GetInstance()->layers, MAX_LAYER_NUM, pool);
+        shadow_cascades = shadow.CascadeCount();
+        shadow_light = light->index;
+    }
+
+    // Keys the casters of each cascade like the prepass, front to back from
+    // the light. Static casters are left out unless their cached depth is
+    // redrawn this frame.
+    void Renderer::build_shadow_lists()
+    {
+        for (unsigned int i = 0; i < shadow_cascades * 2; i++)
+        {
+            auto &list = shadow_lists[i];
+            auto &cascade = shadow.GetCascade(i / 2);
+            bool dynamic = i % 2;
+            list.Clear();
+            if (!dynamic && !cascade.static_dirty)
+            {
+                list.batches.clear();
+                continue;
+            }
+            auto &cam = cascade.camera;
+            glm::vec4 forward(cam.view[0][2], cam.view[1][2], cam.view[2][2], cam.view[3][2]);
+            float range = cam.far - cam.near;
+            for (auto &item : dynamic ? cascade.dynamic_casters : cascade.static_casters)
+            {
+                auto &box = item->args->box;
+                glm::vec3 center = (box.min + box.max) * 0.5f;
+                float depth = (-glm::dot(glm::vec3(forward), center) - forward.w - cam.near) / range;
+                list.Add(item, sort_layouts[PASS_DEPTH].Key(PASS_DEPTH, 0, *item, depth));
+            }
+            list.Sort(sort_layouts[PASS_DEPTH].KeyBits());
+            list.BuildBatches(false, instancing, draw_data);
+        }
+    }
 
-        if (now->subnodes[0] != nullptr)
+    // Records the state of the shadow pass and, after it, binding the
+    // shadow block and putting back what the main passes expect
+    void Renderer::begin_shadows()
+    {
+        auto &begin = shadow_commands[0];
+        auto &end = shadow_commands[1];
+        begin.Clear();
+        end.Clear();
+        if (shadow_cascades)
         {
-            for (auto &subnode : now->subnodes)
+            if (!backend->Headless())
+                shadow.Create();
+            unsigned int resolution = shadow.Resolution();
+            for (unsigned int i = 0; i < shadow_cascades; i++)
             {
-                if (include)
-                {
-                    cull_objects(subnode, true);
-                    continue;
-                }
-                CameraParameters::frustum_relation rel = cam_param.Test(subnode->box);
-
-                if (rel == CameraParameters::FRUSTUM_INCLUDE)
-                    cull_objects(subnode, true);
-                else if (rel == CameraParameters::FRUSTUM_INTERSECT)
-                    cull_objects(subnode, false);
+                ViewBlock vp(shadow.GetCascade(i).camera);
+                shadow_views[i] = ring.Allocate(sizeof(vp));
+                memcpy(shadow_views[i].ptr, &vp, sizeof(vp));
             }
+            begin.DepthMask(true);
+            begin.DepthFunc(GL_LESS);
+            begin.ColorMask(false);
+            // back faces only, lit surfaces do not shadow themselves
+            begin.CullFace(GL_FRONT);
+            begin.Viewport(0, 0, resolution, resolution);
+            end.BindFramebuffer(0);
+            end.Viewport(0, 0, screen_size.x, screen_size.y);
+            end.CullFace(GL_BACK);
+            end.BindBufferRange(GL_UNIFORM_BUFFER, 0, view_alloc.buffer, view_alloc.offset, sizeof(ViewBlock));
         }
+        shadow.Bind(ring, end, shadow_light, shadow_cascades);
     }
 
-    CameraParameters::frustum_relation CameraParameters::Test(const common::BoundingBox &box)
+    // Sets up the vao of the shared geometry. Attributes 4 to 7 take the
+    // model matrix and 8 the material index per instance from the draw data
+    // at binding 4, so the instanced programs draw indirect commands as they
+    // are. The draw data lives in the ring, binding 4 is pointed at it each
+    // frame.
+    void Renderer::init_indirect()
     {
-        glm::vec3 bmin = box.min;
-        glm::vec3 bmax = box.max;
-        glm::vec3 vertices[8];
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++)
-                {
-                    glm::vec3 &vert = vertices[i * 4 + j * 2 + k];
-                    vert.x = i ? bmin.x : bmax.x;
-                    vert.y = j ? bmin.y : bmax.y;
-                    vert.z = k ? bmin.z : bmax.z;
-                }
-        for (int i = 0; i < 8; i++)
-            vertices[i] = view * glm::vec4(vertices[i], 1.0);
+        glGenVertexArrays(1, &geometry_vao);
+        glGenBuffers(1, &geometry_vbo);
+        glGenBuffers(1, &geometry_ebo);
+
+        auto gl = common::GLState::GetInstance();
+        gl->BindVertexArray(geometry_vao);
+        gl->BindBuffer(GL_ARRAY_BUFFER, geometry_vbo);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(common::VertexProperties), (void *)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(common::VertexProperties), (void *)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(common::VertexProperties), (void *)(6 * sizeof(float)));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(common::VertexProperties), (void *)(9 * sizeof(float)));
+        glEnableVertexAttribArray(3);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry_ebo);
+        gl->BindVertexArray(0);
+        gl->BindBuffer(GL_ARRAY_BUFFER, 0);
 
-        bool allin, allout, intersect = false;
-        for (int i = 0; i < 6; i++)
+        common::CommandList setup;
+        setup.InstanceAttribs(geometry_vao);
+        common::GLBackend().Execute(setup);
+        glVertexArrayAttribIFormat(geometry_vao, 8, 1, GL_UNSIGNED_INT, sizeof(glm::mat4));
+        glVertexArrayAttribBinding(geometry_vao, 8, 4);
+        glEnableVertexArrayAttrib(geometry_vao, 8);
+    }
+
+    // Builds the commands of both passes into one buffer, the shared
+    // geometry is uploaded again when meshes were added to it
+    void Renderer::build_indirect()
+    {
+        indirect.Clear();
+        for (unsigned int pass = 0; pass < PASS_CNT; pass++)
         {
-            allin = true, allout = true;
-            for (int j = 0; j < 8; j++)
+            indirect_begin[pass] = indirect.buckets.size();
+            indirect.Build(draw_lists[pass], geometry, pass != PASS_DEPTH);
+            indirect_end[pass] = indirect.buckets.size();
+        }
+        if (geometry.TakeDirty())
+        {
+            // the pool is only added to between frames, the data stays valid
+            // until the commands are executed
+            commands.BufferData(geometry_vbo, geometry.vertices.data(), geometry.vertices.size() * sizeof(common::VertexProperties), GL_STATIC_DRAW);
+            commands.BufferData(geometry_ebo, geometry.indices.data(), geometry.indices.size() * sizeof(unsigned int), GL_STATIC_DRAW);
+        }
+        if (indirect.commands.empty())
+            return;
+        unsigned int size = indirect.commands.size() * sizeof(DrawElementsIndirectCommand);
+        auto alloc = ring.Allocate(size);
+        memcpy(alloc.ptr, indirect.commands.data(), size);
+        commands.BindBuffer(GL_DRAW_INDIRECT_BUFFER, alloc.buffer);
+        indirect_offset = alloc.offset;
+    }
+
+    void Renderer::upload_draw_data()
+    {
+        if (draw_data.empty())
+            return;
+        unsigned int size = draw_data.size() * sizeof(DrawData);
+        draw_alloc = ring.Allocate(size);
+        memcpy(draw_alloc.ptr, draw_data.data(), size);
+        commands.BindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, draw_alloc.buffer, draw_alloc.offset, size);
+        commands.VertexBuffer(geometry_vao, 4, draw_alloc.buffer, draw_alloc.offset, sizeof(DrawData));
+    }
+
+    // Lists the steps of a pass and splits them into chunks of about the
+    // same number of objects, a couple per thread so stealing evens them out
+    void Renderer::split_pass(DrawPass pass)
+    {
+        auto &list = draw_lists[pass];
+        auto &pass_steps = steps[pass];
+        pass_steps.clear();
+        unsigned int objects = 0;
+        if (!indirect_draw)
+            for (unsigned int b = 0; b < list.batches.size(); b++)
+                pass_steps.push_back(DrawStep{-1, b, list.batches[b].count});
+        for (unsigned int i = indirect_draw ? indirect_begin[pass] : 0; indirect_draw && i < indirect_end[pass]; i++)
+        {
+            auto &bucket = indirect.buckets[i];
+            if (bucket.command_cnt)
+                pass_steps.push_back(DrawStep{int(i), 0, bucket.objects});
+            else
+                for (unsigned int b = bucket.first_batch; b < bucket.first_batch + bucket.batch_cnt; b++)
+                    pass_steps.push_back(DrawStep{-1, b, list.batches[b].count});
+        }
+        for (auto &step : pass_steps)
+            objects += step.objects;
+
+        const unsigned int min_objects = 256;
+        unsigned int threads = common::ThreadPool::GetInstance()->WorkerCount() + 1;
+        unsigned int target = parallel_recording ? std::max(min_objects, (objects + threads * 2 - 1) / (threads * 2)) : ~0u;
+        auto &pass_chunks = chunks[pass];
+        chunk_cnt[pass] = 0;
+        unsigned int chunk_objects = 0;
+        for (unsigned int i = 0; i < pass_steps.size(); i++)
+        {
+            if (i == 0 || chunk_objects >= target)
             {
-                glm::vec3 &vert = vertices[j];
-                if (glm::dot(vert - frustum_pos[i], frustum_dir[i]) < 0)
-                    allin = false;
-                else
-                    allout = false;
+                if (pass_chunks.size() <= chunk_cnt[pass])
+                    pass_chunks.emplace_back();
+                pass_chunks[chunk_cnt[pass]++].first = i;
+                chunk_objects = 0;
             }
-            if (allout)
-                return FRUSTUM_SEPARATE;
-            intersect |= !allin;
+            pass_chunks[chunk_cnt[pass] - 1].last = i + 1;
+            chunk_objects += pass_steps[i].objects;
+        }
+    }
+
+    void Renderer::reset_chunk(DrawChunk &chunk)
+    {
+        chunk.commands.Clear();
+        chunk.bound_program = 0;
+        chunk.bound_material = nullptr;
+        chunk.bound_mesh = nullptr;
+        chunk.geometry_bound = false;
+        chunk.stats = DrawStats();
+    }
+
+    // Runs on any thread, only touches the chunk and reads the frame
+    void Renderer::record_chunk(DrawPass pass, DrawChunk &chunk)
+    {
+        reset_chunk(chunk);
+        auto &pass_steps = steps[pass];
+        for (unsigned int i = chunk.first; i < chunk.last; i++)
+        {
+            auto &step = pass_steps[i];
+            if (step.bucket >= 0)
+                draw_bucket(chunk, pass, indirect.buckets[step.bucket]);
+            else
+                draw_batch(chunk, pass, draw_lists[pass], draw_lists[pass].batches[step.batch]);
+        }
+    }
+
+    // Chunk i redraws the cached static depth of cascade i / 2 for even i
+    // and draws the dynamic casters over a copy of it for odd i
+    void Renderer::record_shadow_chunk(unsigned int i)
+    {
+        auto &chunk = shadow_chunks[i];
+        reset_chunk(chunk);
+        unsigned int c = i / 2;
+        bool dynamic = i % 2;
+        if (!dynamic && !shadow.GetCascade(c).static_dirty)
+            return;
+        if (dynamic)
+        {
+            unsigned int resolution = shadow.Resolution();
+            chunk.commands.BlitFramebuffer(shadow.CacheFramebuffer(c), shadow.Framebuffer(c), resolution, resolution, GL_DEPTH_BUFFER_BIT);
+            chunk.commands.BindFramebuffer(shadow.Framebuffer(c));
+        }
+        else
+        {
+            chunk.commands.BindFramebuffer(shadow.CacheFramebuffer(c));
+            chunk.commands.ClearFramebuffer(GL_DEPTH_BUFFER_BIT, glm::vec4(0.0f));
+        }
+        chunk.commands.BindBufferRange(GL_UNIFORM_BUFFER, 0, shadow_views[c].buffer, shadow_views[c].offset, sizeof(ViewBlock));
+        for (auto &batch : shadow_lists[i].batches)
+            draw_batch(chunk, PASS_DEPTH, shadow_lists[i], batch);
+    }
+
+    // Instanced draws point binding 4 of the mesh vao at the draw data of
+    // the frame, its attributes were set up by build_draw_lists. Non
+    // instanced shaders ignore them.
+    void Renderer::bind_mesh(DrawChunk &chunk, common::ModelMesh *mesh, bool instanced, unsigned int objects)
+    {
+        bool bind = mesh != chunk.bound_mesh;
+        chunk.stats.mesh_binds += bind;
+        chunk.stats.mesh_binds_avoided += objects - bind;
+        chunk.bound_mesh = mesh;
+        chunk.geometry_bound = false;
+        if (bind)
+            mesh->PrepareForDraw(chunk.commands);
+        if (instanced)
+            chunk.commands.VertexBuffer(mesh->vao, 4, draw_alloc.buffer, draw_alloc.offset, sizeof(DrawData));
+    }
+
+    // The prepass uses its own program. In the opaque pass a material binds
+    // its program along with its textures, and is only prepared again when
+    // the material or the program variant changes. Programs and textures
+    // shared by consecutive materials are dropped by the state cache.
+    const common::ProgramLayout &Renderer::bind_program(DrawChunk &chunk, DrawPass pass, common::Material *material, bool instanced, unsigned int objects)
+    {
+        auto &shader = pass == PASS_DEPTH ? *depth_shader : *material->shader;
+        auto &layout = instanced ? shader.instanced_layout : shader.layout;
+        unsigned int program = layout.program;
+        bool bind = program != chunk.bound_program;
+        if (pass == PASS_DEPTH)
+            chunk.commands.UseProgram(program);
+        else
+        {
+            bool prepare = material != chunk.bound_material || bind;
+            if (prepare && instanced)
+                material->PrepareForInstancedDraw(chunk.commands);
+            else if (prepare)
+                material->PrepareForDraw(chunk.commands);
+            chunk.bound_material = material;
+            chunk.stats.material_binds += prepare;
+            chunk.stats.material_binds_avoided += objects - prepare;
         }
+        chunk.bound_program = program;
+        chunk.stats.shader_binds += bind;
+        chunk.stats.shader_binds_avoided += objects - bind;
+        return layout;
+    }
+
+    void Renderer::draw_batch(DrawChunk &chunk, DrawPass pass, const DrawList &list, const DrawBatch &batch)
+    {
+        auto &items = list.items;
+        auto &item = *items[batch.first];
+        auto &layout = bind_program(chunk, pass, item.material.get(), batch.instanced, batch.count);
+        bind_mesh(chunk, item.mesh.get(), batch.instanced, batch.count);
+        if (batch.instanced)
+        {
+            chunk.commands.DrawElementsInstanced(GL_TRIANGLES, item.vertex_cnt, batch.count, batch.first_draw);
+            chunk.stats.draws++;
+            chunk.stats.instanced_objects += batch.count;
+            return;
+        }
+        for (unsigned int i = 0; i < batch.count; i++)
+        {
+            chunk.commands.Uniform(layout.draw_id, batch.first_draw + i);
+            items[batch.first + i]->Draw(chunk.commands, layout, false);
+        }
+        chunk.stats.draws += batch.count;
+    }
 
-        if (intersect)
-            return FRUSTUM_INTERSECT;
+    void Renderer::draw_bucket(DrawChunk &chunk, DrawPass pass, const IndirectBucket &bucket)
+    {
+        bind_program(chunk, pass, bucket.material, true, bucket.objects);
+        chunk.stats.mesh_binds += !chunk.geometry_bound;
+        chunk.stats.mesh_binds_avoided += bucket.objects - !chunk.geometry_bound;
+        if (!chunk.geometry_bound)
+            chunk.commands.BindVertexArray(geometry_vao);
+        chunk.geometry_bound = true;
+        chunk.bound_mesh = nullptr;
+        chunk.commands.MultiDrawIndirect(GL_TRIANGLES, indirect_offset + bucket.first_command * sizeof(DrawElementsIndirectCommand), bucket.command_cnt);
+        chunk.stats.draws++;
+        chunk.stats.indirect_commands += bucket.command_cnt;
+        chunk.stats.instanced_objects += bucket.objects;
+    }
 
-        return FRUSTUM_INCLUDE;
+    void Renderer::cull_lights()
+    {
+        // read when the commands are executed, so it has to outlive the call
+        static const glm::ivec2 st(0, 0);
+        commands.UseProgram(light_culler->shader);
+        commands.BufferSubData(ssbo_totindex, sizeof(int) * 65536 * 2, glm::value_ptr(st), sizeof(glm::ivec2));
+        commands.Dispatch(1, 1, 1);
+        commands.Barrier(GL_TEXTURE_UPDATE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
     }
 }
\ No newline at end of file
@@ -7,7 +7,14 @@
 
 #include "../common/common.h"
 #include "skybox.h"
+#include "camera.h"
 #include "render_queue.h"
+#include "occlusion.h"
+#include "draw_sort.h"
+#include "indirect.h"
+#include "frame_ring.h"
+#include "weighted_oit.h"
+#include "shadow.h"
 #include "../events/event.h"
 #include "light.h"
 
@@ -18,70 +25,56 @@
 
 namespace renderer
 {
-    struct CameraParameters
+    // One multi draw of the bucket of a pass when bucket is not negative,
+    // the batch of its draw list otherwise
+    struct DrawStep
     {
-        float fov;
-        float aspect;
-        float near;
-        float far;
-        glm::mat4 view;
-        glm::mat4 projection;
-        glm::vec4 viewPos;
-        glm::vec3 frustum_dir[6];
-        glm::vec3 frustum_pos[6];
-
-        enum frustum_relation
-        {
-            FRUSTUM_INCLUDE,
-            FRUSTUM_INTERSECT,
-            FRUSTUM_SEPARATE
-        };
-
-        frustum_relation Test(const common::BoundingBox &box);
-        void UpdateParam(float nfov, float naspect, float nnear, float nfar)
-        {
-            fov = nfov;
-            aspect = naspect;
-            near = nnear;
-            far = nfar;
-            projection = glm::perspective(fov, aspect, near, far);
-            float thfov = glm::tan(fov / 2) * aspect;
-            for (int i = 0; i < 4; i++)
-                frustum_pos[i] = glm::vec3(0.0f);
-            frustum_pos[4] = glm::vec3(0, 0, -near);
-            frustum_pos[5] = glm::vec3(0, 0, -far);
-            frustum_dir[0] = glm::cross(glm::vec3(0, glm::tan(fov / 2), -1), glm::vec3(1.0, 0.0, 0.0));
-            frustum_dir[1] = frustum_dir[0];
-            frustum_dir[1].y = -frustum_dir[1].y;
-            frustum_dir[2] = glm::cross(glm::vec3(0.0, 1.0, 0.0), glm::vec3(thfov, 0, -1));
-            frustum_dir[3] = frustum_dir[2];
-            frustum_dir[3].x = -frustum_dir[2].x;
-            frustum_dir[4] = glm::vec3(0.0, 0.0, -1.0);
-            frustum_dir[5] = glm::vec3(0.0, 0.0, 1.0);
-        }
+        int bucket;
+        unsigned int batch;
+        unsigned int objects;
+    };
+
+    // Consecutive steps of a pass recorded into their own list, with what
+    // the list bound last. Each chunk binds what it needs at its start, the
+    // state cache drops it when the previous chunk left it bound.
+    struct DrawChunk
+    {
+        unsigned int first;
+        unsigned int last;
+        common::CommandList commands;
+        unsigned int bound_program;
+        common::Material *bound_material;
+        common::ModelMesh *bound_mesh;
+        bool geometry_bound;
+        DrawStats stats;
     };
 
     class Renderer
     {
     public:
-        Renderer() {}
-        Renderer(glm::vec4 ambient, std::shared_ptr<SkyBox> skybox) : ambient(ambient), skybox(skybox)
-        {
-            glEnable(GL_DEPTH_TEST);
-            glEnable(GL_CULL_FACE);
-            glGenBuffers(1, &ubo_VP);
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_VP);
-            glBufferData(GL_UNIFORM_BUFFER, 2 * (sizeof(glm::mat4) + sizeof(glm::vec4)), NULL, GL_DYNAMIC_DRAW);
-            glBindBufferBase(GL_UNIFORM_BUFFER, 0, ubo_VP);
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
-            glGenBuffers(1, &ubo_GI);
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_GI);
-            glBufferData(GL_UNIFORM_BUFFER, sizeof(glm::vec4) + sizeof(glm::vec2), NULL, GL_DYNAMIC_DRAW);
-            glBindBufferBase(GL_UNIFORM_BUFFER, 1, ubo_GI);
-            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::vec4), glm::value_ptr(ambient));
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
-
+        // Headless, frames are recorded and counted by a null backend and no
+        // GL call is made, for running the CPU side of frames without a GPU
+        Renderer() : ambient(0.0f), screen_size(0.0f), ring(1 << 20, true), ssbo_totindex(0), lightgrid(0), shadows(true), shadow_cascades(0), shadow_light(0),
+                     instancing(true), indirect_draw(true), geometry_vao(0), geometry_vbo(0), geometry_ebo(0), indirect_offset(0),
+                     parallel_recording(true), occlusion_culling(true), sub_enabled(false)
+        {
+            SetContributionThresholds(16.0f, 1.0f);
+            for (int i = 0; i < PASS_CNT; i++)
+                sort_layouts[i] = SortKeyLayout::Default(DrawPass(i));
+            backend = std::make_shared<common::NullBackend>();
+            light_culler = std::make_shared<common::ComputeShaderProgram>();
+            depth_shader = std::make_shared<common::ShaderProgram>();
+        }
+        Renderer(glm::vec4 ambient, std::shared_ptr<SkyBox> skybox) : ambient(ambient), screen_size(0.0f), skybox(skybox), shadows(true), shadow_cascades(0),
+                                                                     shadow_light(0), instancing(true), indirect_draw(true), indirect_offset(0),
+                                                                     parallel_recording(true), occlusion_culling(true), sub_enabled(false)
+        {
+            backend = std::make_shared<common::GLBackend>();
+            SetContributionThresholds(16.0f, 1.0f);
+            for (int i = 0; i < PASS_CNT; i++)
+                sort_layouts[i] = SortKeyLayout::Default(DrawPass(i));
+            common::GLState::GetInstance()->SetEnabled(GL_DEPTH_TEST, true);
+            common::GLState::GetInstance()->SetEnabled(GL_CULL_FACE, true);
             glGenBuffers(1, &ssbo_totindex);
             glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_totindex);
             int size = sizeof(int) * 65536 * 2 + sizeof(glm::ivec2);
@@ -102,57 +95,247 @@ namespace renderer
             light_culler = std::make_shared<common::ComputeShaderProgram>("./src/shaders/cull_lights.cs");
             depth_shader = std::make_shared<common::ShaderProgram>(
                 common::Shader("./src/shaders/depth.vs", common::VERTEX_SHADER));
+            depth_shader->InitInstanced(common::Shader("./src/shaders/depth_instanced.vs", common::VERTEX_SHADER));
+            init_indirect();
         }
 
         void Render();
 
+        // Where recorded frames are executed. A headless renderer only takes
+        // backends without a GPU, its GL names are not real.
+        void SetBackend(std::shared_ptr<common::Backend> backend)
+        {
+            this->backend = backend;
+        }
+
+
+        // Occluders are rasterized into the occlusion buffer each frame, the
+        // opaque queue is then tested against it
+        void AddOccluder(std::shared_ptr<RenderQueueItem> item)
+        {
+            occluders.push_back(item);
+        }
+
+        void RemoveOccluder(render_id id)
+        {
+            occluders.erase(std::remove_if(occluders.begin(), occluders.end(),
+                                           [id](std::shared_ptr<RenderQueueItem> &item) { return item->id == id; }),
+                            occluders.end());
+        }
+
+        void SetOcclusionCulling(bool enable)
+        {
+            occlusion_culling = enable;
+        }
+
+        // Objects covering less screen area than these many pixels are left
+        // out of the depth prepass and the shading pass. Everything in the
+        // prepass is shaded as well, so the shading threshold is at most the
+        // prepass one and no depth is written without color. Objects shaded
+        // without a prepass write their depth in a pass of their own.
+        void SetContributionThresholds(float prepass, float shading)
+        {
+            contribution_threshold[0] = prepass;
+            contribution_threshold[1] = std::min(shading, prepass);
+        }
+
+        // Objects sharing mesh and material are drawn by one instanced call
+        // when their material has an instanced program
+        void SetInstancing(bool enable)
+        {
+            instancing = enable;
+        }
+
+        // Draws the buckets of instanceable materials with one multi draw
+        // indirect call each, from geometry shared by all meshes. Without
+        // it, instancing decides how objects are batched.
+        void SetIndirectDraw(bool enable)
+        {
+            indirect_draw = enable;
+        }
+
+        // Records the draws of each pass in chunks on the thread pool, the
+        // lists are executed in order afterwards. Without it one list per
+        // pass is recorded on the calling thread.
+        void SetParallelRecording(bool enable)
+        {
+            parallel_recording = enable;
+        }
+
+        // Cascaded shadows of the first directional light casting them, see
+        // CascadedShadowMap. Objects in the shadow queue cast them.
+        void SetShadows(bool enable)
+        {
+            shadows = enable;
+        }
+
+        CascadedShadowMap &GetShadowMap()
+        {
+            return shadow;
+        }
+
+        // Sets how the draws of a pass are ordered, see SortKeyLayout::Default
+        void SetSortKeyLayout(DrawPass pass, const SortKeyLayout &layout)
+        {
+            sort_layouts[pass] = layout;
+        }
+
+        // Opaque objects of the last frame seen by the main or the sub camera
+        // in the order they were culled, GetPassList has them in draw order
+        const ObjectList &GetDrawList(bool sub)
+        {
+            return item_to_draw[sub ? 1 : 0];
+        }
+
+        // Sorted and batched list of a pass in the last frame
+        const DrawList &GetPassList(DrawPass pass)
+        {
+            return draw_lists[pass];
+        }
+
+        // Binds of the last frame
+        DrawStats GetDrawStats()
+        {
+            return draw_stats;
+        }
+
+        // Binds of the shadow casters of the last frame, static casters only
+        // count in frames their cached depth was redrawn
+        DrawStats GetShadowDrawStats()
+        {
+            return shadow_stats;
+        }
+
+        // GL calls the state cache issued and dropped in the last frame
+        common::GLStateStats GetStateStats()
+        {
+            return state_stats;
+        }
+
+        // Commands the backend executed since the last call
+        common::CommandStats GetCommandStats()
+        {
+            return backend->TakeStats();
+        }
+
+        // Writes the occlusion depth of the last frame as a PGM image
+        bool DumpOcclusionBuffer(const std::string &pth)
+        {
+            return occlusion.DumpPGM(pth);
+        }
+
         void UpdateView(const glm::mat4 &view, const glm::vec3 &viewPos, bool sub)
         {
             auto &param = sub ? sub_param : cam_param;
             param.view = view;
             param.viewPos = glm::vec4(viewPos, 0.0f);
-            if (sub)
-                return;
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_VP);
-            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), glm::value_ptr(param.view));
-            glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4) * 2, sizeof(glm::vec4), glm::value_ptr(param.viewPos));
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            param.UpdatePlanes();
         }
 
         void UpdateProjection(float fov, float width, float height, float near, float far, bool sub)
         {
             float aspect = width / height;
             auto &param = sub ? sub_param : cam_param;
+            param.viewport_height = height;
             param.UpdateParam(fov, aspect, near, far);
             if (sub)
-                return;
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_VP);
-            glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(param.projection));
-            glm::vec4 info(fov, aspect, near, far);
-            glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4) * 2 + sizeof(glm::vec4), sizeof(glm::vec4), glm::value_ptr(info));
-
-            glBindBuffer(GL_UNIFORM_BUFFER, ubo_GI);
-            glm::vec2 size(width, height);
-            glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::vec4), sizeof(glm::vec2), glm::value_ptr(size));
-            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+                sub_enabled = true;
+            else
+                screen_size = glm::vec2(width, height);
         }
 
     private:
         CameraParameters cam_param;
         CameraParameters sub_param;
         glm::vec4 ambient;
-        unsigned int ubo_VP;
-        unsigned int ubo_GI;
+        glm::vec2 screen_size;
+        // uniform blocks, instance data and indirect commands of the frame
+        FrameRing ring;
+        // the view block of the camera, bound again after the shadow pass
+        FrameRing::Allocation view_alloc;
+        // what the frame submits before its passes, executed by backend at
+        // its end followed by the state of each pass and its chunks
+        common::CommandList commands;
+        common::CommandList pass_commands[PASS_CNT];
+        std::shared_ptr<common::Backend> backend;
         unsigned int ssbo_totindex;
         unsigned int lightgrid;
 
         std::shared_ptr<SkyBox> skybox;
         std::shared_ptr<common::ComputeShaderProgram> light_culler;
         std::shared_ptr<common::ShaderProgram> depth_shader;
-        std::vector<std::shared_ptr<RenderQueueItem>> item_to_draw;
+        // culled objects of the main and the sub camera, in one traversal
+        ObjectList item_to_draw[2];
+        // screen area of each object in item_to_draw[0], found by the cull
+        std::vector<float> item_areas;
+        // where the objects of each layer end in item_to_draw[0]
+        std::vector<unsigned int> layer_end;
+        // transparent objects of the main camera and where each layer ends
+        ObjectList transparent_items;
+        std::vector<unsigned int> transparent_end;
+        WeightedOIT oit;
+        bool shadows;
+        CascadedShadowMap shadow;
+        // cascades drawn this frame, 0 without a light casting shadows
+        unsigned int shadow_cascades;
+        unsigned int shadow_light;
+        // static then dynamic casters of each cascade, sorted like the
+        // prepass and recorded into the chunk of the same index
+        DrawList shadow_lists[CascadedShadowMap::MAX_CASCADES * 2];
+        DrawChunk shadow_chunks[CascadedShadowMap::MAX_CASCADES * 2];
+        FrameRing::Allocation shadow_views[CascadedShadowMap::MAX_CASCADES];
+        // state before and after the shadow chunks
+        common::CommandList shadow_commands[2];
+        DrawStats shadow_stats;
+        // what of item_to_draw[0] and transparent_items is drawn, sorted per pass
+        DrawList draw_lists[PASS_CNT];
+        SortKeyLayout sort_layouts[PASS_CNT];
+        DrawStats draw_stats;
+        common::GLStateStats state_stats;
+        float contribution_threshold[2];
+        bool instancing;
+        // indexed by draw id, bound as shader storage block 1 and read per
+        // instance through vertex binding 4 by instanced draws
+        std::vector<DrawData> draw_data;
+        FrameRing::Allocation draw_alloc;
+        bool indirect_draw;
+        GeometryPool geometry;
+        IndirectBuilder indirect;
+        // buckets of each pass in indirect.buckets
+        unsigned int indirect_begin[PASS_CNT];
+        unsigned int indirect_end[PASS_CNT];
+        unsigned int geometry_vao;
+        unsigned int geometry_vbo;
+        unsigned int geometry_ebo;
+        // where the commands of the frame start in the ring buffer
+        unsigned int indirect_offset;
+        bool parallel_recording;
+        // what a pass draws in order, split into chunks recorded in parallel
+        std::vector<DrawStep> steps[PASS_CNT];
+        std::vector<DrawChunk> chunks[PASS_CNT];
+        unsigned int chunk_cnt[PASS_CNT];
+        ObjectList occluders;
+        OcclusionBuffer occlusion;
+        bool occlusion_culling;
+        bool sub_enabled;
 
+        void upload_uniforms();
         void cull_lights();
-        void cull_objects(std::shared_ptr<render_queue_node> &now, bool include);
+        void cull_casters(common::ThreadPool *pool);
+        void build_draw_lists();
+        void build_shadow_lists();
+        void begin_shadows();
+        void upload_draw_data();
+        void init_indirect();
+        void build_indirect();
+        void split_pass(DrawPass pass);
+        void reset_chunk(DrawChunk &chunk);
+        void record_chunk(DrawPass pass, DrawChunk &chunk);
+        void record_shadow_chunk(unsigned int i);
+        const common::ProgramLayout &bind_program(DrawChunk &chunk, DrawPass pass, common::Material *material, bool instanced, unsigned int objects);
+        void bind_mesh(DrawChunk &chunk, common::ModelMesh *mesh, bool instanced, unsigned int objects);
+        void draw_batch(DrawChunk &chunk, DrawPass pass, const DrawList &list, const DrawBatch &batch);
+        void draw_bucket(DrawChunk &chunk, DrawPass pass, const IndirectBucket &bucket);
     };
 }
 
@@ -0,0 +1,218 @@
+#include "shadow.h"
+#include <cstring>
+
+namespace renderer
+{
+    // uniform block 5 as the shaders declare it
+    struct ShadowBlock
+    {
+        glm::mat4 light_vp[CascadedShadowMap::MAX_CASCADES];
+        // far view distance of each cascade
+        glm::vec4 splits;
+        // world space texel size of each cascade, scales the normal offset
+        glm::vec4 texels;
+        // x: cascade count, y: index of the directional light
+        glm::vec4 info;
+    };
+
+    // splitmix64 finalizer
+    static unsigned long long mix(unsigned long long x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    static unsigned long long caster_hash(const RenderQueueItem &item)
+    {
+        unsigned long long h = mix(item.id);
+        const float values[6] = {item.args->box.min.x, item.args->box.min.y, item.args->box.min.z,
+                                 item.args->box.max.x, item.args->box.max.y, item.args->box.max.z};
+        for (float v : values)
+        {
+            unsigned int bits;
+            memcpy(&bits, &v, sizeof(bits));
+            h = mix(h ^ bits);
+        }
+        return h;
+    }
+
+    // std::min binds it to a reference
+    const unsigned int CascadedShadowMap::MAX_CASCADES;
+
+    CascadedShadowMap::CascadedShadowMap(unsigned int cascade_cnt, unsigned int resolution)
+        : cascade_cnt(std::min(std::max(cascade_cnt, 1u), MAX_CASCADES)), resolution(resolution), split_lambda(0.75f),
+          max_distance(100.0f), caster_distance(50.0f), padding(0.15f), light_dir(0.0f), map(0), cache(0),
+          framebuffers(), cache_framebuffers()
+    {
+        Invalidate();
+    }
+
+    CascadedShadowMap::~CascadedShadowMap()
+    {
+        if (!map)
+            return;
+        glDeleteFramebuffers(cascade_cnt, framebuffers);
+        glDeleteFramebuffers(cascade_cnt, cache_framebuffers);
+        glDeleteTextures(1, &map);
+        glDeleteTextures(1, &cache);
+    }
+
+    void CascadedShadowMap::Invalidate()
+    {
+        for (unsigned int i = 0; i < MAX_CASCADES; i++)
+        {
+            cache_valid[i] = false;
+            static_signature[i] = 0;
+        }
+    }
+
+    void CascadedShadowMap::Fit(const CameraParameters &cam, glm::vec3 dir)
+    {
+        dir = glm::normalize(dir);
+        bool force = dir != light_dir;
+        light_dir = dir;
+        // rotation only, each box is placed by its own origin in light space
+        glm::vec3 up = std::abs(dir.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::mat4 light_view = glm::lookAt(glm::vec3(0.0f), dir, up);
+        float near = cam.near;
+        float far = max_distance > 0 ? std::min(cam.far, max_distance) : cam.far;
+        for (unsigned int i = 0; i < cascade_cnt; i++)
+        {
+            float t = float(i + 1) / cascade_cnt;
+            float split = split_lambda * near * std::pow(far / near, t) + (1.0f - split_lambda) * (near + (far - near) * t);
+            cascades[i].split_near = i ? cascades[i - 1].split_far : near;
+            cascades[i].split_far = i + 1 == cascade_cnt ? far : split;
+            fit_cascade(i, cam, light_view, force);
+        }
+    }
+
+    // The smallest sphere around a slice of a symmetric frustum lies on the
+    // view axis and does not change as the camera turns, so neither does the
+    // size of a box fit to it
+    void CascadedShadowMap::fit_cascade(unsigned int i, const CameraParameters &cam, const glm::mat4 &light_view, bool force)
+    {
+        auto &cascade = cascades[i];
+        float n = cascade.split_near;
+        float f = cascade.split_far;
+        float tan_half = std::tan(cam.fov * 0.5f);
+        // squared distance of a slice corner from the axis per unit of depth
+        float k2 = tan_half * tan_half * (1.0f + cam.aspect * cam.aspect);
+        float z = std::min(f, (n + f) * 0.5f * (1.0f + k2));
+        float radius = std::sqrt((f - z) * (f - z) + f * f * k2);
+        glm::vec3 center = glm::inverse(cam.view) * glm::vec4(0.0f, 0.0f, -z, 1.0f);
+
+        // kept while the slice is inside and the box not much too large
+        bool keep = !force && cascade.radius > 0 && glm::distance(center, cascade.center) + radius <= cascade.radius &&
+                    cascade.radius <= radius * (1.0f + 2.0f * padding);
+        if (keep)
+            return;
+        cache_valid[i] = false;
+        cascade.radius = radius * (1.0f + padding);
+        cascade.texel = 2.0f * cascade.radius / resolution;
+        // the origin moves in whole texels, so a texel always covers the
+        // same part of the world
+        glm::vec3 origin = light_view * glm::vec4(center, 1.0f);
+        origin.x = std::floor(origin.x / cascade.texel) * cascade.texel;
+        origin.y = std::floor(origin.y / cascade.texel) * cascade.texel;
+        cascade.center = glm::inverse(light_view) * glm::vec4(origin, 1.0f);
+
+        // the light looks down -z, casters up to caster_distance towards it
+        // are taken in
+        float r = cascade.radius;
+        auto &camera = cascade.camera;
+        camera.fov = 0.0f;
+        camera.aspect = 1.0f;
+        camera.near = -(origin.z + r + caster_distance);
+        camera.far = -(origin.z - r);
+        camera.view = light_view;
+        camera.projection = glm::ortho(origin.x - r, origin.x + r, origin.y - r, origin.y + r, camera.near, camera.far);
+        camera.viewPos = glm::vec4(cascade.center - light_dir * (r + caster_distance), 0.0f);
+        camera.viewport_height = 0.0f;
+        camera.pixel_scale = 0.0f;
+        camera.UpdatePlanes();
+    }
+
+    void CascadedShadowMap::CullCasters(RenderLayer *layers, unsigned int layer_cnt, common::ThreadPool *pool)
+    {
+        CameraParameters *views[MAX_CASCADES];
+        for (unsigned int i = 0; i < cascade_cnt; i++)
+        {
+            casters[i].clear();
+            views[i] = &cascades[i].camera;
+        }
+        for (unsigned int l = 0; l < layer_cnt; l++)
+            layers[l].MultiViewCull(OPAQUE_SHADOW, views, cascade_cnt, casters, pool);
+        for (unsigned int i = 0; i < cascade_cnt; i++)
+        {
+            auto &cascade = cascades[i];
+            cascade.static_casters.clear();
+            cascade.dynamic_casters.clear();
+            // summed, so the order the casters were found in does not matter
+            unsigned long long signature = 0;
+            for (auto &item : casters[i])
+                if (item->is_static)
+                {
+                    cascade.static_casters.push_back(item);
+                    signature += caster_hash(*item);
+                }
+                else
+                    cascade.dynamic_casters.push_back(item);
+            cascade.static_dirty = !cache_valid[i] || signature != static_signature[i];
+            cache_valid[i] = true;
+            static_signature[i] = signature;
+        }
+    }
+
+    void CascadedShadowMap::Create()
+    {
+        if (map)
+            return;
+        const float border[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &map);
+        glTextureStorage3D(map, 1, GL_DEPTH_COMPONENT32F, resolution, resolution, cascade_cnt);
+        glTextureParameteri(map, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTextureParameteri(map, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteri(map, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTextureParameteri(map, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        glTextureParameterfv(map, GL_TEXTURE_BORDER_COLOR, border);
+        // linear filtering of compared samples gives 2x2 PCF per tap
+        glTextureParameteri(map, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTextureParameteri(map, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &cache);
+        glTextureStorage3D(cache, 1, GL_DEPTH_COMPONENT32F, resolution, resolution, cascade_cnt);
+
+        unsigned int textures[2] = {map, cache};
+        unsigned int *targets[2] = {framebuffers, cache_framebuffers};
+        for (int t = 0; t < 2; t++)
+        {
+            glCreateFramebuffers(cascade_cnt, targets[t]);
+            for (unsigned int i = 0; i < cascade_cnt; i++)
+            {
+                unsigned int fb = targets[t][i];
+                glNamedFramebufferTextureLayer(fb, GL_DEPTH_ATTACHMENT, textures[t], 0, i);
+                glNamedFramebufferDrawBuffer(fb, GL_NONE);
+                glNamedFramebufferReadBuffer(fb, GL_NONE);
+                if (glCheckNamedFramebufferStatus(fb, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                    std::cout << "ERROR::FRAMEBUFFER::SHADOW_MAP_INCOMPLETE" << std::endl;
+            }
+        }
+        Invalidate();
+    }
+
+    void CascadedShadowMap::Bind(FrameRing &ring, common::CommandList &cmds, unsigned int light_index, unsigned int cascades)
+    {
+        ShadowBlock block;
+        memset(&block, 0, sizeof(block));
+        for (unsigned int i = 0; i < std::min(cascades, cascade_cnt); i++)
+        {
+            auto &camera = this->cascades[i].camera;
+            block.light_vp[i] = camera.projection * camera.view;
+            block.splits[i] = this->cascades[i].split_far;
+            block.texels[i] = this->cascades[i].texel;
+        }
+        block.info = glm::vec4(float(std::min(cascades, cascade_cnt)), float(light_index), 0.0f, 0.0f);
+        memcpy(ring.Bind(cmds, GL_UNIFORM_BUFFER, 5, sizeof(block)), &block, sizeof(block));
+        cmds.BindTexture(0, map);
+    }
+}
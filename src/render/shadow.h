@@ -0,0 +1,158 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "../common/common.h"
+#include "../common/command_list.h"
+#include "../common/thread_pool.h"
+#include "camera.h"
+#include "render_queue.h"
+#include "frame_ring.h"
+
+namespace renderer
+{
+    // One slice of the view of the camera and the light space box covering it
+    struct ShadowCascade
+    {
+        // light view and orthographic projection, the planes reach out
+        // towards the light to take in casters outside the slice
+        CameraParameters camera;
+        // view distances of the camera the slice lies between
+        float split_near;
+        float split_far;
+        // world space sphere the box was fit around, kept while the slice
+        // stays inside it
+        glm::vec3 center;
+        float radius;
+        // world space size of a texel
+        float texel;
+        // casters the box takes in. Static ones are drawn into a cache only
+        // when static_dirty is set, dynamic ones over a copy of it each frame.
+        ObjectList static_casters;
+        ObjectList dynamic_casters;
+        bool static_dirty;
+
+        ShadowCascade() : split_near(0.0f), split_far(0.0f), center(0.0f), radius(0.0f), texel(0.0f), static_dirty(true) {}
+    };
+
+    // Cascaded shadow map of one directional light. The view of the camera
+    // is cut into slices by distance, each covered by an orthographic box of
+    // the light rendered into its own layer of a depth array texture.
+    //
+    // A box is fit around the bounding sphere of its slice, padded, and its
+    // origin snapped to whole texels, so neither rotating nor moving the
+    // camera makes the shadow edges swim. The box then stays put until the
+    // slice leaves it, which keeps the depth of static casters valid across
+    // frames: it is cached in a second array and copied into the map before
+    // the dynamic casters are drawn over it.
+    //
+    // Fit and CullCasters are CPU only, GL is touched by Create alone.
+    class CascadedShadowMap
+    {
+    public:
+        static const unsigned int MAX_CASCADES = 4;
+
+        CascadedShadowMap(unsigned int cascade_cnt = MAX_CASCADES, unsigned int resolution = 2048);
+        ~CascadedShadowMap();
+
+        // lambda blends logarithmic splits, at 1, with uniform ones, at 0
+        void SetSplitLambda(float lambda)
+        {
+            split_lambda = lambda;
+        }
+
+        // How far from the camera shadows reach, at most its far plane
+        void SetMaxDistance(float distance)
+        {
+            max_distance = distance;
+        }
+
+        // How far towards the light beyond a slice casters are still taken in
+        void SetCasterDistance(float distance)
+        {
+            caster_distance = distance;
+        }
+
+        // Extra radius the boxes get over their slice, as a fraction of it.
+        // More padding means fewer refits and less resolution.
+        void SetPadding(float padding)
+        {
+            this->padding = padding;
+        }
+
+        unsigned int CascadeCount() const
+        {
+            return cascade_cnt;
+        }
+
+        unsigned int Resolution() const
+        {
+            return resolution;
+        }
+
+        ShadowCascade &GetCascade(unsigned int i)
+        {
+            return cascades[i];
+        }
+
+        // Splits the view of cam and fits the boxes of the light shining along
+        // dir to the slices. Boxes the slice left, or all of them when dir
+        // changed, are refit and their cached static depth is dropped.
+        void Fit(const CameraParameters &cam, glm::vec3 dir);
+
+        // Culls the shadow queues of the layers against all boxes in one
+        // traversal each and sorts the casters into static and dynamic. The
+        // static depth of a box is marked dirty when the static casters it
+        // takes in, or their boxes, changed since it was last drawn.
+        void CullCasters(RenderLayer *layers, unsigned int layer_cnt, common::ThreadPool *pool = nullptr);
+
+        // Drops all cached static depth
+        void Invalidate();
+
+        // Makes the textures and framebuffers, GL is only touched on the
+        // first call
+        void Create();
+
+        // Framebuffers of the layer of cascade i in the map and in the cache
+        unsigned int Framebuffer(unsigned int i) const
+        {
+            return framebuffers[i];
+        }
+
+        unsigned int CacheFramebuffer(unsigned int i) const
+        {
+            return cache_framebuffers[i];
+        }
+
+        // Records writing the shadow block, bound to uniform block 5, for
+        // the directional light of the given index, and binding the map to
+        // texture unit 0. cascades 0 turns shadows off in the shaders.
+        void Bind(FrameRing &ring, common::CommandList &cmds, unsigned int light_index, unsigned int cascades);
+
+    private:
+        unsigned int cascade_cnt;
+        unsigned int resolution;
+        float split_lambda;
+        float max_distance;
+        float caster_distance;
+        float padding;
+        glm::vec3 light_dir;
+        ShadowCascade cascades[MAX_CASCADES];
+        // signature of the static casters the cached depth was drawn with,
+        // valid when the cascade was not refit since
+        unsigned long long static_signature[MAX_CASCADES];
+        bool cache_valid[MAX_CASCADES];
+        // casters seen by each cascade, for all layers
+        ObjectList casters[MAX_CASCADES];
+        unsigned int map;
+        unsigned int cache;
+        unsigned int framebuffers[MAX_CASCADES];
+        unsigned int cache_framebuffers[MAX_CASCADES];
+
+        CascadedShadowMap(const CascadedShadowMap &);
+        CascadedShadowMap &operator=(const CascadedShadowMap &);
+
+        void fit_cascade(unsigned int i, const CameraParameters &cam, const glm::mat4 &light_view, bool force);
+    };
+}
+
+#endif
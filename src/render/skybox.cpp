@@ -50,15 +50,16 @@ namespace renderer
     {
         glGenVertexArrays(1, &vao);
         glGenBuffers(1, &vbo);
-        glBindVertexArray(vao);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        auto gl = common::GLState::GetInstance();
+        gl->BindVertexArray(vao);
+        gl->BindBuffer(GL_ARRAY_BUFFER, vbo);
         glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_DYNAMIC_DRAW);
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
-        glBindVertexArray(0);
+        gl->BindVertexArray(0);
 
-        glBindTextureUnit(1, this->irradiance_map->texture);
-        glBindTextureUnit(2, this->prefiltered_map->texture);
-        glBindTextureUnit(3, this->lut_map->texture);
+        gl->BindTexture(1, this->irradiance_map->texture);
+        gl->BindTexture(2, this->prefiltered_map->texture);
+        gl->BindTexture(3, this->lut_map->texture);
     }
 }
\ No newline at end of file
@@ -13,15 +13,13 @@ namespace builtin_materials
         SkyboxMaterial(std::shared_ptr<common::ShaderProgram> shader,
                        std::shared_ptr<common::Texture2D> box) : skybox(box), Material(shader, 0)
         {
-            glUseProgram(shader->shader);
-            glUniform1i(glGetUniformLocation(shader->shader, "skybox"), 0 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(shader->shader, shader->layout.Location("skybox"), 0 + common::ENGINE_TEXTURE_CNT);
         }
 
-        virtual void PrepareForDraw()
+        virtual void PrepareForDraw(common::CommandList &cmds)
         {
-            glUseProgram(shader->shader);
-            glActiveTexture(GL_TEXTURE0 + common::ENGINE_TEXTURE_CNT);
-            glBindTexture(GL_TEXTURE_2D, skybox->texture);
+            cmds.UseProgram(shader->shader);
+            cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, skybox->texture);
         };
 
         virtual void Dispose()
@@ -60,11 +58,11 @@ namespace renderer
 
             this->init();
         }
-        void Draw()
+        void Draw(common::CommandList &cmds)
         {
-            material->PrepareForDraw();
-            glBindVertexArray(vao);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+            material->PrepareForDraw(cmds);
+            cmds.BindVertexArray(vao);
+            cmds.DrawArrays(GL_TRIANGLES, 0, 36);
         }
 
     private:
@@ -0,0 +1,86 @@
+#include "weighted_oit.h"
+
+namespace renderer
+{
+    // read when the commands are executed
+    static const glm::vec4 accum_clear(0.0f);
+    static const glm::vec4 reveal_clear(1.0f);
+
+    WeightedOIT::WeightedOIT() : width(0), height(0), framebuffer(0), accum(0), reveal(0), depth(0), vao(0) {}
+
+    WeightedOIT::~WeightedOIT()
+    {
+        release();
+        if (vao)
+            glDeleteVertexArrays(1, &vao);
+    }
+
+    void WeightedOIT::release()
+    {
+        if (!framebuffer)
+            return;
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteTextures(1, &accum);
+        glDeleteTextures(1, &reveal);
+        glDeleteRenderbuffers(1, &depth);
+        framebuffer = accum = reveal = depth = 0;
+    }
+
+    void WeightedOIT::Resize(unsigned int width, unsigned int height)
+    {
+        if (framebuffer && width == this->width && height == this->height)
+            return;
+        if (!composite)
+        {
+            composite = std::make_shared<common::ShaderProgram>(
+                common::Shader("./src/shaders/oit_composite.vs", common::VERTEX_SHADER),
+                common::Shader("./src/shaders/oit_composite.fs", common::FRAGMENT_SHADER));
+            glProgramUniform1i(composite->shader, composite->layout.Location("accum"), 0 + common::ENGINE_TEXTURE_CNT);
+            glProgramUniform1i(composite->shader, composite->layout.Location("reveal"), 1 + common::ENGINE_TEXTURE_CNT);
+            // the composite triangle is made from gl_VertexID alone
+            glCreateVertexArrays(1, &vao);
+        }
+        release();
+        this->width = width;
+        this->height = height;
+        glCreateTextures(GL_TEXTURE_2D, 1, &accum);
+        glTextureStorage2D(accum, 1, GL_RGBA16F, width, height);
+        glCreateTextures(GL_TEXTURE_2D, 1, &reveal);
+        glTextureStorage2D(reveal, 1, GL_R8, width, height);
+        // same format as the default depth buffer, or the blit fails
+        glCreateRenderbuffers(1, &depth);
+        glNamedRenderbufferStorage(depth, GL_DEPTH24_STENCIL8, width, height);
+        glCreateFramebuffers(1, &framebuffer);
+        glNamedFramebufferTexture(framebuffer, GL_COLOR_ATTACHMENT0, accum, 0);
+        glNamedFramebufferTexture(framebuffer, GL_COLOR_ATTACHMENT1, reveal, 0);
+        glNamedFramebufferRenderbuffer(framebuffer, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth);
+        GLenum buffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glNamedFramebufferDrawBuffers(framebuffer, 2, buffers);
+        if (glCheckNamedFramebufferStatus(framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::FRAMEBUFFER::WEIGHTED_OIT_INCOMPLETE" << std::endl;
+    }
+
+    void WeightedOIT::Begin(common::CommandList &cmds)
+    {
+        cmds.BlitFramebuffer(0, framebuffer, width, height, GL_DEPTH_BUFFER_BIT);
+        cmds.BindFramebuffer(framebuffer);
+        cmds.ClearBuffer(framebuffer, 0, accum_clear);
+        cmds.ClearBuffer(framebuffer, 1, reveal_clear);
+        cmds.SetEnabled(GL_BLEND, true);
+        cmds.BlendFunc(GL_ONE, GL_ONE, 0);
+        cmds.BlendFunc(GL_ZERO, GL_ONE_MINUS_SRC_COLOR, 1);
+    }
+
+    void WeightedOIT::Composite(common::CommandList &cmds)
+    {
+        cmds.BindFramebuffer(0);
+        cmds.SetEnabled(GL_DEPTH_TEST, false);
+        cmds.BlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+        cmds.UseProgram(composite ? composite->shader : 0);
+        cmds.BindTexture(0 + common::ENGINE_TEXTURE_CNT, accum);
+        cmds.BindTexture(1 + common::ENGINE_TEXTURE_CNT, reveal);
+        cmds.BindVertexArray(vao);
+        cmds.DrawArrays(GL_TRIANGLES, 0, 3);
+        cmds.SetEnabled(GL_DEPTH_TEST, true);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef WEIGHTED_OIT_H
+#define WEIGHTED_OIT_H
+
+#include "../common/common.h"
+#include "../common/command_list.h"
+
+namespace renderer
+{
+    // Targets of weighted blended order independent transparency. Objects
+    // add their weighted premultiplied color to an accumulation target and
+    // multiply their transparency into a revealage target, in any order,
+    // with the depth of the opaque scene copied in for testing. Compositing
+    // divides out the weights and blends the average over the frame.
+    // Fragment shaders write vec4(color.rgb * color.a, color.a) * weight to
+    // location 0 and color.a to location 1, see particle_weighted.fs.
+    class WeightedOIT
+    {
+    public:
+        WeightedOIT();
+        ~WeightedOIT();
+
+        // Makes the targets the size of the screen, GL is only touched on
+        // the first call and when the size changes
+        void Resize(unsigned int width, unsigned int height);
+
+        // Records copying the depth of the default framebuffer, clearing the
+        // targets, binding them and setting the accumulation blending
+        void Begin(common::CommandList &cmds);
+        // Records blending the result over the default framebuffer, which is
+        // bound afterwards with depth testing on
+        void Composite(common::CommandList &cmds);
+
+    private:
+        unsigned int width;
+        unsigned int height;
+        unsigned int framebuffer;
+        unsigned int accum;
+        unsigned int reveal;
+        unsigned int depth;
+        unsigned int vao;
+        std::shared_ptr<common::ShaderProgram> composite;
+
+        WeightedOIT(const WeightedOIT &);
+        WeightedOIT &operator=(const WeightedOIT &);
+
+        void release();
+    };
+}
+
+#endif
@@ -0,0 +1,22 @@
+#version 450 core
+layout (location = 0) in vec3 aPos;
+// per instance, filled from the instance buffer of the frame
+layout (location = 4) in mat4 model;
+
+
+layout(std140, binding = 0) uniform VPBlock{
+    mat4 view;
+    mat4 projection;
+    vec4 viewPos;
+    vec4 camInfo;
+};
+
+//uniform uint pointlight_cnt;
+//uniform uint spotlight_cnt;
+//uniform uint directional_cnt;
+
+void main()
+{
+    vec4 FragPos = model * vec4(aPos, 1.0);
+    gl_Position = projection * view * FragPos;
+}
\ No newline at end of file
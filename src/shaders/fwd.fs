@@ -39,6 +39,37 @@ layout(std140, binding = 4) uniform directional_block{
     Light directionals[8];
 };
 
+layout(std140, binding = 5) uniform ShadowBlock{
+    mat4 lightVP[4];
+    vec4 shadowSplits; // far view distance of each cascade
+    vec4 shadowTexels; // world size of a texel of each cascade
+    vec4 shadowInfo;   // x: cascade count, y: index of the directional light
+};
+
+layout (binding = 0) uniform sampler2DArrayShadow shadowMap;
+
+// How much of directional light i reaches FragPos, 0 in full shadow
+float ShadowFactor(uint i, vec3 N)
+{
+    int cnt = int(shadowInfo.x);
+    float dist = -(view * vec4(FragPos, 1.0)).z;
+    if (cnt == 0 || i != uint(shadowInfo.y) || dist > shadowSplits[cnt - 1])
+        return 1.0;
+    int c = 0;
+    while (c < cnt - 1 && dist > shadowSplits[c])
+        c++;
+    // moved out along the normal by about a texel against acne
+    vec3 pos = FragPos + N * shadowTexels[c] * 1.5;
+    vec3 uvz = (lightVP[c] * vec4(pos, 1.0)).xyz * 0.5 + 0.5;
+    // 3x3 taps, each a 2x2 compare filtered by the sampler
+    vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    for (int x = -1; x <= 1; x++)
+        for (int y = -1; y <= 1; y++)
+            lit += texture(shadowMap, vec4(uvz.xy + vec2(x, y) * texel, c, uvz.z));
+    return lit / 9.0;
+}
+
 
 void handlePointLight(vec3 norm, vec3 viewDir, vec3 diffuse_rgb, vec3 specular_rgb){
     Light l0 = pointlights[0];
@@ -106,7 +137,7 @@ void handleDirectional(vec3 norm, vec3 viewDir, vec3 diffuse_rgb, vec3 specular_
     //float spec = pow(max(dot(norm, reflectDir), 0.0), shininess);
     vec3 f_specular = vec3(1.0, 1.0, 1.0) * spec * specular_rgb.r / 2.0;  
         
-    vec3 result = l0.color.xyz * intensity * (f_diffuse + f_specular);
+    vec3 result = l0.color.xyz * intensity * (f_diffuse + f_specular) * ShadowFactor(0u, TBN[2]);
     FragColor += vec4(result, 1.0);
 }
 
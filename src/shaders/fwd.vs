@@ -15,13 +15,24 @@ layout(std140, binding = 0) uniform VPBlock{
 };
 
 
-uniform mat4 model;
+// per draw data of the frame, the renderer sets draw_id for every draw
+struct DrawData{
+    mat4 model;
+    uint material;
+};
+
+layout(std430, binding = 1) readonly buffer DrawBlock{
+    DrawData draws[];
+};
+
+uniform uint draw_id;
 //uniform uint pointlight_cnt;
 //uniform uint spotlight_cnt;
 //uniform uint directional_cnt;
 
 void main()
 {
+    mat4 model = draws[draw_id].model;
     FragPos = vec3(model * vec4(aPos, 1.0));
     vec3 T = normalize(vec3(model * vec4(aTangent,   0.0)));
     vec3 N = normalize(vec3(model * vec4(aNormal,    0.0)));
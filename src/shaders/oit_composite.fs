@@ -0,0 +1,16 @@
+#version 450 core
+
+out vec4 FragColor;
+
+uniform sampler2D accum;
+uniform sampler2D reveal;
+
+// blended with GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA
+void main(){
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    float r = texelFetch(reveal, p, 0).r;
+    if (r >= 1.0)
+        discard;
+    vec4 a = texelFetch(accum, p, 0);
+    FragColor = vec4(a.rgb / max(a.a, 1e-5), r);
+}
@@ -0,0 +1,22 @@
+#version 450 core
+
+// unlit, for materials with the weighted render mode
+layout(location = 0) out vec4 accum;
+layout(location = 1) out float reveal;
+
+in vec3 FragPos;
+in mat3 TBN;
+in vec2 TexCoords;
+
+uniform sampler2D diffuse;
+uniform float opacity;
+
+void main(){
+    vec4 color = texture(diffuse, TexCoords);
+    color.a *= opacity;
+    // depth weight of McGuire and Bavoil, near fragments count more
+    float z = gl_FragCoord.z;
+    float w = clamp(color.a * max(1e-2, 3e3 * pow(1.0 - z, 3.0)), 1e-2, 3e3);
+    accum = vec4(color.rgb * color.a, color.a) * w;
+    reveal = color.a;
+}
@@ -0,0 +1,1060 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "../../src/render/render_queue.h"
+#include "../../src/render/draw_sort.h"
+#include "../../src/render/indirect.h"
+#include "../../src/render/renderer.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+using namespace renderer;
+
+// Compares the octree and the bvh render queue on generated scenes and
+// checks culling and queries against testing every object, also after
+// random updates, then times draw list sorting and checks the indirect commands built from it,
+// records whole frames with a headless renderer and times shadow cascades.
+// Exits with 1 when any check fails.
+// usage: cull_bench [object count] [frames] [occlusion dump.pgm]
+
+typedef std::vector<std::shared_ptr<RenderQueueItem>> ItemList;
+
+static std::shared_ptr<RenderQueueItem> make_item(unsigned int id, glm::vec3 min, glm::vec3 max)
+{
+    auto args = std::make_shared<common::RenderArguments>();
+    args->box = common::BoundingBox(min, max, 1.1f);
+    return std::make_shared<RenderQueueItem>(id, nullptr, nullptr, args, 0);
+}
+
+// Rooms on a grid with floors, walls, furniture and small clutter, so object
+// sizes span three orders of magnitude like an architectural scene
+static ItemList architectural_scene(unsigned int cnt, std::mt19937 &rng)
+{
+    ItemList items;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const float room = 12.0f, height = 4.0f;
+    unsigned int per_room = 64;
+    unsigned int side = std::max(1u, (unsigned int)std::sqrt(float(cnt / per_room)));
+    for (unsigned int i = 0; items.size() < cnt; i++)
+    {
+        glm::vec3 base(float(i % side) * room, float(i / (side * side)) * height, float(i / side % side) * room);
+        items.push_back(make_item(items.size() + 1, base, base + glm::vec3(room, 0.2f, room)));
+        items.push_back(make_item(items.size() + 1, base, base + glm::vec3(0.2f, height, room)));
+        items.push_back(make_item(items.size() + 1, base, base + glm::vec3(room, height, 0.2f)));
+        for (unsigned int j = 3; j < per_room && items.size() < cnt; j++)
+        {
+            float size = j < 12 ? 0.5f + unit(rng) * 1.5f : 0.05f + unit(rng) * 0.25f;
+            glm::vec3 pos = base + glm::vec3(unit(rng) * (room - size), 0.2f + unit(rng) * (height - size - 0.2f), unit(rng) * (room - size));
+            items.push_back(make_item(items.size() + 1, pos, pos + size));
+        }
+    }
+    items.resize(cnt);
+    return items;
+}
+
+static ItemList uniform_scene(unsigned int cnt, std::mt19937 &rng)
+{
+    ItemList items;
+    float extent = std::cbrt(float(cnt)) * 4.0f;
+    std::uniform_real_distribution<float> pos(0.0f, extent), size(0.2f, 1.5f);
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        glm::vec3 min(pos(rng), pos(rng), pos(rng));
+        items.push_back(make_item(i + 1, min, min + size(rng)));
+    }
+    return items;
+}
+
+// Closed box mesh with outward counter clockwise faces, as an occluder
+static std::shared_ptr<common::ModelMesh> box_mesh(glm::vec3 min, glm::vec3 max)
+{
+    auto mesh = std::make_shared<common::ModelMesh>();
+    for (int i = 0; i < 8; i++)
+    {
+        common::VertexProperties v = {};
+        v.position[0] = i & 1 ? max.x : min.x;
+        v.position[1] = i & 2 ? max.y : min.y;
+        v.position[2] = i & 4 ? max.z : min.z;
+        mesh->vertices.push_back(v);
+    }
+    const unsigned int faces[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+    for (auto &face : faces)
+        for (unsigned int k : {0, 1, 2, 0, 2, 3})
+            mesh->indices.push_back(face[k]);
+    mesh->box = common::BoundingBox(min, max, 1.0f);
+    return mesh;
+}
+
+// Blocks of buildings on a street grid with small objects between them,
+// the buildings are the occluders
+static ItemList city_scene(unsigned int cnt, std::mt19937 &rng, ItemList &occluders)
+{
+    ItemList items;
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const float block = 24.0f, street = 8.0f;
+    unsigned int side = std::max(2u, (unsigned int)std::sqrt(float(cnt) / 200.0f));
+    for (unsigned int i = 0; i < side * side; i++)
+    {
+        glm::vec3 min(float(i % side) * block + street * 0.5f, 0.0f, float(i / side) * block + street * 0.5f);
+        glm::vec3 max = min + glm::vec3(block - street, 10.0f + unit(rng) * 30.0f, block - street);
+        auto item = make_item(items.size() + 1, min, max);
+        item->mesh = box_mesh(min, max);
+        item->args->model = glm::mat4(1.0f);
+        items.push_back(item);
+        occluders.push_back(item);
+    }
+    float extent = side * block;
+    while (items.size() < cnt)
+    {
+        float size = 0.2f + unit(rng) * 1.5f;
+        glm::vec3 pos(unit(rng) * extent, unit(rng) * 3.0f, unit(rng) * extent);
+        items.push_back(make_item(items.size() + 1, pos, pos + size));
+    }
+    return items;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point st)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - st).count();
+}
+
+// The former view space test, transforms all 8 corners and checks each
+// against every plane. Kept as the reference for the plane kernel.
+struct CornerFrustum
+{
+    glm::mat4 view;
+    glm::vec3 frustum_dir[6];
+    glm::vec3 frustum_pos[6];
+
+    CornerFrustum(float fov, float aspect, float near, float far, const glm::mat4 &view) : view(view)
+    {
+        float thfov = glm::tan(fov / 2) * aspect;
+        for (int i = 0; i < 4; i++)
+            frustum_pos[i] = glm::vec3(0.0f);
+        frustum_pos[4] = glm::vec3(0, 0, -near);
+        frustum_pos[5] = glm::vec3(0, 0, -far);
+        frustum_dir[0] = glm::cross(glm::vec3(0, glm::tan(fov / 2), -1), glm::vec3(1.0, 0.0, 0.0));
+        frustum_dir[1] = frustum_dir[0];
+        frustum_dir[1].y = -frustum_dir[1].y;
+        frustum_dir[2] = glm::cross(glm::vec3(0.0, 1.0, 0.0), glm::vec3(thfov, 0, -1));
+        frustum_dir[3] = frustum_dir[2];
+        frustum_dir[3].x = -frustum_dir[2].x;
+        frustum_dir[4] = glm::vec3(0.0, 0.0, -1.0);
+        frustum_dir[5] = glm::vec3(0.0, 0.0, 1.0);
+    }
+
+    CameraParameters::frustum_relation Test(const common::BoundingBox &box)
+    {
+        glm::vec3 vertices[8];
+        for (int i = 0; i < 8; i++)
+        {
+            glm::vec3 vert((i & 4) ? box.min.x : box.max.x, (i & 2) ? box.min.y : box.max.y, (i & 1) ? box.min.z : box.max.z);
+            vertices[i] = view * glm::vec4(vert, 1.0);
+        }
+        bool intersect = false;
+        for (int i = 0; i < 6; i++)
+        {
+            bool allin = true, allout = true;
+            for (int j = 0; j < 8; j++)
+            {
+                if (glm::dot(vertices[j] - frustum_pos[i], frustum_dir[i]) < 0)
+                    allin = false;
+                else
+                    allout = false;
+            }
+            if (allout)
+                return CameraParameters::FRUSTUM_SEPARATE;
+            intersect |= !allin;
+        }
+        return intersect ? CameraParameters::FRUSTUM_INTERSECT : CameraParameters::FRUSTUM_INCLUDE;
+    }
+};
+
+// Returns false when a kernel rejects a box the corner test keeps
+static bool kernel_bench(unsigned int cnt)
+{
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> pos(-200.0f, 200.0f), size(0.1f, 8.0f);
+    std::vector<common::BoundingBox> boxes;
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        glm::vec3 min(pos(rng), pos(rng) * 0.2f, pos(rng));
+        boxes.push_back(common::BoundingBox(min, min + glm::vec3(size(rng), size(rng), size(rng)), 1.0f));
+    }
+    CameraParameters cam;
+    cam.view = glm::lookAt(glm::vec3(0.0f, 10.0f, 0.0f), glm::vec3(60.0f, 0.0f, 40.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    cam.UpdateParam(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 150.0f);
+    CornerFrustum corner(cam.fov, cam.aspect, cam.near, cam.far, cam.view);
+
+    std::vector<CameraParameters::frustum_relation> ref(cnt), plane(cnt), batch(cnt);
+    auto st = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < cnt; i++)
+        ref[i] = corner.Test(boxes[i]);
+    double corner_time = elapsed_ms(st);
+    st = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < cnt; i++)
+        plane[i] = cam.Test(boxes[i]);
+    double plane_time = elapsed_ms(st);
+    st = std::chrono::steady_clock::now();
+    cam.TestBatch(boxes.data(), cnt, batch.data());
+    double batch_time = elapsed_ms(st);
+
+    // include and intersect may trade places on boxes touching a plane, and
+    // the kernels may keep boxes within their slack outside, but never drop
+    // a box the corners keep
+    unsigned int plane_diff = 0, batch_diff = 0, dropped = 0, kept = 0;
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        plane_diff += plane[i] != ref[i];
+        batch_diff += batch[i] != plane[i];
+        for (auto relation : {plane[i], batch[i]})
+        {
+            bool separate = relation == CameraParameters::FRUSTUM_SEPARATE;
+            bool ref_separate = ref[i] == CameraParameters::FRUSTUM_SEPARATE;
+            dropped += separate && !ref_separate;
+            kept += !separate && ref_separate;
+        }
+    }
+#if defined(FRUSTUM_AVX)
+    const char *kernel = "avx";
+#elif defined(FRUSTUM_SSE)
+    const char *kernel = "sse";
+#else
+    const char *kernel = "scalar";
+#endif
+    std::cout << cnt << " boxes: 8 corners " << corner_time << " ms"
+              << ", planes " << plane_time << " ms"
+              << ", " << kernel << " batch " << batch_time << " ms"
+              << " (" << plane_diff << " differ from corners, " << batch_diff << " batch from planes, "
+              << kept << " kept within slack)" << (dropped ? ", " + std::to_string(dropped) + " dropped that the corners keep!" : "") << std::endl;
+    return !dropped;
+}
+
+static std::vector<unsigned int> sorted_ids(const ObjectList &items)
+{
+    std::vector<unsigned int> ids;
+    for (auto &item : items)
+        ids.push_back(item->id);
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+// Distances of hits against those of testing every object, which may pick
+// other objects at a tie. Each hit has to be where its own box is.
+static bool same_hits(const QueryHit *hits, unsigned int cnt, std::vector<std::pair<float, RenderQueueItem *>> &expected,
+                      const std::function<float(RenderQueueItem &)> &dist)
+{
+    std::sort(expected.begin(), expected.end());
+    for (unsigned int i = 0; i < cnt; i++)
+        if (hits[i].dist != expected[i].first || dist(*hits[i].item) != hits[i].dist)
+            return false;
+    return true;
+}
+
+// Compares the frustum cull of cam and random box, sphere, ray and nearest
+// queries around center with testing each of the live objects, returns the
+// number of answers that differ
+static unsigned int check_queries(RenderLayer &layer, const ItemList &live, CameraParameters &cam, std::mt19937 &rng,
+                                  glm::vec3 center, glm::vec3 size, unsigned int queries)
+{
+    std::uniform_real_distribution<float> unit(-0.5f, 0.5f);
+    unsigned int wrong = 0;
+    ObjectList visible, expected;
+    layer.FrustumCull(OPAQUE, cam, visible);
+    for (auto &item : live)
+        if (cam.Test(item->args->box) != CameraParameters::FRUSTUM_SEPARATE)
+            expected.push_back(item);
+    wrong += sorted_ids(visible) != sorted_ids(expected);
+
+    std::vector<RenderQueueItem *> found(live.size() + 1);
+    const unsigned int k = 8;
+    QueryHit hits[k];
+    std::vector<std::pair<float, RenderQueueItem *>> expected_hits;
+    float reach = glm::length(size);
+    for (unsigned int q = 0; q < queries; q++)
+    {
+        glm::vec3 p = center + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+        glm::vec3 half = (glm::vec3(unit(rng), unit(rng), unit(rng)) + 0.5f) * size * 0.05f;
+        common::BoundingBox box(p - half, p + half, 1.0f);
+        unsigned int cnt = layer.QueryBox(OPAQUE, box, found.data(), found.size());
+        ObjectList in_box, in_sphere;
+        for (unsigned int i = 0; i < std::min<size_t>(cnt, found.size()); i++)
+            in_box.push_back(std::shared_ptr<RenderQueueItem>(found[i], [](RenderQueueItem *) {}));
+        expected.clear();
+        for (auto &item : live)
+            if (common::BoxOverlap(item->args->box.min, item->args->box.max, box.min, box.max))
+                expected.push_back(item);
+        wrong += cnt != expected.size() || sorted_ids(in_box) != sorted_ids(expected);
+
+        float radius = (unit(rng) + 0.5f) * reach * 0.05f;
+        cnt = layer.QuerySphere(OPAQUE, p, radius, found.data(), found.size());
+        for (unsigned int i = 0; i < std::min<size_t>(cnt, found.size()); i++)
+            in_sphere.push_back(std::shared_ptr<RenderQueueItem>(found[i], [](RenderQueueItem *) {}));
+        expected.clear();
+        for (auto &item : live)
+            if (common::BoxSqDistance(item->args->box.min, item->args->box.max, p) <= radius * radius)
+                expected.push_back(item);
+        wrong += cnt != expected.size() || sorted_ids(in_sphere) != sorted_ids(expected);
+
+        glm::vec3 dir = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + 1e-4f);
+        glm::vec3 inv_dir = 1.0f / dir;
+        auto ray_dist = [&](RenderQueueItem &item) {
+            float t = -1.0f;
+            if (!common::RayBoxIntersect(item.args->box.min, item.args->box.max, p, inv_dir, reach, t))
+                return -1.0f;
+            return t;
+        };
+        cnt = layer.QueryRay(OPAQUE, p, dir, reach, hits, k);
+        expected_hits.clear();
+        for (auto &item : live)
+        {
+            float t = ray_dist(*item);
+            if (t >= 0.0f)
+                expected_hits.emplace_back(t, item.get());
+        }
+        wrong += cnt != std::min<size_t>(k, expected_hits.size()) || !same_hits(hits, cnt, expected_hits, ray_dist);
+
+        auto point_dist = [&](RenderQueueItem &item) {
+            return std::sqrt(common::BoxSqDistance(item.args->box.min, item.args->box.max, p));
+        };
+        cnt = layer.QueryNearest(OPAQUE, p, k, hits);
+        expected_hits.clear();
+        for (auto &item : live)
+            expected_hits.emplace_back(point_dist(*item), item.get());
+        wrong += cnt != std::min<size_t>(k, expected_hits.size()) || !same_hits(hits, cnt, expected_hits, point_dist);
+    }
+    return wrong;
+}
+
+// Returns false when a cull or query differs from another way of getting it
+static bool run(const std::string &name, ItemList &items, AccelType accel, unsigned int frames)
+{
+    std::mt19937 rng(42);
+    glm::vec3 min(1e30f), max(-1e30f);
+    for (auto &item : items)
+    {
+        min = glm::min(min, item->args->box.min);
+        max = glm::max(max, item->args->box.max);
+    }
+    glm::vec3 center = (min + max) * 0.5f, size = max - min;
+
+    RenderLayer layer;
+    layer.SetAccelType(accel);
+    auto st = std::chrono::steady_clock::now();
+    layer.BulkInsert(OPAQUE, items);
+    double build = elapsed_ms(st);
+
+    CameraParameters cam;
+    cam.view = glm::mat4(1.0f);
+    cam.viewport_height = 1080.0f;
+    cam.UpdateParam(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, glm::length(size) * 0.5f);
+    ObjectList visible, parallel_visible, contributing, culled_contributing;
+    std::vector<float> areas;
+    auto pool = common::ThreadPool::GetInstance();
+    double cull = 0.0, parallel_cull = 0.0, commit = 0.0;
+    size_t visible_cnt = 0, plane_tests = 0, subpixel_cnt = 0, small_cnt = 0;
+    double contribution = 0.0, contribution_cull = 0.0;
+    // the default shading threshold
+    ContributionCull subpixel;
+    subpixel.min_area[0] = 1.0f;
+    subpixel.areas = &areas;
+    CameraParameters *cam_ptr = &cam;
+    bool same = true;
+    // extra views orbiting at other angles, culled one by one and together
+    const unsigned int view_cnt = 4;
+    CameraParameters views[view_cnt];
+    CameraParameters *view_ptrs[view_cnt];
+    ObjectList separate_visible[view_cnt], multi_visible[view_cnt];
+    double separate = 0.0, multi = 0.0;
+    for (unsigned int v = 0; v < view_cnt; v++)
+    {
+        views[v] = cam;
+        view_ptrs[v] = &views[v];
+    }
+    std::uniform_real_distribution<float> unit(-0.5f, 0.5f);
+    for (unsigned int f = 0; f < frames; f++)
+    {
+        // orbit around the scene center, one percent of the objects move each frame
+        float angle = 6.2831853f * f / frames;
+        glm::vec3 eye = center + glm::vec3(std::cos(angle) * size.x * 0.4f, size.y * 0.5f + 2.0f, std::sin(angle) * size.z * 0.4f);
+        cam.view = glm::lookAt(eye, center, glm::vec3(0.0f, 1.0f, 0.0f));
+        cam.UpdatePlanes();
+        for (unsigned int i = 0; i < items.size() / 100; i++)
+        {
+            auto &item = items[rng() % items.size()];
+            glm::vec3 d(unit(rng), 0.0f, unit(rng));
+            item->args->box = common::BoundingBox(item->args->box.min + d, item->args->box.max + d, 1.1f);
+            layer.MarkDirty(item->id, OPAQUE);
+        }
+        st = std::chrono::steady_clock::now();
+        layer.CommitUpdates();
+        commit += elapsed_ms(st);
+
+        visible.clear();
+        st = std::chrono::steady_clock::now();
+        layer.FrustumCull(OPAQUE, cam, visible);
+        cull += elapsed_ms(st);
+        visible_cnt += visible.size();
+
+        parallel_visible.clear();
+        st = std::chrono::steady_clock::now();
+        layer.FrustumCull(OPAQUE, cam, parallel_visible, pool);
+        parallel_cull += elapsed_ms(st);
+        same &= parallel_visible == visible;
+
+        // objects below a pixel dropped after the cull, following each one
+        // to its box, and by the parallel cull tasks from their box arrays
+        contributing.clear();
+        st = std::chrono::steady_clock::now();
+        for (auto &item : visible)
+        {
+            float area = cam.ScreenArea(item->args->box);
+            if (area >= 1.0f)
+                contributing.push_back(item);
+            small_cnt += area < 16.0f;
+        }
+        contribution += elapsed_ms(st);
+        subpixel_cnt += visible.size() - contributing.size();
+
+        layer.EndFrame();
+        CullStats frame = layer.GetStats(OPAQUE, 0).last_frame.cull;
+        plane_tests += frame.plane_tests;
+
+        culled_contributing.clear();
+        areas.clear();
+        st = std::chrono::steady_clock::now();
+        layer.MultiViewCull(OPAQUE, &cam_ptr, 1, &culled_contributing, pool, nullptr, &subpixel);
+        contribution_cull += elapsed_ms(st);
+        same &= culled_contributing == contributing && areas.size() == contributing.size();
+        // left out of the plane tests of the next frame
+        layer.EndFrame();
+    }
+
+    // after the single view frames, the views below replace the cached planes
+    for (unsigned int f = 0; f < frames; f++)
+    {
+        float angle = 6.2831853f * f / frames;
+        for (unsigned int v = 0; v < view_cnt; v++)
+        {
+            float view_angle = angle + 6.2831853f * v / view_cnt;
+            glm::vec3 view_eye = center + glm::vec3(std::cos(view_angle) * size.x * 0.4f, size.y * 0.5f + 2.0f, std::sin(view_angle) * size.z * 0.4f);
+            views[v].view = glm::lookAt(view_eye, center, glm::vec3(0.0f, 1.0f, 0.0f));
+            views[v].UpdatePlanes();
+            separate_visible[v].clear();
+            multi_visible[v].clear();
+        }
+        st = std::chrono::steady_clock::now();
+        for (unsigned int v = 0; v < view_cnt; v++)
+            layer.FrustumCull(OPAQUE, views[v], separate_visible[v]);
+        separate += elapsed_ms(st);
+        st = std::chrono::steady_clock::now();
+        layer.MultiViewCull(OPAQUE, view_ptrs, view_cnt, multi_visible);
+        multi += elapsed_ms(st);
+        for (unsigned int v = 0; v < view_cnt; v++)
+            same &= separate_visible[v] == multi_visible[v];
+    }
+
+    std::vector<QueryHit> hits(16);
+    st = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        glm::vec3 origin = center + glm::vec3(unit(rng), unit(rng), unit(rng)) * size;
+        glm::vec3 dir = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + 1e-4f);
+        layer.QueryRay(OPAQUE, origin, dir, glm::length(size), hits.data(), 1);
+    }
+    double ray = elapsed_ms(st);
+    unsigned int wrong = check_queries(layer, items, cam, rng, center, size, 20);
+
+    std::cout << name << (accel == ACCEL_BVH ? " bvh   " : " octree")
+              << " build " << build << " ms"
+              << ", commit " << commit / frames << " ms"
+              << ", cull " << cull / frames << " ms"
+              << ", parallel cull " << parallel_cull / frames << " ms"
+              << (same ? "" : " (differs!)")
+              << ", visible " << visible_cnt / frames
+              << " (" << subpixel_cnt / frames << " below 1 px, " << small_cnt / frames << " below 16 px, dropped after the cull in "
+              << contribution / frames << " ms, culled with them " << contribution_cull / frames << " ms)"
+              << ", plane tests " << plane_tests / frames
+              << ", " << view_cnt << " views " << separate / frames << " ms one by one, " << multi / frames << " ms together"
+              << ", 1000 rays " << ray << " ms"
+              << (wrong ? ", " + std::to_string(wrong) + " answers differ from testing every object!" : "") << std::endl;
+    return same && !wrong;
+}
+
+// Moves, updates, inserts and removes objects at random, some far enough to
+// grow the root, and after each commit compares culling and the queries
+// with testing every object and looks for each object at its box. Returns
+// the number of answers that differ.
+static unsigned int update_check(AccelType accel, unsigned int seed, unsigned int frames)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> pos(-60.0f, 60.0f), unit(0.0f, 1.0f);
+    unsigned int next_id = 1;
+    auto make = [&]() {
+        glm::vec3 min(pos(rng), pos(rng) * 0.2f, pos(rng));
+        return make_item(next_id++, min, min + 0.2f + unit(rng) * 3.0f);
+    };
+    auto move = [&](RenderQueueItem &item, glm::vec3 d) {
+        item.args->box = common::BoundingBox(item.args->box.min + d, item.args->box.max + d, 1.1f);
+    };
+    ItemList live;
+    for (unsigned int i = 0; i < 3000; i++)
+        live.push_back(make());
+    RenderLayer layer;
+    layer.SetAccelType(accel);
+    ItemList inserted = live;
+    layer.BulkInsert(OPAQUE, inserted);
+
+    CameraParameters cam;
+    cam.viewport_height = 1080.0f;
+    cam.UpdateParam(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 200.0f);
+    std::vector<RenderQueueItem *> found;
+    unsigned int wrong = 0;
+    for (unsigned int f = 0; f < frames; f++)
+    {
+        for (unsigned int i = 0; i < 100; i++)
+        {
+            auto &item = live[rng() % live.size()];
+            glm::vec3 d(pos(rng), pos(rng) * 0.2f, pos(rng));
+            switch (rng() % 9)
+            {
+            case 0:
+                // out of the initial root, which grows to hold it
+                move(*item, d * 4.0f);
+                layer.MarkDirty(item->id, OPAQUE);
+                break;
+            case 1:
+                move(*item, d * 0.05f);
+                layer.UpdateObject(item->id, OPAQUE);
+                break;
+            case 2:
+                // anywhere else in the scene
+                move(*item, d - item->args->box.min);
+                layer.MarkDirty(item->id, OPAQUE);
+                break;
+            case 3:
+                live.push_back(make());
+                layer.InsertObject(OPAQUE, live.back());
+                break;
+            case 4:
+                layer.RemoveObject(item->id, OPAQUE);
+                item = live.back();
+                live.pop_back();
+                break;
+            default:
+                move(*item, d * 0.05f);
+                layer.MarkDirty(item->id, OPAQUE);
+                break;
+            }
+        }
+        if (f % 10 == 5)
+        {
+            ItemList more;
+            for (unsigned int i = 0; i < 200; i++)
+                more.push_back(make());
+            live.insert(live.end(), more.begin(), more.end());
+            layer.BulkInsert(OPAQUE, more);
+        }
+        layer.CommitUpdates();
+        glm::vec3 eye(pos(rng), 20.0f, pos(rng));
+        cam.view = glm::lookAt(eye, glm::vec3(pos(rng), 0.0f, pos(rng)), glm::vec3(0.0f, 1.0f, 0.0f));
+        cam.UpdatePlanes();
+        wrong += check_queries(layer, live, cam, rng, glm::vec3(0.0f), glm::vec3(160.0f, 40.0f, 160.0f), 8);
+        // and each object is found where it is now
+        found.resize(live.size());
+        for (auto &item : live)
+        {
+            unsigned int cnt = std::min<size_t>(layer.QueryBox(OPAQUE, item->args->box, found.data(), found.size()), found.size());
+            wrong += std::find(found.begin(), found.begin() + cnt, item.get()) == found.begin() + cnt;
+        }
+    }
+    return wrong;
+}
+
+// Runs update_check for both structures on a few seeds
+static bool update_bench(unsigned int frames)
+{
+    bool ok = true;
+    for (auto accel : {ACCEL_OCTREE, ACCEL_BVH})
+    {
+        unsigned int wrong = 0;
+        auto st = std::chrono::steady_clock::now();
+        for (unsigned int seed = 1; seed <= 6; seed++)
+            wrong += update_check(accel, seed, frames);
+        std::cout << "updates " << (accel == ACCEL_BVH ? "bvh   " : "octree") << " 6 seeds of " << frames << " frames checked in " << elapsed_ms(st) << " ms"
+                  << (wrong ? ", " + std::to_string(wrong) + " answers differ from testing every object!" : "") << std::endl;
+        ok &= !wrong;
+    }
+    return ok;
+}
+
+// Walks along a street, culling with and without the occluders rasterized
+static void occlusion_bench(unsigned int cnt, unsigned int frames, const char *dump)
+{
+    std::mt19937 rng(5);
+    ItemList occluders;
+    ItemList items = city_scene(cnt, rng, occluders);
+    RenderLayer layer;
+    layer.BulkInsert(OPAQUE, items);
+    float extent = occluders.back()->args->box.max.x;
+
+    CameraParameters cam;
+    cam.view = glm::mat4(1.0f);
+    cam.UpdateParam(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, extent);
+    OcclusionBuffer occlusion;
+    auto pool = common::ThreadPool::GetInstance();
+    ObjectList visible;
+    double raster = 0.0, cull = 0.0, occlusion_cull = 0.0;
+    size_t visible_cnt = 0, unoccluded_cnt = 0, triangle_cnt = 0;
+    for (unsigned int f = 0; f < frames; f++)
+    {
+        glm::vec3 eye(extent * (0.1f + 0.8f * f / frames), 1.7f, 0.0f);
+        cam.view = glm::lookAt(eye, eye + glm::vec3(0.3f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        cam.UpdatePlanes();
+
+        visible.clear();
+        auto st = std::chrono::steady_clock::now();
+        layer.FrustumCull(OPAQUE, cam, visible, pool);
+        cull += elapsed_ms(st);
+        unoccluded_cnt += visible.size();
+
+        st = std::chrono::steady_clock::now();
+        occlusion.Begin(cam);
+        for (auto &item : occluders)
+            if (cam.Test(item->args->box) != CameraParameters::FRUSTUM_SEPARATE)
+                occlusion.AddOccluder(*item->mesh, item->args->model);
+        occlusion.Finish(pool);
+        raster += elapsed_ms(st);
+        triangle_cnt += occlusion.TriangleCount();
+
+        visible.clear();
+        st = std::chrono::steady_clock::now();
+        layer.FrustumCull(OPAQUE, cam, visible, pool, &occlusion);
+        occlusion_cull += elapsed_ms(st);
+        visible_cnt += visible.size();
+    }
+    if (dump)
+        occlusion.DumpPGM(dump);
+    std::cout << "city " << occluders.size() << " occluders"
+              << ", rasterize " << raster / frames << " ms for " << triangle_cnt / frames << " triangles"
+              << ", cull " << cull / frames << " ms visible " << unoccluded_cnt / frames
+              << ", occlusion cull " << occlusion_cull / frames << " ms visible " << visible_cnt / frames << std::endl;
+}
+
+// Binds of consecutive draws with a different shader, material or mesh
+static void count_changes(const ObjectList &items, size_t *changes)
+{
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        bool first = i == 0;
+        changes[0] += first || items[i]->material->shader != items[i - 1]->material->shader;
+        changes[1] += first || items[i]->material != items[i - 1]->material;
+        changes[2] += first || items[i]->mesh != items[i - 1]->mesh;
+    }
+}
+
+// Stand ins for the GL calls of the state cache, there is no context here
+static void APIENTRY no_use_program(GLuint) {}
+static void APIENTRY no_bind_vertex_array(GLuint) {}
+static void APIENTRY no_bind_texture_unit(GLuint, GLuint) {}
+
+// GL calls that reach the driver when a draw loop binds the program, two
+// textures and the mesh of every item through the state cache
+static common::GLStateStats replay_binds(const ObjectList &items)
+{
+    glUseProgram = no_use_program;
+    glBindVertexArray = no_bind_vertex_array;
+    glBindTextureUnit = no_bind_texture_unit;
+    auto gl = common::GLState::GetInstance();
+    gl->Invalidate();
+    gl->TakeStats();
+    for (auto &item : items)
+    {
+        gl->UseProgram(item->material->shader->sort_id + 1);
+        gl->BindTexture(common::ENGINE_TEXTURE_CNT, item->material->sort_id * 2 + 1);
+        gl->BindTexture(common::ENGINE_TEXTURE_CNT + 1, item->material->sort_id * 2 + 2);
+        gl->BindVertexArray(item->mesh->sort_id + 1);
+    }
+    return gl->TakeStats();
+}
+
+struct BenchMaterial : public common::Material
+{
+    bool instanceable;
+
+    BenchMaterial(std::shared_ptr<common::ShaderProgram> shader, bool instanceable) : Material(shader, 0), instanceable(instanceable) {}
+
+    virtual bool Instanceable()
+    {
+        return instanceable;
+    }
+};
+
+// Every object of the list has to be in exactly one bucket, and every
+// command has to point at the indices and vertices of its mesh and at the
+// draw data of its objects
+static bool check_indirect(const DrawList &list, const std::vector<DrawData> &draws,
+                           const IndirectBuilder &indirect, const GeometryPool &pool)
+{
+    unsigned int objects = 0, next_batch = 0;
+    for (auto &bucket : indirect.buckets)
+    {
+        if (bucket.first_batch != next_batch)
+            return false;
+        next_batch += bucket.batch_cnt;
+        unsigned int bucket_objects = 0;
+        for (unsigned int b = bucket.first_batch; b < bucket.first_batch + bucket.batch_cnt; b++)
+        {
+            auto &batch = list.batches[b];
+            bucket_objects += batch.count;
+            auto &first = *list.items[batch.first];
+            if (bucket.material != first.material.get() || (bucket.command_cnt > 0) != first.material->Instanceable())
+                return false;
+            for (unsigned int i = 0; i < batch.count; i++)
+            {
+                auto &obj = *list.items[batch.first + i];
+                auto &draw = draws[batch.first_draw + i];
+                if (draw.model != obj.args->model || draw.material != obj.material->sort_id)
+                    return false;
+            }
+            if (!bucket.command_cnt)
+                continue;
+            if (bucket.command_cnt != bucket.batch_cnt)
+                return false;
+            auto &cmd = indirect.commands[bucket.first_command + b - bucket.first_batch];
+            auto &mesh = *first.mesh;
+            if (cmd.count != mesh.indices.size() || cmd.instance_count != batch.count || cmd.base_instance != batch.first_draw)
+                return false;
+            for (unsigned int t = 0; t < cmd.count; t++)
+            {
+                if (pool.indices[cmd.first_index + t] != mesh.indices[t])
+                    return false;
+                auto &v = pool.vertices[cmd.base_vertex + pool.indices[cmd.first_index + t]];
+                if (std::memcmp(&v, &mesh.vertices[mesh.indices[t]], sizeof(v)))
+                    return false;
+            }
+        }
+        if (bucket_objects != bucket.objects)
+            return false;
+        objects += bucket_objects;
+    }
+    return next_batch == list.batches.size() && objects == list.items.size();
+}
+
+// Keys and sorts a visible list in traversal order, which is random with
+// respect to state, and counts the binds and draw calls left. Every material
+// is used with a few meshes, as props sharing a texture set.
+static bool sort_bench(unsigned int cnt, unsigned int frames)
+{
+    std::mt19937 rng(7);
+    std::vector<std::shared_ptr<common::ShaderProgram>> shaders;
+    std::vector<std::shared_ptr<common::Material>> materials;
+    std::vector<std::shared_ptr<common::ModelMesh>> meshes;
+    for (int i = 0; i < 8; i++)
+        shaders.push_back(std::make_shared<common::ShaderProgram>());
+    for (int i = 0; i < 256; i++)
+        materials.push_back(std::make_shared<BenchMaterial>(shaders[rng() % shaders.size()], i % 8 != 0));
+    for (int i = 0; i < 1024; i++)
+        meshes.push_back(box_mesh(glm::vec3(0.0f), glm::vec3(1.0f + i % 7)));
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    ObjectList items;
+    std::vector<float> depth;
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        auto item = make_item(i + 1, glm::vec3(0.0f), glm::vec3(1.0f));
+        item->args->model = glm::translate(glm::mat4(1.0f), glm::vec3(unit(rng), unit(rng), unit(rng)) * 100.0f);
+        unsigned int material = rng() % materials.size();
+        item->material = materials[material];
+        item->mesh = meshes[(material * 4 + rng() % 4) % meshes.size()];
+        items.push_back(item);
+        depth.push_back(unit(rng));
+    }
+
+    SortKeyLayout layout = SortKeyLayout::Default(PASS_OPAQUE);
+    DrawList list;
+    std::vector<std::pair<unsigned long long, unsigned int>> pairs;
+    double radix = 0.0, comparison = 0.0;
+    for (unsigned int f = 0; f < frames; f++)
+    {
+        auto st = std::chrono::steady_clock::now();
+        list.Clear();
+        for (unsigned int i = 0; i < cnt; i++)
+            list.Add(items[i], layout.Key(PASS_OPAQUE, 0, *items[i], depth[i]));
+        list.Sort(layout.KeyBits());
+        radix += elapsed_ms(st);
+
+        st = std::chrono::steady_clock::now();
+        pairs.clear();
+        for (unsigned int i = 0; i < cnt; i++)
+            pairs.emplace_back(layout.Key(PASS_OPAQUE, 0, *items[i], depth[i]), i);
+        std::sort(pairs.begin(), pairs.end());
+        comparison += elapsed_ms(st);
+    }
+    size_t before[3] = {0, 0, 0}, after[3] = {0, 0, 0};
+    count_changes(items, before);
+    count_changes(list.items, after);
+    auto unsorted_binds = replay_binds(items);
+    auto sorted_binds = replay_binds(list.items);
+    std::vector<DrawData> draws;
+    auto st = std::chrono::steady_clock::now();
+    list.BuildBatches(true, true, draws);
+    double batching = elapsed_ms(st);
+    draws.clear();
+    list.BuildBatches(true, false, draws);
+    GeometryPool pool;
+    IndirectBuilder indirect;
+    st = std::chrono::steady_clock::now();
+    indirect.Build(list, pool, true);
+    double indirect_build = elapsed_ms(st);
+    bool exact = check_indirect(list, draws, indirect, pool);
+    unsigned int multi_draws = 0, single_draws = 0;
+    for (auto &bucket : indirect.buckets)
+        if (bucket.command_cnt)
+            multi_draws++;
+        else
+            single_draws += bucket.objects;
+    std::cout << "draw sort " << cnt << " items, " << layout.KeyBits() << " bit keys"
+              << ", radix " << radix / frames << " ms, std::sort " << comparison / frames << " ms"
+              << ", shader/material/mesh changes " << before[0] << "/" << before[1] << "/" << before[2]
+              << " unsorted, " << after[0] << "/" << after[1] << "/" << after[2] << " sorted"
+              << ", state cache issued/skipped " << unsorted_binds.Issued() << "/" << unsorted_binds.Skipped()
+              << " unsorted, " << sorted_binds.Issued() << "/" << sorted_binds.Skipped() << " sorted"
+              << ", " << list.batches.size() << " draw calls instanced (" << batching << " ms)"
+              << ", indirect " << multi_draws << " multi draws of " << indirect.commands.size() << " commands and "
+              << single_draws << " single draws (" << indirect_build << " ms)"
+              << (exact ? "" : " (wrong commands!)") << std::endl;
+    return exact;
+}
+
+// Renders frames of a scene like the one of sort_bench with a headless
+// renderer, so culling, sorting, batching and uploads are timed without a
+// GPU, with draws recorded in parallel and serially. One frame is recorded
+// and replayed, which has to give the same counts.
+static bool frame_bench(unsigned int cnt, unsigned int frames)
+{
+    std::mt19937 rng(11);
+    std::vector<std::shared_ptr<common::ShaderProgram>> shaders;
+    std::vector<std::shared_ptr<common::Material>> materials;
+    std::vector<std::shared_ptr<common::ModelMesh>> meshes;
+    for (int i = 0; i < 8; i++)
+        shaders.push_back(std::make_shared<common::ShaderProgram>());
+    for (int i = 0; i < 256; i++)
+    {
+        materials.push_back(std::make_shared<BenchMaterial>(shaders[rng() % shaders.size()], i % 8 != 0));
+        if (i % 16 == 3)
+            materials.back()->render_mode = common::RENDER_MODE_TRANSPARENT;
+        if (i % 16 == 5)
+            materials.back()->render_mode = common::RENDER_MODE_WEIGHTED;
+    }
+    for (int i = 0; i < 1024; i++)
+        meshes.push_back(box_mesh(glm::vec3(0.0f), glm::vec3(1.0f + i % 7)));
+    std::uniform_real_distribution<float> pos(-200.0f, 200.0f);
+    ItemList items, transparent;
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        unsigned int material = rng() % materials.size();
+        auto mesh = meshes[(material * 4 + rng() % 4) % meshes.size()];
+        glm::vec3 min(pos(rng), pos(rng) * 0.1f, pos(rng));
+        auto item = make_item(i + 1, min, min + mesh->box.max);
+        item->args->model = glm::translate(glm::mat4(1.0f), min);
+        item->material = materials[material];
+        item->mesh = mesh;
+        item->vertex_cnt = mesh->indices.size();
+        (item->material->render_mode == common::RENDER_MODE_OPAQUE ? items : transparent).push_back(item);
+    }
+    auto &layer = RenderLayerManager::GetInstance()->layers[0];
+    layer.BulkInsert(OPAQUE, items);
+    layer.BulkInsert(TRANSPARENT, transparent);
+
+    Renderer renderer;
+    renderer.UpdateView(glm::lookAt(glm::vec3(0.0f, 30.0f, 0.0f), glm::vec3(100.0f, 0.0f, 100.0f), glm::vec3(0.0f, 1.0f, 0.0f)),
+                        glm::vec3(0.0f, 30.0f, 0.0f), false);
+    renderer.UpdateProjection(glm::radians(60.0f), 1920.0f, 1080.0f, 0.1f, 500.0f, false);
+    auto time_frames = [&](common::CommandStats &stats) {
+        renderer.Render();
+        renderer.GetCommandStats();
+        auto st = std::chrono::steady_clock::now();
+        for (unsigned int f = 0; f < frames; f++)
+            renderer.Render();
+        double ret = elapsed_ms(st) / frames;
+        stats = renderer.GetCommandStats();
+        return ret;
+    };
+    common::CommandStats stats, serial_stats, single_stats, single_serial_stats;
+    double frame = time_frames(stats);
+    renderer.SetParallelRecording(false);
+    double serial = time_frames(serial_stats);
+    // one draw call per object, where recording costs the most
+    renderer.SetIndirectDraw(false);
+    renderer.SetInstancing(false);
+    double single_serial = time_frames(single_serial_stats);
+    renderer.SetParallelRecording(true);
+    double single = time_frames(single_stats);
+
+    auto recorder = std::make_shared<common::NullBackend>(true);
+    renderer.SetBackend(recorder);
+    renderer.Render();
+    auto recorded = recorder->TakeStats();
+    common::NullBackend replay;
+    recorder->Replay(replay);
+    auto replayed = replay.TakeStats();
+    // sorted transparency has to come back to front, up to the key precision
+    auto &sorted = renderer.GetPassList(PASS_TRANSPARENT);
+    glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 30.0f, 0.0f), glm::vec3(100.0f, 0.0f, 100.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    bool back_to_front = true;
+    for (unsigned int i = 1; i < sorted.items.size(); i++)
+    {
+        auto depth = [&](unsigned int k) {
+            auto &box = sorted.items[k]->args->box;
+            return -(view * glm::vec4((box.min + box.max) * 0.5f, 1.0f)).z;
+        };
+        back_to_front &= depth(i) <= depth(i - 1) + 1e-3f;
+    }
+    auto &weighted = renderer.GetPassList(PASS_WEIGHTED);
+    bool same = recorded.Total() == replayed.Total() && recorded.draws == replayed.draws &&
+                recorder->recorded.commands.size() == recorded.Total() &&
+                stats.draws == serial_stats.draws && single_stats.draws == single_serial_stats.draws;
+    std::cout << "headless frame " << cnt << " items, " << frame << " ms (" << serial << " ms recorded serially)"
+              << ", " << stats.Total() / frames << " commands and " << stats.draws / frames << " draws per frame"
+              << ", single draws " << single << " ms (" << single_serial << " ms serially)"
+              << ", " << single_stats.Total() / frames << " commands and " << single_stats.draws / frames << " draws per frame"
+              << ", " << renderer.GetDrawList(false).size() << " objects drawn"
+              << ", transparent " << sorted.items.size() << " sorted in " << sorted.batches.size() << " batches"
+              << (back_to_front ? "" : " (not back to front!)")
+              << " and " << weighted.items.size() << " weighted in " << weighted.batches.size() << " batches"
+              << (same ? "" : " (replay differs!)") << std::endl;
+    return same && back_to_front;
+}
+
+// Times fitting cascades to a camera walking through the scene and culling
+// casters against them, then draws headless frames where only dynamic
+// casters are drawn once static depth is cached. render_tests checks the
+// cascades and casters. None of it needs a GPU.
+static void shadow_bench(unsigned int cnt, unsigned int frames)
+{
+    glm::vec3 light_dir(-0.4f, -1.0f, -0.3f);
+    glm::vec3 up(0.0f, 1.0f, 0.0f);
+    CameraParameters cam;
+    cam.viewport_height = 1080.0f;
+    cam.UpdateParam(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f);
+    auto place = [&](glm::vec3 eye, float yaw) {
+        cam.view = glm::lookAt(eye, eye + glm::vec3(std::cos(yaw), -0.2f, std::sin(yaw)), up);
+        cam.viewPos = glm::vec4(eye, 0.0f);
+        cam.UpdatePlanes();
+    };
+    CascadedShadowMap shadow;
+    unsigned int cascades = shadow.CascadeCount();
+    const unsigned int steps = 2000;
+    unsigned int refits = 0;
+    std::vector<glm::mat4> last(cascades, glm::mat4(0.0f));
+    double fit_ms = 0;
+    for (unsigned int step = 0; step < steps; step++)
+    {
+        float t = step * 0.01f;
+        place(glm::vec3(t * 2.0f, 10.0f, t * 0.5f), t * 0.2f);
+        auto st = std::chrono::steady_clock::now();
+        shadow.Fit(cam, light_dir);
+        fit_ms += elapsed_ms(st);
+        for (unsigned int i = 0; i < cascades; i++)
+        {
+            auto &cascade = shadow.GetCascade(i);
+            glm::mat4 vp = cascade.camera.projection * cascade.camera.view;
+            if (vp == last[i])
+                continue;
+            refits += step > 0;
+            last[i] = vp;
+        }
+    }
+
+    std::mt19937 rng(5);
+    auto shader = std::make_shared<common::ShaderProgram>();
+    std::vector<std::shared_ptr<common::Material>> materials;
+    std::vector<std::shared_ptr<common::ModelMesh>> meshes;
+    for (int i = 0; i < 16; i++)
+        materials.push_back(std::make_shared<BenchMaterial>(shader, true));
+    for (int i = 0; i < 64; i++)
+        meshes.push_back(box_mesh(glm::vec3(0.0f), glm::vec3(1.0f + i % 5)));
+    std::uniform_real_distribution<float> pos(-200.0f, 200.0f);
+    ItemList casters;
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        auto mesh = meshes[rng() % meshes.size()];
+        glm::vec3 min(pos(rng), pos(rng) * 0.05f, pos(rng));
+        auto item = make_item(i + 1, min, min + mesh->box.max);
+        item->args->model = glm::translate(glm::mat4(1.0f), min);
+        item->material = materials[rng() % materials.size()];
+        item->mesh = mesh;
+        item->vertex_cnt = mesh->indices.size();
+        // one in eight moves
+        item->is_static = i % 8 != 0;
+        casters.push_back(item);
+    }
+    RenderLayer layer;
+    ItemList inserted = casters;
+    layer.BulkInsert(OPAQUE_SHADOW, inserted);
+    place(glm::vec3(0.0f, 30.0f, 0.0f), 0.7f);
+    shadow.Fit(cam, light_dir);
+    auto st = std::chrono::steady_clock::now();
+    shadow.CullCasters(&layer, 1);
+    double cull_ms = elapsed_ms(st);
+    unsigned int culled = 0;
+    for (unsigned int i = 0; i < cascades; i++)
+        culled += shadow.GetCascade(i).static_casters.size() + shadow.GetCascade(i).dynamic_casters.size();
+
+    // whole frames, the casters in a layer of their own so they are not drawn
+    auto &frame_layer = RenderLayerManager::GetInstance()->layers[1];
+    ItemList frame_casters = casters;
+    frame_layer.BulkInsert(OPAQUE_SHADOW, frame_casters);
+    auto light = std::make_shared<LightParameters>(DIRECTIONAL_LIGHT, true,
+                                                   InnerLightParameters(glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(1.0f), glm::vec4(light_dir, 0.0f)));
+    auto light_id = LightManager::GetInstance()->InsertItem(light);
+    Renderer renderer;
+    renderer.UpdateView(cam.view, glm::vec3(cam.viewPos), false);
+    renderer.UpdateProjection(glm::radians(60.0f), 1920.0f, 1080.0f, 0.1f, 500.0f, false);
+    auto objects = [](const DrawStats &stats) { return stats.shader_binds + stats.shader_binds_avoided; };
+    renderer.Render();
+    auto first = renderer.GetShadowDrawStats();
+    st = std::chrono::steady_clock::now();
+    for (unsigned int f = 0; f < frames; f++)
+        renderer.Render();
+    double frame = elapsed_ms(st) / frames;
+    auto steady = renderer.GetShadowDrawStats();
+    renderer.SetShadows(false);
+    st = std::chrono::steady_clock::now();
+    for (unsigned int f = 0; f < frames; f++)
+        renderer.Render();
+    double unshadowed = elapsed_ms(st) / frames;
+    LightManager::GetInstance()->RemoveItem(light_id);
+    for (auto &item : casters)
+        frame_layer.RemoveObject(item->id, OPAQUE_SHADOW);
+
+    std::cout << "cascades " << cascades << ", fit " << fit_ms * 1000 / steps << " us, " << refits << " refits in " << steps << " steps" << std::endl;
+    std::cout << "casters " << cnt << " culled to " << culled << " in " << cull_ms << " ms, shadow objects drawn " << objects(first) << " first frame, "
+              << objects(steady) << " with cached static depth, " << frame << " ms per frame (" << unshadowed << " ms without shadows)" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int cnt = argc > 1 ? std::stoul(argv[1]) : 100000;
+    unsigned int frames = argc > 2 ? std::stoul(argv[2]) : 100;
+    bool ok = kernel_bench(1000000);
+    std::cout << common::ThreadPool::GetInstance()->WorkerCount() + 1 << " threads for parallel culling" << std::endl;
+    for (auto accel : {ACCEL_OCTREE, ACCEL_BVH})
+    {
+        // same seed, both structures see the same scenes
+        std::mt19937 rng(1);
+        ItemList arch = architectural_scene(cnt, rng);
+        ok &= run("architectural", arch, accel, frames);
+        ItemList uniform = uniform_scene(cnt, rng);
+        ok &= run("uniform      ", uniform, accel, frames);
+    }
+    ok &= update_bench(40);
+    occlusion_bench(cnt, frames, argc > 3 ? argv[3] : nullptr);
+    ok &= sort_bench(cnt, frames);
+    ok &= frame_bench(cnt, frames);
+    shadow_bench(cnt, frames);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,657 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+#include "../../src/render/render_queue.h"
+#include "../../src/render/draw_sort.h"
+#include "../../src/render/indirect.h"
+#include "../../src/render/shadow.h"
+#include "../../src/render/renderer.h"
+
+using namespace renderer;
+
+// Checks the CPU side of the renderer against values worked out by hand.
+// Every failed check is printed and the exit code is non-zero if any failed.
+// usage: render_tests
+
+static unsigned int failures = 0;
+
+#define CHECK(cond)                                                                         \
+    do                                                                                      \
+    {                                                                                       \
+        if (!(cond))                                                                        \
+        {                                                                                   \
+            std::cout << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            failures++;                                                                     \
+        }                                                                                   \
+    } while (0)
+
+struct TestMaterial : public common::Material
+{
+    bool instanceable;
+
+    TestMaterial(std::shared_ptr<common::ShaderProgram> shader, bool instanceable) : Material(shader, 0), instanceable(instanceable) {}
+
+    virtual bool Instanceable()
+    {
+        return instanceable;
+    }
+};
+
+// vertex i lies at (i, sort id), so the vertices of two meshes never match
+static std::shared_ptr<common::ModelMesh> make_mesh(unsigned int vertex_cnt, unsigned int index_cnt)
+{
+    auto mesh = std::make_shared<common::ModelMesh>();
+    for (unsigned int i = 0; i < vertex_cnt; i++)
+    {
+        common::VertexProperties v = {};
+        v.position[0] = float(i);
+        v.position[1] = float(mesh->sort_id);
+        mesh->vertices.push_back(v);
+    }
+    for (unsigned int i = 0; i < index_cnt; i++)
+        mesh->indices.push_back((i * 7) % vertex_cnt);
+    return mesh;
+}
+
+static std::shared_ptr<RenderQueueItem> make_item(unsigned int id, std::shared_ptr<common::Material> material,
+                                                  std::shared_ptr<common::ModelMesh> mesh)
+{
+    auto args = std::make_shared<common::RenderArguments>(glm::translate(glm::mat4(1.0f), glm::vec3(float(id), 0.0f, 0.0f)));
+    auto item = std::make_shared<RenderQueueItem>(id, nullptr, nullptr, args, 0);
+    item->material = material;
+    item->mesh = mesh;
+    item->vertex_cnt = mesh->indices.size();
+    return item;
+}
+
+static bool same_command(const DrawElementsIndirectCommand &a, const DrawElementsIndirectCommand &b)
+{
+    return a.count == b.count && a.instance_count == b.instance_count && a.first_index == b.first_index &&
+           a.base_vertex == b.base_vertex && a.base_instance == b.base_instance;
+}
+
+static bool same_bucket(const IndirectBucket &a, const IndirectBucket &b)
+{
+    return a.material == b.material && a.first_batch == b.first_batch && a.batch_cnt == b.batch_cnt &&
+           a.first_command == b.first_command && a.command_cnt == b.command_cnt && a.objects == b.objects;
+}
+
+static void check_commands(const IndirectBuilder &indirect, const std::vector<DrawElementsIndirectCommand> &expected)
+{
+    CHECK(indirect.commands.size() == expected.size());
+    for (unsigned int i = 0; i < std::min(indirect.commands.size(), expected.size()); i++)
+        CHECK(same_command(indirect.commands[i], expected[i]));
+}
+
+static void check_buckets(const IndirectBuilder &indirect, const std::vector<IndirectBucket> &expected)
+{
+    CHECK(indirect.buckets.size() == expected.size());
+    for (unsigned int i = 0; i < std::min(indirect.buckets.size(), expected.size()); i++)
+        CHECK(same_bucket(indirect.buckets[i], expected[i]));
+}
+
+// The pool holds the indices and vertices of mesh at range
+static bool pool_holds(const GeometryPool &pool, const MeshRange &range, const common::ModelMesh &mesh)
+{
+    if (range.index_count != mesh.indices.size() || range.first_index + range.index_count > pool.indices.size() ||
+        range.base_vertex + mesh.vertices.size() > pool.vertices.size())
+        return false;
+    if (!std::equal(mesh.indices.begin(), mesh.indices.end(), pool.indices.begin() + range.first_index))
+        return false;
+    return !std::memcmp(&pool.vertices[range.base_vertex], mesh.vertices.data(), mesh.vertices.size() * sizeof(common::VertexProperties));
+}
+
+// Draws by material: instanced runs, a run of one, a material without an
+// instanced program in between and a mesh met again after it
+static void test_indirect_by_material()
+{
+    auto shader = std::make_shared<common::ShaderProgram>();
+    auto a = std::make_shared<TestMaterial>(shader, true);
+    auto b = std::make_shared<TestMaterial>(shader, true);
+    auto c = std::make_shared<TestMaterial>(shader, false);
+    auto box = make_mesh(8, 36);
+    auto slab = make_mesh(8, 36);
+    auto tri = make_mesh(3, 3);
+
+    DrawList list;
+    std::shared_ptr<common::Material> materials[9] = {a, a, a, b, b, b, c, c, a};
+    std::shared_ptr<common::ModelMesh> meshes[9] = {box, box, slab, tri, tri, tri, box, box, slab};
+    for (unsigned int i = 0; i < 9; i++)
+        list.Add(make_item(i + 1, materials[i], meshes[i]), i);
+    std::vector<DrawData> draws;
+    list.BuildBatches(true, true, draws);
+
+    CHECK(list.batches.size() == 5);
+    const DrawBatch batches[5] = {{0, 2, 0, true}, {2, 1, 2, false}, {3, 3, 3, true}, {6, 2, 6, false}, {8, 1, 8, false}};
+    for (unsigned int i = 0; i < std::min<size_t>(list.batches.size(), 5); i++)
+    {
+        auto &batch = list.batches[i];
+        CHECK(batch.first == batches[i].first && batch.count == batches[i].count &&
+              batch.first_draw == batches[i].first_draw && batch.instanced == batches[i].instanced);
+    }
+    CHECK(draws.size() == 9);
+    for (unsigned int i = 0; i < std::min<size_t>(draws.size(), 9); i++)
+        CHECK(draws[i].model == list.items[i]->args->model && draws[i].material == materials[i]->sort_id);
+
+    GeometryPool pool;
+    IndirectBuilder indirect;
+    indirect.Build(list, pool, true);
+    // box at index 0 and vertex 0, slab after it, tri last. c has no
+    // instanced program, its batch is a bucket without commands.
+    check_commands(indirect, {{36, 2, 0, 0, 0}, {36, 1, 36, 8, 2}, {3, 3, 72, 16, 3}, {36, 1, 36, 8, 8}});
+    check_buckets(indirect, {{a.get(), 0, 2, 0, 2, 3}, {b.get(), 2, 1, 2, 1, 3}, {c.get(), 3, 1, 3, 0, 2}, {a.get(), 4, 1, 3, 1, 1}});
+    CHECK(pool.indices.size() == 75 && pool.vertices.size() == 19);
+    CHECK(pool_holds(pool, pool.Get(*box), *box));
+    CHECK(pool_holds(pool, pool.Get(*slab), *slab));
+    CHECK(pool_holds(pool, pool.Get(*tri), *tri));
+    CHECK(pool.TakeDirty());
+    CHECK(!pool.TakeDirty());
+
+    // the next frame finds every mesh in the pool
+    indirect.Clear();
+    indirect.Build(list, pool, true);
+    CHECK(indirect.commands.size() == 4 && same_command(indirect.commands[3], {36, 1, 36, 8, 8}));
+    CHECK(pool.indices.size() == 75 && pool.vertices.size() == 19);
+    CHECK(!pool.TakeDirty());
+}
+
+// A pass with its own program ignores materials, the batches split by mesh
+// only and all of them are one bucket, instanceable or not
+static void test_indirect_own_program()
+{
+    auto shader = std::make_shared<common::ShaderProgram>();
+    auto a = std::make_shared<TestMaterial>(shader, true);
+    auto c = std::make_shared<TestMaterial>(shader, false);
+    auto box = make_mesh(8, 36);
+    auto tri = make_mesh(3, 3);
+
+    DrawList list;
+    std::shared_ptr<common::Material> materials[5] = {a, c, a, c, a};
+    std::shared_ptr<common::ModelMesh> meshes[5] = {box, box, box, tri, tri};
+    for (unsigned int i = 0; i < 5; i++)
+        list.Add(make_item(i + 1, materials[i], meshes[i]), i);
+    std::vector<DrawData> draws;
+    list.BuildBatches(false, true, draws);
+    CHECK(list.batches.size() == 2);
+    CHECK(list.batches[0].first == 0 && list.batches[0].count == 3 && list.batches[0].instanced);
+    CHECK(list.batches[1].first == 3 && list.batches[1].count == 2 && list.batches[1].first_draw == 3 && list.batches[1].instanced);
+
+    // tri was added to the pool before box this time
+    GeometryPool pool;
+    pool.Get(*tri);
+    IndirectBuilder indirect;
+    indirect.Build(list, pool, false);
+    check_commands(indirect, {{36, 3, 3, 3, 0}, {3, 2, 0, 0, 3}});
+    check_buckets(indirect, {{nullptr, 0, 2, 0, 2, 5}});
+
+    // a second list appends its buckets after those of the first
+    DrawList more;
+    more.Add(make_item(6, c, tri), 0);
+    more.BuildBatches(false, true, draws);
+    indirect.Build(more, pool, false);
+    check_commands(indirect, {{36, 3, 3, 3, 0}, {3, 2, 0, 0, 3}, {3, 1, 0, 0, 5}});
+    check_buckets(indirect, {{nullptr, 0, 2, 0, 2, 5}, {nullptr, 0, 1, 2, 1, 1}});
+}
+
+// Meshes are copied once, a mesh without indices is never added
+static void test_geometry_pool()
+{
+    GeometryPool pool;
+    auto box = make_mesh(8, 36);
+    auto empty = make_mesh(4, 0);
+    CHECK(!pool.TakeDirty());
+    MeshRange first = pool.Get(*box);
+    CHECK(first.first_index == 0 && first.index_count == 36 && first.base_vertex == 0);
+    CHECK(pool.TakeDirty());
+    MeshRange again = pool.Get(*box);
+    CHECK(again.first_index == 0 && again.index_count == 36 && again.base_vertex == 0);
+    CHECK(!pool.TakeDirty());
+    CHECK(pool.Get(*empty).index_count == 0);
+    CHECK(!pool.TakeDirty());
+    CHECK(pool.indices.size() == 36 && pool.vertices.size() == 8);
+    CHECK(pool_holds(pool, pool.Get(*box), *box));
+}
+
+static void place_camera(CameraParameters &cam, glm::vec3 eye, float yaw)
+{
+    cam.view = glm::lookAt(eye, eye + glm::vec3(std::cos(yaw), -0.2f, std::sin(yaw)), glm::vec3(0.0f, 1.0f, 0.0f));
+    cam.viewPos = glm::vec4(eye, 0.0f);
+    cam.UpdatePlanes();
+}
+
+static CameraParameters shadow_camera()
+{
+    CameraParameters cam;
+    cam.viewport_height = 1080.0f;
+    cam.UpdateParam(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f);
+    place_camera(cam, glm::vec3(0.0f, 10.0f, 0.0f), 0.0f);
+    return cam;
+}
+
+static glm::mat4 light_vp(const ShadowCascade &cascade)
+{
+    return cascade.camera.projection * cascade.camera.view;
+}
+
+// The box of the cascade holds all corners of its slice
+static bool slice_inside(const CameraParameters &cam, const ShadowCascade &cascade)
+{
+    glm::mat4 to_box = light_vp(cascade) * glm::inverse(cam.view);
+    float tan_half = std::tan(cam.fov * 0.5f);
+    for (int k = 0; k < 8; k++)
+    {
+        float d = k & 4 ? cascade.split_far : cascade.split_near;
+        glm::vec4 corner(d * tan_half * cam.aspect * (k & 1 ? 1 : -1), d * tan_half * (k & 2 ? 1 : -1), -d, 1.0f);
+        glm::vec3 p = to_box * corner;
+        const float eps = 1e-4f;
+        if (std::abs(p.x) > 1 + eps || std::abs(p.y) > 1 + eps || std::abs(p.z) > 1 + eps)
+            return false;
+    }
+    return true;
+}
+
+static const glm::vec3 shadow_light(-0.4f, -1.0f, -0.3f);
+
+// A camera walking and turning through the scene: every slice stays in its
+// box and every refit box has its origin on the texel grid of the light
+static void test_shadow_fit()
+{
+    CameraParameters cam = shadow_camera();
+    CascadedShadowMap shadow;
+    unsigned int cascades = shadow.CascadeCount();
+    glm::mat4 light_view = glm::lookAt(glm::vec3(0.0f), glm::normalize(shadow_light), glm::vec3(0.0f, 1.0f, 0.0f));
+    unsigned int outside = 0, unsnapped = 0, refits = 0;
+    std::vector<glm::mat4> last(cascades, glm::mat4(0.0f));
+    for (unsigned int step = 0; step < 2000; step++)
+    {
+        float t = step * 0.01f;
+        place_camera(cam, glm::vec3(t * 2.0f, 10.0f, t * 0.5f), t * 0.2f);
+        shadow.Fit(cam, shadow_light);
+        for (unsigned int i = 0; i < cascades; i++)
+        {
+            auto &cascade = shadow.GetCascade(i);
+            outside += !slice_inside(cam, cascade);
+            if (light_vp(cascade) == last[i])
+                continue;
+            refits++;
+            last[i] = light_vp(cascade);
+            glm::vec3 origin = light_view * glm::vec4(cascade.center, 1.0f);
+            for (int k = 0; k < 2; k++)
+            {
+                float texels = origin[k] / cascade.texel;
+                unsnapped += std::abs(texels - std::round(texels)) > 1e-2f;
+            }
+        }
+    }
+    CHECK(outside == 0);
+    CHECK(unsnapped == 0);
+    // the walk has to leave the first boxes, or nothing was snapped
+    CHECK(refits > cascades);
+}
+
+// Moving by less than a texel keeps every box where it is, turning the
+// light refits all of them
+static void test_shadow_stable()
+{
+    CameraParameters cam = shadow_camera();
+    CascadedShadowMap shadow;
+    unsigned int cascades = shadow.CascadeCount();
+    shadow.Fit(cam, shadow_light);
+    std::vector<glm::mat4> first;
+    for (unsigned int i = 0; i < cascades; i++)
+        first.push_back(light_vp(shadow.GetCascade(i)));
+    place_camera(cam, glm::vec3(shadow.GetCascade(0).texel * 0.25f, 10.0f, 0.0f), 0.0f);
+    shadow.Fit(cam, shadow_light);
+    for (unsigned int i = 0; i < cascades; i++)
+        CHECK(light_vp(shadow.GetCascade(i)) == first[i]);
+    shadow.Fit(cam, shadow_light + glm::vec3(0.1f, 0.0f, 0.0f));
+    for (unsigned int i = 0; i < cascades; i++)
+        CHECK(light_vp(shadow.GetCascade(i)) != first[i]);
+}
+
+static std::vector<unsigned int> sorted_ids(const ObjectList &items)
+{
+    std::vector<unsigned int> ids;
+    for (auto &item : items)
+        ids.push_back(item->id);
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+// Ids of the casters, static or dynamic, a cascade box does not separate
+static std::vector<unsigned int> expected_casters(ShadowCascade &cascade, const std::vector<std::shared_ptr<RenderQueueItem>> &casters,
+                                                  bool is_static)
+{
+    std::vector<unsigned int> ids;
+    for (auto &item : casters)
+        if (item->is_static == is_static && cascade.camera.Test(item->args->box) != CameraParameters::FRUSTUM_SEPARATE)
+            ids.push_back(item->id);
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+static std::vector<std::shared_ptr<RenderQueueItem>> shadow_casters(unsigned int cnt)
+{
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> pos(-200.0f, 200.0f), size(1.0f, 5.0f);
+    std::vector<std::shared_ptr<RenderQueueItem>> casters;
+    for (unsigned int i = 0; i < cnt; i++)
+    {
+        glm::vec3 min(pos(rng), pos(rng) * 0.05f, pos(rng));
+        auto args = std::make_shared<common::RenderArguments>(glm::translate(glm::mat4(1.0f), min));
+        args->box = common::BoundingBox(min, min + size(rng), 1.0f);
+        auto item = std::make_shared<RenderQueueItem>(i + 1, nullptr, nullptr, args, 0);
+        // one in eight moves
+        item->is_static = i % 8 != 0;
+        casters.push_back(item);
+    }
+    return casters;
+}
+
+// Culling all cascades in one traversal finds exactly the casters testing
+// every object against each box finds, sorted into static and dynamic
+static void test_shadow_casters()
+{
+    CameraParameters cam = shadow_camera();
+    place_camera(cam, glm::vec3(0.0f, 10.0f, 0.0f), 0.7f);
+    CascadedShadowMap shadow;
+    shadow.Fit(cam, shadow_light);
+    auto casters = shadow_casters(20000);
+    RenderLayer layer;
+    auto inserted = casters;
+    layer.BulkInsert(OPAQUE_SHADOW, inserted);
+    for (int parallel = 0; parallel < 2; parallel++)
+    {
+        shadow.CullCasters(&layer, 1, parallel ? common::ThreadPool::GetInstance() : nullptr);
+        for (unsigned int i = 0; i < shadow.CascadeCount(); i++)
+        {
+            auto &cascade = shadow.GetCascade(i);
+            CHECK(!cascade.static_casters.empty() && !cascade.dynamic_casters.empty());
+            CHECK(sorted_ids(cascade.static_casters) == expected_casters(cascade, casters, true));
+            CHECK(sorted_ids(cascade.dynamic_casters) == expected_casters(cascade, casters, false));
+            // nothing was drawn yet on the first cull
+            CHECK(cascade.static_dirty == !parallel);
+        }
+    }
+}
+
+// Culling the same casters again and moving dynamic ones keeps the cached
+// static depth, moving a static caster drops it in exactly the cascades
+// that saw it before or after the move, refitting a box drops its own
+static void test_shadow_cache()
+{
+    CameraParameters cam = shadow_camera();
+    place_camera(cam, glm::vec3(0.0f, 10.0f, 0.0f), 0.7f);
+    CascadedShadowMap shadow;
+    unsigned int cascades = shadow.CascadeCount();
+    shadow.Fit(cam, shadow_light);
+    auto casters = shadow_casters(20000);
+    RenderLayer layer;
+    auto inserted = casters;
+    layer.BulkInsert(OPAQUE_SHADOW, inserted);
+    shadow.CullCasters(&layer, 1);
+
+    auto dirty = [&]() {
+        std::vector<bool> ret;
+        for (unsigned int i = 0; i < cascades; i++)
+            ret.push_back(shadow.GetCascade(i).static_dirty);
+        return ret;
+    };
+    auto sees = [&](unsigned int id) {
+        std::vector<bool> ret;
+        for (unsigned int i = 0; i < cascades; i++)
+        {
+            auto ids = sorted_ids(shadow.GetCascade(i).static_casters);
+            ret.push_back(std::binary_search(ids.begin(), ids.end(), id));
+        }
+        return ret;
+    };
+    auto move = [&](RenderQueueItem &item) {
+        item.args->box.min.y += 0.5f;
+        item.args->box.max.y += 0.5f;
+        layer.MarkDirty(item.id, OPAQUE_SHADOW);
+        layer.CommitUpdates();
+        shadow.CullCasters(&layer, 1);
+    };
+    const std::vector<bool> none(cascades, false);
+
+    shadow.CullCasters(&layer, 1);
+    CHECK(dirty() == none);
+
+    // a dynamic and a static caster of the nearest cascade
+    auto &near = shadow.GetCascade(0);
+    CHECK(!near.dynamic_casters.empty() && !near.static_casters.empty());
+    if (near.dynamic_casters.empty() || near.static_casters.empty())
+        return;
+    auto dynamic_item = near.dynamic_casters[0];
+    auto static_item = near.static_casters[0];
+    move(*dynamic_item);
+    CHECK(dirty() == none);
+
+    std::vector<bool> before = sees(static_item->id);
+    move(*static_item);
+    std::vector<bool> after = sees(static_item->id), expected;
+    for (unsigned int i = 0; i < cascades; i++)
+        expected.push_back(before[i] || after[i]);
+    CHECK(expected[0]);
+    CHECK(dirty() == expected);
+    shadow.CullCasters(&layer, 1);
+    CHECK(dirty() == none);
+
+    // a refit box has to draw its static casters again
+    shadow.Fit(cam, shadow_light + glm::vec3(0.1f, 0.0f, 0.0f));
+    shadow.CullCasters(&layer, 1);
+    CHECK(dirty() == std::vector<bool>(cascades, true));
+    shadow.Invalidate();
+    shadow.CullCasters(&layer, 1);
+    CHECK(dirty() == std::vector<bool>(cascades, true));
+}
+
+// Every object of the subtree of now lies in a node holding its current
+// box, the root aside once it can grow no more, and the counts match.
+// Returns the number of objects in the subtree, or -1.
+static int octree_consistent(RenderLayer &layer, RenderMode mode, node_id now)
+{
+    auto &tree = layer.GetQueue(mode);
+    auto &node = tree[now];
+    int cnt = node.content.objects.size();
+    for (auto &item : node.content.objects)
+        if (now != tree.Root() && node.box.LooseTest(item->args->box) != common::BoundingBox::BOX_INCLUDE)
+            return -1;
+    if (!node.IsLeaf())
+        for (node_id sub = node.subnodes; sub < node.subnodes + 8; sub++)
+        {
+            int sub_cnt = octree_consistent(layer, mode, sub);
+            if (sub_cnt < 0)
+                return -1;
+            cnt += sub_cnt;
+        }
+    return cnt == node.content.subtree_objcnt ? cnt : -1;
+}
+
+static std::shared_ptr<RenderQueueItem> make_box_item(unsigned int id, glm::vec3 min, float size)
+{
+    auto args = std::make_shared<common::RenderArguments>();
+    args->box = common::BoundingBox(min, min + size, 1.0f);
+    return std::make_shared<RenderQueueItem>(id, nullptr, nullptr, args, 0);
+}
+
+static bool query_finds(RenderLayer &layer, RenderQueueItem &item)
+{
+    RenderQueueItem *out[64];
+    unsigned int cnt = layer.QueryBox(OPAQUE, item.args->box, out, 64);
+    return std::find(out, out + std::min(cnt, 64u), &item) != out + std::min(cnt, 64u);
+}
+
+static void move_to(RenderQueueItem &item, glm::vec3 min)
+{
+    item.args->box.max = min + (item.args->box.max - item.args->box.min);
+    item.args->box.min = min;
+}
+
+// An object marked dirty keeps its mark when a neighbour splits or merges
+// its node before the commit, which then places it with its new box
+static void test_queue_dirty_restructure()
+{
+    RenderLayer layer;
+    std::vector<std::shared_ptr<RenderQueueItem>> items;
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        items.push_back(make_box_item(i + 1, glm::vec3(10.0f + i, 10.0f, 10.0f), 1.0f));
+        layer.InsertObject(OPAQUE, items.back());
+    }
+    CHECK(layer.GetQueue(OPAQUE)[layer.GetQueue(OPAQUE).Root()].IsLeaf());
+
+    // split by an insert, the moved object would go down by its old box
+    move_to(*items[0], glm::vec3(-40.0f, -40.0f, -40.0f));
+    layer.MarkDirty(items[0]->id, OPAQUE);
+    items.push_back(make_box_item(9, glm::vec3(20.0f, 10.0f, 10.0f), 1.0f));
+    layer.InsertObject(OPAQUE, items.back());
+    CHECK(!layer.GetQueue(OPAQUE)[layer.GetQueue(OPAQUE).Root()].IsLeaf());
+    layer.CommitUpdates();
+    CHECK(octree_consistent(layer, OPAQUE, layer.GetQueue(OPAQUE).Root()) == 9);
+    CHECK(query_finds(layer, *items[0]));
+
+    // merged by removes, the moved object would be pulled up by its old box
+    move_to(*items[1], glm::vec3(-40.0f, 30.0f, -40.0f));
+    layer.MarkDirty(items[1]->id, OPAQUE);
+    for (unsigned int i = 3; i < 9; i++)
+        layer.RemoveObject(items[i]->id, OPAQUE);
+    layer.CommitUpdates();
+    CHECK(octree_consistent(layer, OPAQUE, layer.GetQueue(OPAQUE).Root()) == 3);
+    CHECK(query_finds(layer, *items[0]) && query_finds(layer, *items[1]));
+
+    // split by a bulk insert and by a neighbour placed with UpdateObject
+    move_to(*items[2], glm::vec3(30.0f, -40.0f, 30.0f));
+    layer.MarkDirty(items[2]->id, OPAQUE);
+    std::vector<std::shared_ptr<RenderQueueItem>> more;
+    for (unsigned int i = 0; i < 16; i++)
+        more.push_back(make_box_item(100 + i, glm::vec3(-40.0f + i, -40.0f, -40.0f), 1.0f));
+    auto inserted = more;
+    layer.BulkInsert(OPAQUE, inserted);
+    move_to(*items[0], glm::vec3(5.0f, 5.0f, 5.0f));
+    layer.MarkDirty(items[0]->id, OPAQUE);
+    move_to(*more[0], glm::vec3(30.0f, -41.0f, 31.0f));
+    layer.UpdateObject(more[0]->id, OPAQUE);
+    layer.CommitUpdates();
+    CHECK(octree_consistent(layer, OPAQUE, layer.GetQueue(OPAQUE).Root()) == 19);
+    for (auto &item : {items[0], items[1], items[2], more[0]})
+        CHECK(query_finds(layer, *item));
+}
+
+// Opaque objects shaded without a prepass write depth with GL_LESS, those
+// with one only test against it, and transparent objects never write it
+static void test_small_opaque_depth()
+{
+    auto shader = std::make_shared<common::ShaderProgram>();
+    // draw ids are recorded as uniform 0, which tells the draws apart
+    shader->layout.draw_id = 0;
+    auto opaque = std::make_shared<TestMaterial>(shader, false);
+    auto transparent = std::make_shared<TestMaterial>(shader, false);
+    transparent->render_mode = common::RENDER_MODE_TRANSPARENT;
+    auto mesh = make_mesh(8, 36);
+
+    // 2 units cover thousands of pixels 20 away, 0.05 units a few
+    std::vector<std::shared_ptr<RenderQueueItem>> items;
+    std::vector<unsigned int> large_ids, small_ids, transparent_ids;
+    for (unsigned int i = 0; i < 24; i++)
+    {
+        float size = i % 3 == 1 ? 0.05f : 2.0f;
+        auto item = make_box_item(i + 1, glm::vec3(-12.0f + i, -1.0f, -20.0f - float(i % 3)), size);
+        item->args->model = glm::translate(glm::mat4(1.0f), item->args->box.min);
+        item->material = i % 3 == 2 ? transparent : opaque;
+        item->mesh = mesh;
+        item->vertex_cnt = mesh->indices.size();
+        (i % 3 == 2 ? transparent_ids : i % 3 == 1 ? small_ids : large_ids).push_back(item->id);
+        items.push_back(item);
+    }
+    auto &layer = RenderLayerManager::GetInstance()->layers[0];
+    for (auto &item : items)
+        layer.InsertObject(item->material == transparent ? TRANSPARENT : OPAQUE, item);
+
+    Renderer renderer;
+    auto recorder = std::make_shared<common::NullBackend>(true);
+    renderer.SetBackend(recorder);
+    renderer.SetShadows(false);
+    renderer.SetIndirectDraw(false);
+    renderer.SetInstancing(false);
+    renderer.UpdateView(glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f)), glm::vec3(0.0f), false);
+    renderer.UpdateProjection(glm::radians(60.0f), 1920.0f, 1080.0f, 0.1f, 500.0f, false);
+    renderer.Render();
+
+    CHECK(sorted_ids(renderer.GetPassList(PASS_DEPTH).items) == large_ids);
+    CHECK(sorted_ids(renderer.GetPassList(PASS_OPAQUE).items) == large_ids);
+    CHECK(sorted_ids(renderer.GetPassList(PASS_OPAQUE_SMALL).items) == small_ids);
+    CHECK(sorted_ids(renderer.GetPassList(PASS_TRANSPARENT).items) == transparent_ids);
+
+    // id of the item each draw id belongs to
+    std::vector<unsigned int> draw_item;
+    for (auto pass : {PASS_OPAQUE, PASS_OPAQUE_SMALL, PASS_TRANSPARENT})
+    {
+        auto &list = renderer.GetPassList(pass);
+        for (auto &batch : list.batches)
+            for (unsigned int i = 0; i < batch.count; i++)
+            {
+                draw_item.resize(std::max<size_t>(draw_item.size(), batch.first_draw + i + 1), 0);
+                draw_item[batch.first_draw + i] = list.items[batch.first + i]->id;
+            }
+    }
+    // color draws of each item with the depth state they ran with
+    bool depth_mask = true, color_mask = true;
+    unsigned int depth_func = GL_LESS, draw_id = ~0u;
+    std::vector<unsigned int> writing, testing, wrong;
+    for (auto &cmd : recorder->recorded.commands)
+    {
+        if (cmd.type == common::CMD_DEPTH_MASK)
+            depth_mask = cmd.args[0].u;
+        else if (cmd.type == common::CMD_COLOR_MASK)
+            color_mask = cmd.args[0].u;
+        else if (cmd.type == common::CMD_DEPTH_FUNC)
+            depth_func = cmd.args[0].u;
+        else if (cmd.type == common::CMD_UNIFORM_UINT && cmd.args[0].u == 0)
+            draw_id = cmd.args[1].u;
+        else if (cmd.type == common::CMD_DRAW_ELEMENTS && color_mask)
+        {
+            unsigned int id = draw_id < draw_item.size() ? draw_item[draw_id] : 0;
+            if (depth_mask && depth_func == GL_LESS)
+                writing.push_back(id);
+            else if (!depth_mask && depth_func == GL_LEQUAL)
+                testing.push_back(id);
+            else
+                wrong.push_back(id);
+            draw_id = ~0u;
+        }
+    }
+    std::sort(writing.begin(), writing.end());
+    std::sort(testing.begin(), testing.end());
+    std::vector<unsigned int> not_writing = large_ids;
+    not_writing.insert(not_writing.end(), transparent_ids.begin(), transparent_ids.end());
+    std::sort(not_writing.begin(), not_writing.end());
+    CHECK(writing == small_ids);
+    CHECK(testing == not_writing);
+    CHECK(wrong.empty());
+
+    for (auto &item : items)
+        layer.RemoveObject(item->id, item->material == transparent ? TRANSPARENT : OPAQUE);
+}
+
+int main()
+{
+    test_indirect_by_material();
+    test_indirect_own_program();
+    test_geometry_pool();
+    test_queue_dirty_restructure();
+    test_small_opaque_depth();
+    test_shadow_fit();
+    test_shadow_stable();
+    test_shadow_casters();
+    test_shadow_cache();
+    if (failures)
+        std::cout << failures << " checks failed" << std::endl;
+    else
+        std::cout << "all checks passed" << std::endl;
+    return failures ? 1 : 0;
+}